@@ -13,6 +13,34 @@
 #include "ap_utilities.h"
 
 
+//
+// Forward Declarations
+//
+void end_line(HTTPParser *parser, char *raw);
+int parse_start_line(HTTPParser *parser, char *raw);
+HTTPSpan *find_span(HTTPParser *parser, char *raw, const char *name);
+char *span_string(char *block, HTTPSpan span);
+HTTPHeader *block_headers(HTTPParser *parser, HTTPHeader *hdrs, char *block);
+BodyFraming body_framing(HTTPResponse *response);
+int decode_chunked(BodyDecoder *decoder, HTTPResponse *response, char *data,
+                   int length);
+void append_body(HTTPResponse *response, char *data, int length);
+void complete_body(BodyDecoder *decoder, HTTPResponse *response);
+int grow_buffer(Connection *connection);
+Connection *new_connection(int sockfd, ConnectionTable *connection_list);
+void free_connection(Connection *connection, ConnectionTable *connection_list);
+int header_block_length(HTTPResponse *response);
+void write_header_block(HTTPResponse *response, char *raw);
+int response_tail(HTTPResponse *response, int keep_alive, char *tail);
+
+
+//
+// Globals
+//
+__thread char *Spare_Buffers = NULL;  // each worker's IO_BUFFER_SIZE buffers,
+__thread int Spare_Count = 0;         // linked through their first bytes
+
+
 //
 // Implementation
 //
@@ -68,30 +96,31 @@ int connect_to_server(char *hostname, int port_num) {
 }
 
 
-int header_not_completed(char *raw, int raw_len) {
-    /* Returns 0 if request stored in raw was completed and 1 if not */
+int connect_nonblocking(struct in_addr *addr, int port_num) {
+    /* Starts connecting to the resolved address and returns the socket right
+     * away, the connect is done once the socket becomes writable */
 
-    // - header complete when last chars read are CRLF2 or CRCR or LFLF
-    //   (CRLF2, CRCR, LFLF are defined in the header file)
-    // - we check the above by string comparing the last chars to them. this
-    //   means, if the last chars are CRLF2 then strcmp == 0, hdr_togo = 0
-    //          if the last chars are CRCR then strcmp == 0, hdr_togo = 0
-    //          if the last chars are LFLF then strcmp == 0, hdr_togo = 0
-    //  if any of the above cases are hit, hdr_togo must be 0. therefore, we
-    //  && the cases together.
+    int sockfd;
+    struct sockaddr_in serveraddr;
+
+    if ((sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        error_declare("Couldn't open socket!");
+        return -1;
+    }
 
-    int hdr_togo = 1;
-    char *tmp;
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr = *addr;
+    serveraddr.sin_port = htons(port_num);
 
-    if ((tmp = strstr(raw, CRLF2)) != NULL) {
-        hdr_togo &= 0;
-    } else if ((tmp = strstr(raw, CRCR)) != NULL) {
-        hdr_togo &= 0;
-    } else if ((tmp = strstr(raw, LFLF)) != NULL) {
-        hdr_togo &= 0;
+    if (connect(sockfd, (const struct sockaddr*) &serveraddr,
+                sizeof(serveraddr)) < 0 && errno != EINPROGRESS) {
+        error_declare("Couldn't connect to the server!");
+        close(sockfd);
+        return -1;
     }
 
-    return hdr_togo;
+    return sockfd;
 }
 
 
@@ -150,6 +179,8 @@ int read_hdr(int sockfd, char **raw_ptr) {
         buf_size = BUFFER_SIZE, // buffer size
         hdr_togo = 1;           // is more of header to be read still?
     char *buffer, *raw = NULL;
+    HTTPParser parser;
+    init_parser(&parser, 0);
     if ((buffer = (char *) malloc(buf_size)) == NULL) {
         error_out("Couldn't malloc!");
     }
@@ -162,7 +193,7 @@ int read_hdr(int sockfd, char **raw_ptr) {
             memcpy(raw + readlen, buffer, last_read);
             readlen += last_read;
         }
-        hdr_togo = header_not_completed(raw, readlen);
+        hdr_togo = parse_header(&parser, raw, readlen) == PARSE_INCOMPLETE;
         bzero(buffer, buf_size);
     } while (last_read > 0 && hdr_togo);
 
@@ -188,48 +219,28 @@ int read_hdr(int sockfd, char **raw_ptr) {
 
 
 void free_hdr(HTTPHeader *hdr) {
-    /* Frees the HTTPHeader structure */
+    /* Frees the HTTPHeader structure, parsed headers go with their message */
 
     if (hdr) {
-        if (hdr->name) {
+        free_hdr(hdr->next);
+        if (!hdr->in_block) {
             free(hdr->name);
-            hdr->name = NULL;
-        }
-        if (hdr->value) {
             free(hdr->value);
-            hdr->value = NULL;
+            free(hdr);
         }
-        free_hdr(hdr->next);
-        free(hdr);
-        hdr = NULL;
     }
 }
 
 
 void free_request(HTTPRequest *request) {
-    /* Frees the HTTPRequest structure */
+    /* Frees the HTTPRequest structure, its strings and body are part of the
+     * same allocation (see parsed_request) */
 
     if (request) {
-        if (request->host) {
-            free(request->host);
-            request->host = NULL;
-        }
-        if (request->url) {
-            free(request->url);
-            request->url = NULL;
-        }
-        if (request->version) {
-            free(request->version);
-            request->version = NULL;
-        }
         if (request->hdrs) {
             free_hdr(request->hdrs);
             request->hdrs = NULL;
         }
-        if (request->body) {
-            free(request->body);
-            request->body = NULL;
-        }
         free(request);
         request = NULL;
     }
@@ -237,29 +248,16 @@ void free_request(HTTPRequest *request) {
 
 
 void free_response(HTTPResponse *response) {
-    /* Frees the HTTPResponse structure */
+    /* Frees the HTTPResponse structure, its status line is part of the same
+     * allocation (see parsed_response) */
 
     if (response) {
-        if (response->status) {
-            free(response->status);
-            response->status = NULL;
-        }
-        if (response->status_desc) {
-            free(response->status_desc);
-            response->status_desc = NULL;
-        }
-        if (response->version) {
-            free(response->version);
-            response->version = NULL;
-        }
         if (response->hdrs) {
             free_hdr(response->hdrs);
             response->hdrs = NULL;
         }
-        if (response->body) {
-            free(response->body);
-            response->body = NULL;
-        } 
+        free_body(response);
+        drop_header_block(response);
         
         for (int i = 0; i < NUM_KEYWORDS; i++) {
             if (response->keywords[i] != NULL) {
@@ -278,6 +276,61 @@ void free_response(HTTPResponse *response) {
 }
 
 
+void file_body(HTTPResponse *response) {
+    /* Moves a large body out of the heap into a memfd, so hits can send it
+     * with sendfile rather than through our memory. The body stays readable
+     * through a read-only mapping of it. If that fails it stays where it is */
+
+    char *mapped;
+    int fd, written = 0, last_write;
+
+    if (response->body == NULL || response->body_fd >= 0 ||
+            response->body_length < LARGE_BODY_BYTES) {
+        return;
+    }
+    if ((fd = memfd_create("pcs-body", MFD_CLOEXEC)) < 0) {
+        error_declare("Couldn't create a file for the body!");
+        return;
+    }
+
+    // its '\0' too, like the heap copy it is readable as a string
+    while (written <= response->body_length) {
+        if ((last_write = write(fd, response->body + written,
+                                response->body_length + 1 - written)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        written += last_write;
+    }
+    if (written <= response->body_length ||
+            (mapped = mmap(NULL, response->body_length + 1, PROT_READ,
+                           MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        error_declare("Couldn't move the body to a file!");
+        close(fd);
+        return;
+    }
+    free(response->body);
+    response->body = mapped;
+    response->body_fd = fd;
+}
+
+
+void free_body(HTTPResponse *response) {
+    /* Frees the response's body, wherever it is kept */
+
+    if (response->body_fd >= 0) {
+        munmap(response->body, response->body_length + 1);
+        close(response->body_fd);
+    } else {
+        free(response->body);
+    }
+    response->body = NULL;
+    response->body_fd = -1;
+}
+
+
 void display_request(HTTPRequest *request) {
     /* Displays the HTTPRequest structure */
 
@@ -329,574 +382,1707 @@ void display_response(HTTPResponse *response) {
 
 
 char *get_hdr_value(HTTPHeader *hdrs, const char *name) {
-    /* Get the value for the name from the hdrs */
+    /* Get a copy of the value for the name from the hdrs */
+
+    char *value = find_hdr(hdrs, name);
+
+    if (value != NULL && (value = strdup(value)) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+
+    return value;
+}
 
-    char *value = NULL;
+
+char *find_hdr(HTTPHeader *hdrs, const char *name) {
+    /* Get the value for the name from the hdrs, the first one if it is
+     * repeated. It isn't a copy, so it is only good as long as hdrs are */
 
     for (HTTPHeader *hdr = hdrs; hdr; hdr = hdr->next) {
-        size_t value_length = strcspn(hdr->value, "\0");
-        if (strcmp(hdr->name, name) == 0) {
-            int value_length = strcspn(hdr->value, EMPTY);
-            if ((value = (char *) malloc(value_length + 1)) == NULL) {
-                error_out("Couldn't malloc!");
-            }
-            memcpy(value, hdr->value, value_length);
-            value[value_length] = '\0';
+        // header field names are case-insensitive
+        if (strcasecmp(hdr->name, name) == 0) {
+            return hdr->value;
         }
     }
 
-    return value;
+    return NULL;
 }
 
 
-HTTPHeader *parse_headers(int *offset, char **raw_ptr) {
-    /* Parses the headers from the raw data and returns the length of the data
-     * parsed from the passed in raw parameter */
+void init_parser(HTTPParser *parser, int is_response) {
+    /* Readies the parser for a new message at the start of a buffer */
 
-    int length = 0;
-    char *raw = *raw_ptr;
-    HTTPHeader *hdr = NULL, *lst = NULL;
+    parser->state = IN_LINE;
+    parser->is_response = is_response;
+    parser->offset = 0;
+    parser->line = 0;
+    parser->line_end = 0;
+    parser->bare_cr = 0;
+    parser->length = 0;
+    parser->header_count = -1;
+}
 
-    while (strncmp(raw, CRLF, strlen(CRLF)) != 0) {
-        lst = hdr;
-        if ((hdr = (HTTPHeader *) malloc(sizeof(HTTPHeader))) == NULL) {
-            error_out("Couldn't malloc!");
+
+int parse_header(HTTPParser *parser, char *raw, int raw_len) {
+    /* Parses as much of the header at the start of raw as has arrived,
+     * picking up where the last call stopped. Returns the length of the
+     * header (up to and including the empty line that ends it) once it is
+     * complete, PARSE_INCOMPLETE if more is needed, or PARSE_MALFORMED.
+     * raw may hold more than the header (a body, pipelined requests) */
+
+    char *end;
+
+    while (parser->state == IN_LINE || parser->state == AFTER_CR) {
+        if (parser->offset > MAX_HEADER_BYTES) {
+            parser->state = MALFORMED;
+            break;
+        }
+        if (parser->offset >= raw_len) {
+            return PARSE_INCOMPLETE;
         }
 
-        // header field name
-        size_t name_length = strcspn(raw, ":");
-        if ((hdr->name = (char *) malloc(name_length + 1)) == NULL) {
-            error_out("Couldn't malloc!");
+        if (parser->state == IN_LINE) {
+            if ((end = scan_for(raw + parser->offset, raw_len - parser->offset,
+                                '\r', '\n')) == NULL) {
+                parser->offset = raw_len;
+                continue;
+            }
+            parser->line_end = end - raw;
+            parser->offset = parser->line_end + 1;
+
+            // an LF may follow a CR, except where lines end in a CR alone and
+            // this is the empty line that ends the header: nothing may follow
+            if (*end == '\r' &&
+                    !(parser->bare_cr && parser->line_end == parser->line)) {
+                parser->state = AFTER_CR;
+                continue;
+            }
+            parser->bare_cr = *end == '\r';
+        } else {
+            parser->bare_cr = raw[parser->offset] != '\n';
+            if (!parser->bare_cr) {
+                parser->offset++;
+            }
         }
-        memcpy(hdr->name, raw, name_length);
-        hdr->name[name_length] = '\0';
-        raw += name_length + 1;
-        length += name_length + 1;
-        while (*raw == ' ') {
-            raw++;
-            length++;
+
+        parser->state = IN_LINE;
+        end_line(parser, raw);
+        parser->line = parser->offset;
+    }
+
+    return parser->state == PARSED ? parser->length : PARSE_MALFORMED;
+}
+
+
+void end_line(HTTPParser *parser, char *raw) {
+    /* Takes in the line that was just found: the start line, a header or
+     * the empty line that ends them */
+
+    int start = parser->line, end = parser->line_end, name_end;
+    HTTPSpan *name, *value, *earlier;
+    long long length;
+    char *colon;
+
+    // empty lines before the start line are allowed (RFC 9112 2.2)
+    if (parser->header_count < 0) {
+        if (start < end) {
+            parser->header_count = 0;
+            if (parse_start_line(parser, raw) < 0) {
+                parser->state = MALFORMED;
+            }
         }
+        return;
+    }
+    if (start == end) {
+        // a length alongside a transfer coding is how a message is smuggled
+        // past whoever goes by the other one (RFC 9112 6.3)
+        parser->state = find_span(parser, raw, CONTENT_LENGTH) != NULL &&
+                        find_span(parser, raw, TRANSFER_ENCODING) != NULL ?
+                        MALFORMED : PARSED;
+        parser->length = parser->offset;
+        return;
+    }
 
-        // header field value
-        size_t value_length = strcspn(raw, CRLF);
-        if ((hdr->value = (char *) malloc(value_length + 1)) == NULL) {
-            error_out("Couldn't malloc!");
+    // a header folded onto more than one line is obsolete (RFC 9112 5.2), and
+    // there is no room for whitespace in a name
+    if (raw[start] == ' ' || raw[start] == '\t' ||
+            (colon = scan_for(raw + start, end - start, ':', ':')) == NULL ||
+            colon == raw + start || parser->header_count == MAX_HEADERS) {
+        parser->state = MALFORMED;
+        return;
+    }
+    name_end = colon - raw;
+    for (int i = start; i < name_end; i++) {
+        if ((unsigned char) raw[i] <= ' ' || raw[i] == 127) {
+            parser->state = MALFORMED;
+            return;
         }
-        memcpy(hdr->value, raw, value_length);
-        hdr->value[value_length] = '\0';
-        raw += value_length;
-        length += value_length;
-        if (strncmp(raw, CR, strlen(CR)) == 0) {
-            raw += strlen(CR);
-            length += strlen(CR);
+    }
+    name = &(parser->names[parser->header_count]);
+    value = &(parser->values[parser->header_count]);
+    name->offset = start;
+    name->length = name_end - start;
+
+    // the value is what is between the whitespace around it
+    start = name_end + 1;
+    while (start < end && (raw[start] == ' ' || raw[start] == '\t')) {
+        start++;
+    }
+    while (end > start && (raw[end - 1] == ' ' || raw[end - 1] == '\t')) {
+        end--;
+    }
+    value->offset = start;
+    value->length = end - start;
+
+    // the length decides where the body ends, so it has to make sense, fit
+    // in what we count bodies in and agree with any other we were given
+    if ((size_t) name->length == strlen(CONTENT_LENGTH) &&
+            strncasecmp(raw + name->offset, CONTENT_LENGTH, name->length) == 0) {
+        for (int i = start; i < end; i++) {
+            if (raw[i] < '0' || raw[i] > '9') {
+                start = end;
+                break;
+            }
         }
-        if (strncmp(raw, LF, strlen(LF)) == 0) {
-            raw += strlen(LF);
-            length += strlen(LF);
+        errno = 0;
+        length = strtoll(raw + start, NULL, 10);
+        if (start == end || length > MAX_CONTENT_LENGTH || errno == ERANGE ||
+                ((earlier = find_span(parser, raw, CONTENT_LENGTH)) != NULL &&
+                 strtoll(raw + earlier->offset, NULL, 10) != length)) {
+            parser->state = MALFORMED;
+            return;
         }
+    }
+    parser->header_count++;
+}
 
-        // add to the header if its not the age header
-        if (strcmp(hdr->name, AGE)) {
-            hdr->next = lst;
-        } else {
-            free_hdr(hdr);
+
+int parse_start_line(HTTPParser *parser, char *raw) {
+    /* Splits the start line into its three parts. Returns -1 if it isn't
+     * one: a request has to have a method, a target and a version, a
+     * response a version and a three digit status (the description may be
+     * left out) */
+
+    int start = parser->line, end = parser->line_end;
+    char *first, *second = NULL;
+
+    if ((first = memchr(raw + start, ' ', end - start)) != NULL) {
+        second = memchr(first + 1, ' ', raw + end - first - 1);
+    }
+    if (first == NULL || (second == NULL && !parser->is_response)) {
+        return -1;
+    }
+    if (second == NULL) {
+        second = raw + end;
+    }
+    parser->start[0].offset = start;
+    parser->start[0].length = first - raw - start;
+    parser->start[1].offset = first + 1 - raw;
+    parser->start[1].length = second - first - 1;
+    parser->start[2].offset = second < raw + end ? second + 1 - raw : end;
+    parser->start[2].length = end - parser->start[2].offset;
+
+    if (parser->is_response) {
+        return parser->start[0].length > 5 &&
+               strncmp(raw + start, "HTTP/", 5) == 0 &&
+               parser->start[1].length == 3 &&
+               raw[parser->start[1].offset] >= '1' &&
+               raw[parser->start[1].offset] <= '5' &&
+               raw[parser->start[1].offset + 1] >= '0' &&
+               raw[parser->start[1].offset + 1] <= '9' &&
+               raw[parser->start[1].offset + 2] >= '0' &&
+               raw[parser->start[1].offset + 2] <= '9' ? 0 : -1;
+    }
+    return parser->start[0].length > 0 && parser->start[1].length > 0 &&
+           parser->start[2].length > 5 &&
+           strncmp(raw + parser->start[2].offset, "HTTP/", 5) == 0 &&
+           memchr(raw + parser->start[2].offset, ' ',
+                  parser->start[2].length) == NULL ? 0 : -1;
+}
+
+
+HTTPSpan *find_span(HTTPParser *parser, char *raw, const char *name) {
+    /* Returns where the value for the name is in raw, the first one if it
+     * is repeated, for before the header has been copied out of it */
+
+    size_t name_length = strlen(name);
+
+    for (int i = 0; i < parser->header_count; i++) {
+        if ((size_t) parser->names[i].length == name_length &&
+                strncasecmp(raw + parser->names[i].offset, name, name_length) == 0) {
+            return &(parser->values[i]);
         }
     }
 
-    // move the buffer and set the offset
-    *raw_ptr = raw;
-    *offset += length;
+    return NULL;
+}
+
 
-    return hdr;
+char *span_string(char *block, HTTPSpan span) {
+    /* Returns the span of the copy of the header in block as a string. What
+     * follows a span in the header is a delimiter, so it can be ended there */
+
+    block[span.offset + span.length] = '\0';
+    return block + span.offset;
 }
 
 
-HTTPRequest *parse_request(int length, char *raw) {
-    /* Parses and returns the raw data as a HTTPRequest structure */
+HTTPHeader *block_headers(HTTPParser *parser, HTTPHeader *hdrs, char *block) {
+    /* Links up the headers the parser found, in the order they came in.
+     * hdrs has room for all of them, their strings are in block */
+
+    for (int i = 0; i < parser->header_count; i++) {
+        hdrs[i].name = span_string(block, parser->names[i]);
+        hdrs[i].value = span_string(block, parser->values[i]);
+        hdrs[i].next = i + 1 < parser->header_count ? &(hdrs[i + 1]) : NULL;
+        hdrs[i].in_block = 1;
+    }
+
+    return parser->header_count > 0 ? hdrs : NULL;
+}
+
+
+HTTPRequest *parsed_request(HTTPParser *parser, char *raw, int length) {
+    /* Returns the request whose header the parser has parsed, the first
+     * length bytes of raw being the request as a whole. Everything in it,
+     * the header copied once and its strings pointing into the copy, comes
+     * in one allocation along with it (see free_request) */
 
-    int offset = 0;
-    char *host;
     HTTPRequest *request;
-    if ((request = (HTTPRequest *) malloc(sizeof(HTTPRequest))) == NULL) {
+    HTTPHeader *hdrs;
+    HTTPSpan *host_span;
+    char *block, *host, *method;
+    size_t host_length;
+    int count = parser->header_count;
+
+    // the Host header's value stays as it is, the host without its port
+    // gets a copy of its own at the end
+    host_span = find_span(parser, raw, HOST);
+    if ((request = (HTTPRequest *) malloc(sizeof(HTTPRequest) +
+                                          count * sizeof(HTTPHeader) + length +
+                                          (host_span ? host_span->length : 0) +
+                                          2)) == NULL) {
         error_out("Couldn't malloc!");
     }
+    hdrs = (HTTPHeader *) (request + 1);
+    block = (char *) (hdrs + count);
+    memcpy(block, raw, length);
+    block[length] = '\0';
 
     // set the method, add new methods here (Eg. CONNECT)
-    size_t method_length = strcspn(raw, " ");
-    if (strncmp(raw, GET_RQ, strlen(GET_RQ)) == 0) {
+    method = span_string(block, parser->start[0]);
+    if (strcmp(method, GET_RQ) == 0) {
         request->method = GET;
-    } else if (strncmp(raw, CONNECT_RQ, strlen(CONNECT_RQ)) == 0) {
+    } else if (strcmp(method, CONNECT_RQ) == 0) {
         request->method = CONNECT;
-    } else if (strncmp(raw, OPTIONS_RQ, strlen(OPTIONS_RQ)) == 0) {
+    } else if (strcmp(method, OPTIONS_RQ) == 0) {
         request->method = OPTIONS;
-    }
-    else {
+    } else {
         request->method = UNSUPPORTED;
     }
-    raw += method_length + 1;
-    offset += method_length + 1;
-
-    // set the URI
-    size_t uri_length = strcspn(raw, " ");
-    if ((request->url = (char *) malloc(uri_length + 1)) == NULL) {
-        free_request(request);
-        error_out("Couldn't malloc!");
-    }
-    memcpy(request->url, raw, uri_length);
-    request->url[uri_length] = '\0';
-    raw += uri_length + 1;
-    offset += uri_length + 1;
-
-    // set the HTTP-Version
-    size_t ver_length = strcspn(raw, CRLF);
-    if ((request->version = (char *) malloc(ver_length + 1)) == NULL) {
-        free_request(request);
-        error_out("Couldn't malloc!");
-    }
-    memcpy(request->version, raw, ver_length);
-    request->version[ver_length] = '\0';
-    raw += ver_length;
-    offset += ver_length;
-    if (strncmp(raw, CR, strlen(CR)) == 0) {
-        raw += strlen(CR);
-        offset += strlen(CR);
-    }
-    if (strncmp(raw, LF, strlen(LF)) == 0) {
-        raw += strlen(LF);
-        offset += strlen(LF);
-    }
-
-    // set the hdrs
-    request->hdrs = parse_headers(&offset, &raw);
-    if (strncmp(raw, CR, strlen(CR)) == 0) {
-        raw += strlen(CR);
-        offset += strlen(CR);
-    }
-    if (strncmp(raw, LF, strlen(LF)) == 0) {
-        raw += strlen(LF);
-        offset += strlen(LF);
-    }
+    request->url = span_string(block, parser->start[1]);
+    request->version = span_string(block, parser->start[2]);
+    request->hdrs = block_headers(parser, hdrs, block);
 
     // extract host and port if there is "Host" header otherwise keep defaults
     request->host = request->url;
     request->port = DEFAULT_HTTP_PORT;
-    if ((host = get_hdr_value(request->hdrs, HOST)) != NULL) {
-        size_t value_length = strcspn(host, EMPTY),
-               host_length = strcspn(host, COLON);
-        if (value_length != host_length) {
-            request->port = atoi(host + host_length + 1);
-        }
-        if ((request->host = (char *) malloc(host_length + 1)) == NULL) {
-            free_request(request);
-            error_out("Couldn't malloc!");
-        }
+    if ((host = find_hdr(request->hdrs, HOST)) != NULL) {
+        host_length = strcspn(host, COLON);
+        request->host = block + length + 1;
         memcpy(request->host, host, host_length);
         request->host[host_length] = '\0';
+        if (host[host_length] != '\0') {
+            request->port = atoi(host + host_length + 1);
+        }
     }
 
-    // set the body
-    request->body_length = length - offset;
-    if ((request->body = (char *) malloc(request->body_length)) == NULL) {
-        free_request(request);
-        error_out("Couldn't malloc!");
-    }
-    memcpy(request->body, raw, request->body_length);
+    // whatever follows the header is the body
+    request->body = block + parser->length;
+    request->body_length = length - parser->length;
 
     return request;
 }
 
 
-HTTPResponse *parse_response(int length, char *raw) {
-    /* Parses and returns the raw data as an HTTPResponse structure */
+HTTPResponse *parsed_response(HTTPParser *parser, char *raw) {
+    /* Returns the response whose header the parser has parsed from the start
+     * of raw. Like a request its header comes in one allocation with it, the
+     * body has its own since it is filled in as it arrives (see decode_body) */
 
-    int offset = 0;
     HTTPResponse *response;
-    if ((response = (HTTPResponse *) malloc(sizeof(HTTPResponse))) == NULL) {
-        error_out("Couldn't malloc!");
-    }
+    HTTPHeader *hdrs;
+    char *block, *age, *date;
+    int count = parser->header_count;
 
-    // set the HTTP-Version
-    size_t ver_length = strcspn(raw, " ");
-    if ((response->version = (char *) malloc(ver_length + 1)) == NULL) {
-        free_response(response);
+    if ((response = (HTTPResponse *) malloc(sizeof(HTTPResponse) +
+                                            count * sizeof(HTTPHeader) +
+                                            parser->length + 1)) == NULL) {
         error_out("Couldn't malloc!");
     }
-    memcpy(response->version, raw, ver_length);
-    response->version[ver_length] = '\0';
-    raw += ver_length + 1;
-    offset += ver_length + 1;
-
-    // set the status
-    size_t status_length = strcspn(raw, " ");
-    if ((response->status = (char *) malloc(status_length + 1)) == NULL) {
-        free_response(response);
-        error_out("Couldn't malloc!");
+    hdrs = (HTTPHeader *) (response + 1);
+    block = (char *) (hdrs + count);
+    memcpy(block, raw, parser->length);
+    block[parser->length] = '\0';
+    response->version = span_string(block, parser->start[0]);
+    response->status = span_string(block, parser->start[1]);
+    response->status_desc = span_string(block, parser->start[2]);
+    response->hdrs = block_headers(parser, hdrs, block);
+
+    // make room for the start of the body, it grows as the rest comes in
+    // (the response may well not be kept, see free_body)
+    switch (body_framing(response)) {
+    case NO_BODY:
+        response->total_body_length = 0;
+        break;
+    case BY_LENGTH:
+        // end_line made sure it fits
+        response->total_body_length = strtol(find_hdr(response->hdrs, CONTENT_LENGTH),
+                                             NULL, 10);
+        break;
+    default:
+        response->total_body_length = -1;
     }
-    memcpy(response->status, raw, status_length);
-    response->status[status_length] = '\0';
-    raw += status_length + 1;
-    offset += status_length + 1;
-
-    // set the status description
-    size_t status_desc_length = strcspn(raw, CRLF);
-    if ((response->status_desc = (char *) malloc(status_desc_length + 1))
-            == NULL) {
-        free_response(response);
+    response->body_room = response->total_body_length >= 0 &&
+                          response->total_body_length < INITIAL_BODY_ROOM ?
+                          response->total_body_length + 1 : INITIAL_BODY_ROOM;
+    if ((response->body = (char *) malloc(response->body_room)) == NULL) {
         error_out("Couldn't malloc!");
     }
-    memcpy(response->status_desc, raw, status_desc_length);
-    response->status_desc[status_desc_length] = '\0';
-    raw += status_desc_length;
-    offset += status_desc_length;
-    if (strncmp(raw, CR, strlen(CR)) == 0) {
-        raw += strlen(CR);
-        offset += strlen(CR);
-    }
-    if (strncmp(raw, LF, strlen(LF)) == 0) {
-        raw += strlen(LF);
-        offset += strlen(LF);
+    response->body[0] = '\0';
+    response->body_length = 0;
+    response->body_fd = -1;
+    for (int i = 0; i < NUM_KEYWORDS; i++) {
+        response->keywords[i] = NULL;
     }
 
-    // set the hdrs
-    response->hdrs = parse_headers(&offset, &raw);
-    if (strncmp(raw, CR, strlen(CR)) == 0) {
-        raw += strlen(CR);
-        offset += strlen(CR);
+    // set the fetch time, and how old the response was by then: what the
+    // caches before us say or how long ago the server sent it, if more
+    response->time_fetched = time(NULL);
+    response->initial_age = 0;
+    response->fetch_latency = 0;
+    response->header_block = NULL;
+    response->header_block_length = 0;
+    age = find_hdr(response->hdrs, AGE);
+    date = find_hdr(response->hdrs, DATE);
+    time_t sent = date != NULL ? curl_getdate(date, NULL) : -1;
+    if (age != NULL && atoi(age) > 0) {
+        response->initial_age = atoi(age);
     }
-    if (strncmp(raw, LF, strlen(LF)) == 0) {
-        raw += strlen(LF);
-        offset += strlen(LF);
+    if (sent > 0 && response->time_fetched - sent > response->initial_age) {
+        response->initial_age = response->time_fetched - sent;
     }
 
-    // set the body
-    response->total_body_length = atoi(get_hdr_value(response->hdrs, CONTENT_LENGTH));
-    response->body = (char *) malloc(response->total_body_length + 1);
-    if (length - offset > 0) {
-        memcpy(response->body, raw, length - offset);
-        response->body_length = length - offset;
-    }
-    response->body[response->total_body_length] = '\0';
+    return response;
+}
 
-    // set the fetch time
-    response->time_fetched = time(NULL);
 
+HTTPRequest *parse_request(int length, char *raw) {
+    /* Parses and returns the raw data as a HTTPRequest structure, NULL if it
+     * isn't a complete request */
+
+    HTTPParser parser;
 
-    return response;
+    init_parser(&parser, 0);
+    if (parse_header(&parser, raw, length) <= 0) {
+        return NULL;
+    }
+
+    return parsed_request(&parser, raw, length);
 }
 
 
-int write_to_socket(int sockfd, char *buffer, int buffer_length) {
-    /* Write to the given socket and return the length of the written data */
+HTTPResponse *parse_response(int length, char *raw) {
+    /* Parses and returns the raw data as an HTTPResponse structure, with as
+     * much of its body as there is. NULL if its header isn't complete */
 
-    int writelen = 0;
+    HTTPParser parser;
+    BodyDecoder decoder;
+    HTTPResponse *response;
 
-    if ((writelen = write(sockfd, buffer, buffer_length)) < 0) {
-        error_declare("Couldn't write to the socket!");
+    init_parser(&parser, 1);
+    if (parse_header(&parser, raw, length) <= 0) {
+        return NULL;
     }
+    response = parsed_response(&parser, raw);
+    init_decoder(&decoder, response);
+    decode_body(&decoder, response, raw + parser.length, length - parser.length);
 
-    return writelen;
+    return response;
 }
 
 
-int construct_response(HTTPResponse *response, char **raw_ptr) {
-    /* Reconstructs a response into the provided buffer */
-    // TODO: THIS IS VERY INEFFICIENT (many reallocs)
-    //       consider calculating total memory we need in the start and then
-    //       parsing it as needed
+BodyFraming body_framing(HTTPResponse *response) {
+    /* Returns how the end of the response's body is found. A transfer coding
+     * other than chunked can only be ended by the server closing */
 
-    // setup
-    int response_length = 0;
-    char *raw = NULL;
+    char *transfer_encoding = find_hdr(response->hdrs, TRANSFER_ENCODING);
 
-    // move the HTTP Version into raw
-    int version_length = strlen(response->version);
-    if ((raw = (char *) realloc(raw, version_length + 1)) == NULL) {
-        free_response(response);
-        error_out("Couldn't realloc!");    
-    }
-    memcpy(raw, response->version, version_length);
-    raw[version_length] = ' ';
-    response_length = version_length + 1;
-
-    // move the Status into raw
-    int status_length = strlen(response->status);
-    if ((raw = (char *) realloc(raw, response_length + status_length + 1))
-            == NULL) {
-        free_response(response);
-        error_out("Couldn't realloc!");            
-    }
-    memcpy(raw + response_length, response->status, status_length);
-    raw[response_length + status_length] = ' ';
-    response_length += status_length + 1;
-
-    // move the Status Description into raw
-    int status_desc_length = strlen(response->status_desc);
-    if ((raw = (char *) realloc(raw, response_length + status_desc_length + 1))
-            == NULL) {
-        free_response(response);
-        error_out("Couldn't realloc!");
-    }
-    memcpy(raw + response_length, response->status_desc, status_desc_length);
-    raw[response_length + status_desc_length] = ' ';
-    response_length += status_desc_length + 1;
-
-    // CRLF
-    int crlf_length = strlen(CRLF);
-    if ((raw = (char *) realloc(raw, response_length + crlf_length)) == NULL) {
-        free_response(response);
-        error_out("Couldn't realloc!");
+    if (response->status[0] == '1' || strcmp(response->status, "204") == 0 ||
+            strcmp(response->status, "304") == 0) {
+        return NO_BODY;
+    }
+    if (transfer_encoding != NULL) {
+        return strcasestr(transfer_encoding, "chunked") != NULL ? CHUNKED :
+                                                                 BY_CLOSE;
     }
-    memcpy(raw + response_length, CRLF, crlf_length);
-    response_length += crlf_length;
 
-    // move header into raw
-    for (HTTPHeader *hdr = response->hdrs; hdr; hdr = hdr->next) {
-        int name_length = strlen(hdr->name);
-        int value_length = strlen(hdr->value);
-        if ((raw = (char *) realloc(raw, response_length + name_length + 2 +
-                                    value_length + crlf_length)) == NULL) {
-            free_response(response);
-            error_out("Couldn't realloc!");
-        }
-        // move name into raw
-        memcpy(raw + response_length, hdr->name, name_length);
-        response_length += name_length;
-        // add separator between name and value
-        raw[response_length] = ':';
-        raw[response_length + 1] = ' ';
-        response_length += 2;
-        // move value into raw
-        memcpy(raw + response_length, hdr->value, value_length);
-        response_length += value_length;
-        // add crlf at the end of the header
-        memcpy(raw + response_length, CRLF, crlf_length);
-        response_length += crlf_length;
-    }
-
-    // add age to header
-    int age = time(NULL) - response->time_fetched;
-    int name_length = strlen(AGE);
-    int value_length = snprintf( NULL, 0, "%d", age);
-    char age_string[value_length];
-    sprintf(age_string, "%d", age);
-    if ((raw = (char *) realloc(raw, response_length + name_length + 2 +
-                                value_length + 2 * crlf_length)) == NULL) {
-        free_response(response);
-        error_out("Couldn't realloc!");
-    }
-    memcpy(raw + response_length, AGE, name_length);
-    response_length += name_length;
-    raw[response_length] = ':';
-    raw[response_length + 1] = ' ';
-    response_length += 2;
-    memcpy(raw + response_length, age_string, value_length);
-    response_length += value_length;
-    memcpy(raw + response_length, CRLF, crlf_length);
-    response_length += crlf_length;
-
-    // CRLF
-    memcpy(raw + response_length, CRLF, crlf_length);
-    response_length += crlf_length;
-
-    // move the body into raw
-    if ((raw = (char *) realloc(raw, response_length + response->body_length))
-            == NULL) {
-        free_response(response);
-        error_out("Couldn't realloc!");
-    }
-    memcpy(raw + response_length, response->body, response->body_length);
-    response_length += response->body_length;
+    return find_hdr(response->hdrs, CONTENT_LENGTH) != NULL ? BY_LENGTH : BY_CLOSE;
+}
 
-    // set the requested pointer to our data
-    *raw_ptr = raw;
 
-    return response_length;
-}
+void init_decoder(BodyDecoder *decoder, HTTPResponse *response) {
+    /* Sets the decoder up for the body that follows the response's header */
 
+    decoder->framing = body_framing(response);
+    decoder->state = CHUNK_SIZE;
+    decoder->size_digits = 0;
+    decoder->chunk_left = 0;
+    decoder->line_length = 0;
+}
 
-int read_sockfd(int sockfd, char *buffer, Connection *connection) {
-    /* Reads from the socket and stores it in the partial buffer of the
-     * connection */
 
-    int last_read = 0;
-    bzero(buffer, BUFFER_SIZE);
+int decode_body(BodyDecoder *decoder, HTTPResponse *response, char *data,
+                int length) {
+    /* Takes the next length bytes of the response's body as the server sent
+     * them and adds what they hold to its body. Returns BODY_COMPLETE once
+     * all of it is in, PARSE_INCOMPLETE while more is to come and
+     * PARSE_MALFORMED if its chunks are broken. Whatever follows the body is
+     * ignored */
 
-    if ((last_read = read(sockfd, buffer, BUFFER_SIZE)) < 0) {
-        error_declare("Couldn't read from client socket!");
-        return -1;
-    }
+    int take, status = BODY_COMPLETE;
 
-    if (last_read > 0) {
-        if ((connection->raw = (char *) realloc(connection->raw,
-                connection->read_len + last_read)) == NULL) {
-            error_declare("Couldn't realloc!");
-            clear_connection(connection);
-            return -1;
+    if (decoder->framing == BY_LENGTH) {
+        take = response->total_body_length - response->body_length;
+        append_body(response, data, length < take ? length : take);
+        if (response->body_length < response->total_body_length) {
+            return PARSE_INCOMPLETE;
         }
-        memcpy(connection->raw + connection->read_len, buffer, last_read);
-        connection->read_len += last_read;
+    } else if (decoder->framing == CHUNKED) {
+        if ((status = decode_chunked(decoder, response, data, length)) !=
+                BODY_COMPLETE) {
+            return status;
+        }
+    } else if (decoder->framing == BY_CLOSE) {
+        append_body(response, data, length);
+        return PARSE_INCOMPLETE;
     }
+    complete_body(decoder, response);
 
-    return last_read;
+    return BODY_COMPLETE;
 }
 
 
-int accept_client(int proxy) {
-    /* Accepts a new client and returns its sockfd */
-    
-    int sockfd;
-    struct sockaddr_in address;
-    socklen_t addr_len = sizeof(address);
-    struct timeval tv;
-    tv.tv_sec = TIMEOUT_INTERVAL;
-    tv.tv_usec = 0;
+int end_body(BodyDecoder *decoder, HTTPResponse *response) {
+    /* The server closed the connection. Returns BODY_COMPLETE if that is
+     * where the body ends, PARSE_MALFORMED if it was cut short */
 
-    if ((sockfd = accept(proxy, (struct sockaddr*) &address, &addr_len)) < 0) {
-        error_declare("Server cannot accept incoming connections!");
+    if (decoder->framing != BY_CLOSE) {
+        return PARSE_MALFORMED;
     }
+    complete_body(decoder, response);
 
-    return sockfd;
+    return BODY_COMPLETE;
 }
 
 
-int add_client(int proxy, Connection **connection_list) {
-    /* Adds client to connection_list */
+int decode_chunked(BodyDecoder *decoder, HTTPResponse *response, char *data,
+                   int length) {
+    /* Decodes the next length bytes of a chunked body (RFC 9112 7.1), see
+     * decode_body. Like the header, lines may end in a bare LF */
 
-    int n;
+    int i = 0, take, digit;
+    char c;
 
-    if ((n = accept_client(proxy)) < 0) {
-        error_declare("Cannot accept client!");
-    } else {
-        n = add_client_connection(n, connection_list);
+    while (i < length && decoder->state != CHUNK_DONE) {
+
+        // the data is taken as a whole, everything else a byte at a time
+        if (decoder->state == CHUNK_DATA) {
+            take = length - i < decoder->chunk_left ? length - i : decoder->chunk_left;
+            append_body(response, data + i, take);
+            decoder->chunk_left -= take;
+            i += take;
+            if (decoder->chunk_left == 0) {
+                decoder->state = CHUNK_DATA_END;
+            }
+            continue;
+        }
+        c = data[i++];
+        digit = c >= '0' && c <= '9' ? c - '0' :
+                c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+
+        if (decoder->state == CHUNK_SIZE && digit >= 0) {
+            // a chunk bigger than a body can be is as good as malformed
+            if (decoder->chunk_left > (INT_MAX >> 4)) {
+                return PARSE_MALFORMED;
+            }
+            decoder->chunk_left = decoder->chunk_left * 16 + digit;
+            decoder->size_digits++;
+        } else if (decoder->state == CHUNK_SIZE && decoder->size_digits > 0 &&
+                   (c == ';' || c == ' ' || c == '\t' || c == '\r')) {
+            decoder->state = CHUNK_EXTENSION;
+        } else if ((decoder->state == CHUNK_SIZE && decoder->size_digits > 0 &&
+                    c == '\n') ||
+                   (decoder->state == CHUNK_EXTENSION && c == '\n')) {
+            // the last chunk is the one of size 0, then come the trailers
+            decoder->state = decoder->chunk_left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+        } else if (decoder->state == CHUNK_EXTENSION) {
+            continue;
+        } else if ((decoder->state == CHUNK_DATA_END && c == '\n') ||
+                   (decoder->state == CHUNK_DATA_LF && c == '\n')) {
+            decoder->state = CHUNK_SIZE;
+            decoder->size_digits = 0;
+        } else if (decoder->state == CHUNK_DATA_END && c == '\r') {
+            decoder->state = CHUNK_DATA_LF;
+        } else if (decoder->state == CHUNK_TRAILER) {
+            if (c == '\n' && decoder->line_length == 0) {
+                decoder->state = CHUNK_DONE;
+            } else if (c == '\n') {
+                decoder->line_length = 0;
+            } else if (c != '\r') {
+                decoder->line_length++;
+            }
+        } else {
+            return PARSE_MALFORMED;
+        }
     }
 
-    return n;
+    return decoder->state == CHUNK_DONE ? BODY_COMPLETE : PARSE_INCOMPLETE;
 }
 
 
-int add_server(int proxy, int client, HTTPRequest *request,
-               Connection **connection_list) {
-    /* Adds server to connection_list */
+void append_body(HTTPResponse *response, char *data, int length) {
+    /* Adds to the response's body, making room for it as it goes. A body we
+     * aren't keeping (NULL) is only counted */
 
-    int n;
+    int needed = response->body_length + length + 1;
 
-    if ((n = connect_to_server(request->host, request->port)) < 0) {
-        error_declare("Cannot connect to the server!");
-    } else {
-        n = add_server_connection(n, client, request, connection_list);
-    }
+    if (response->body != NULL) {
+        if (needed > response->body_room) {
 
-    return n;
+            // doubling, though never past the length we were told to expect
+            while (needed > response->body_room) {
+                response->body_room = response->body_room > MAX_CONTENT_LENGTH / 2 ?
+                                      needed : response->body_room * 2;
+            }
+            if (response->total_body_length >= needed - 1 &&
+                    response->body_room > response->total_body_length + 1) {
+                response->body_room = response->total_body_length + 1;
+            }
+            if ((response->body = (char *) realloc(response->body,
+                                                   response->body_room)) == NULL) {
+                error_out("Couldn't realloc!");
+            }
+        }
+        memcpy(response->body + response->body_length, data, length);
+        response->body[response->body_length + length] = '\0';
+    }
+    response->body_length += length;
 }
 
 
-int add_client_connection(int requesting_sockfd, Connection **connection_list) {
-    /* Adds connection to our connection list
-     * NOTE: -1 means we couldn't add to our connection list */
+void complete_body(BodyDecoder *decoder, HTTPResponse *response) {
+    /* The body is all in. Whatever framed it on the way here, it is kept and
+     * sent on from the cache with its length */
 
-    Connection *connection;
+    char length[16];
 
-    if ((connection = (Connection *) malloc(sizeof(Connection))) == NULL) {
-        error_declare("Couldn't malloc!");
-        return -1;
+    response->total_body_length = response->body_length;
+    if (decoder->framing == CHUNKED || decoder->framing == BY_CLOSE) {
+        remove_hdr(&(response->hdrs), TRANSFER_ENCODING);
+        snprintf(length, sizeof(length), "%d", response->body_length);
+        set_hdr(&(response->hdrs), CONTENT_LENGTH, length);
     }
-    connection->requesting_sockfd = requesting_sockfd;
-    connection->target_sockfd = -1;
-    connection->raw = NULL;
-    connection->read_len = 0;
-    // connection->got_header = 0;
-    connection->request = NULL;
-    connection->response = NULL;
-    HASH_ADD_INT(*connection_list, requesting_sockfd, connection);
+}
 
-    return requesting_sockfd;
+
+int is_hop_by_hop(const char *name) {
+    /* Returns 1 if the header only applies to a single connection and must
+     * not be forwarded */
+
+    return strcasecmp(name, CONNECTION) == 0 ||
+           strcasecmp(name, PROXY_CONNECTION) == 0 ||
+           strcasecmp(name, KEEP_ALIVE) == 0;
 }
 
 
-int add_server_connection(int requesting_sockfd, int target_sockfd,
-                          HTTPRequest *request, Connection **connection_list) {
-    /* Adds connection to our connection list
-     * NOTE: -1 means we couldn't add to our connection list */
+int is_persistent(char *version, HTTPHeader *hdrs) {
+    /* Returns 1 if the connection a message came in on stays open after it:
+     * HTTP/1.1 unless told to close, HTTP/1.0 only if told to keep alive */
 
-    Connection *connection;
+    int persistent = strcmp(version, HTTP_1_1) == 0;
+    char *value = find_hdr(hdrs, CONNECTION);
 
-    if ((connection = (Connection *) malloc(sizeof(Connection))) == NULL) {
-        error_declare("Couldn't malloc!");
-        return -1;
+    if (value == NULL) {
+        value = find_hdr(hdrs, PROXY_CONNECTION);
+    }
+    if (value != NULL) {
+        if (strcasestr(value, "close") != NULL) {
+            persistent = 0;
+        } else if (strcasestr(value, "keep-alive") != NULL) {
+            persistent = 1;
+        }
     }
-    connection->requesting_sockfd = requesting_sockfd;
-    connection->target_sockfd = target_sockfd;
-    connection->raw = NULL;
-    connection->read_len = 0;
-    // connection->got_header = 0;
-    connection->request = request;
-    connection->response = NULL;
-    HASH_ADD_INT(*connection_list, requesting_sockfd, connection);
-
-    Connection *client_connection = search_connection(target_sockfd,
-                                                      connection_list);
-    client_connection->target_sockfd = requesting_sockfd;
 
-    return requesting_sockfd;
+    return persistent;
 }
 
 
-void remove_connection(int sockfd, fd_set *master, Connection **connection_list) {
-    /* Removes client from the connection_list */
+int construct_request(HTTPRequest *request, HTTPResponse *stale,
+                      char **raw_ptr) {
+    /* Reconstructs a request for the server into the provided buffer. It is
+     * always sent as HTTP/1.1 with its hop-by-hop headers replaced, so the
+     * server keeps the connection open for the next request. With a stale
+     * copy of the response its validators replace the client's own, so the
+     * server can answer 304 if our copy is still good */
 
-    Connection *connection = search_connection(sockfd, connection_list);
+    int request_length = 0, crlf_length = strlen(CRLF);
+    char *raw = NULL, *method = GET_RQ;
+    char *etag = NULL, *last_modified = NULL;
 
-    if (connection != NULL) {
+    if (request->method == CONNECT) {
+        method = CONNECT_RQ;
+    } else if (request->method == OPTIONS) {
+        method = OPTIONS_RQ;
+    }
+    if (stale != NULL) {
+        etag = get_hdr_value(stale->hdrs, ETAG);
+        last_modified = get_hdr_value(stale->hdrs, LAST_MODIFIED);
+    }
 
-        // Remove the target connection to avoid any future 1-sided communication
-        Connection *target = search_connection(connection->target_sockfd,
-                                               connection_list);
-        if (target != NULL) {
-            HASH_DEL(*connection_list, target);
-            clear_connection(target);
-            FD_CLR(connection->target_sockfd, master);
-            close(connection->target_sockfd);
-            connection->request = NULL;  // so we don't double free this pointer
+    // work out how much room we need so there is only one allocation
+    request_length = strlen(method) + 1 + strlen(request->url) + 1 +
+                     strlen(HTTP_1_1) + crlf_length;
+    for (HTTPHeader *hdr = request->hdrs; hdr; hdr = hdr->next) {
+        if (!is_hop_by_hop(hdr->name) &&
+                (stale == NULL || !is_conditional(hdr->name))) {
+            request_length += strlen(hdr->name) + 2 + strlen(hdr->value) +
+                              crlf_length;
         }
+    }
+    if (etag != NULL) {
+        request_length += strlen(IF_NONE_MATCH) + 2 + strlen(etag) + crlf_length;
+    }
+    if (last_modified != NULL) {
+        request_length += strlen(IF_MODIFIED_SINCE) + 2 + strlen(last_modified) +
+                          crlf_length;
+    }
+    request_length += strlen(CONNECTION_KEEP_ALIVE) + 2 * crlf_length +
+                      request->body_length;
+    if ((raw = (char *) malloc(request_length + 1)) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+
+    // request line, headers, our validators and connection header then the body
+    int offset = sprintf(raw, "%s %s %s" CRLF, method, request->url, HTTP_1_1);
+    for (HTTPHeader *hdr = request->hdrs; hdr; hdr = hdr->next) {
+        if (!is_hop_by_hop(hdr->name) &&
+                (stale == NULL || !is_conditional(hdr->name))) {
+            offset += sprintf(raw + offset, "%s: %s" CRLF, hdr->name, hdr->value);
+        }
+    }
+    if (etag != NULL) {
+        offset += sprintf(raw + offset, IF_NONE_MATCH ": %s" CRLF, etag);
+    }
+    if (last_modified != NULL) {
+        offset += sprintf(raw + offset, IF_MODIFIED_SINCE ": %s" CRLF,
+                          last_modified);
+    }
+    offset += sprintf(raw + offset, CONNECTION_KEEP_ALIVE CRLF CRLF);
+    memcpy(raw + offset, request->body, request->body_length);
+    free(etag);
+    free(last_modified);
+
+    // set the requested pointer to our data
+    *raw_ptr = raw;
+
+    return request_length;
+}
+
+
+char *serialize_headers(HTTPResponse *response, int *length) {
+    /* Returns the response's status line and headers as they'd be sent,
+     * ending in an empty line, and their length in length */
+
+    int crlf_length = strlen(CRLF), offset;
+    char *raw;
+
+    *length = strlen(response->version) + 1 + strlen(response->status) + 1 +
+              strlen(response->status_desc) + 2 * crlf_length;
+    for (HTTPHeader *hdr = response->hdrs; hdr; hdr = hdr->next) {
+        *length += strlen(hdr->name) + 2 + strlen(hdr->value) + crlf_length;
+    }
+    if ((raw = (char *) malloc(*length + 1)) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+
+    offset = sprintf(raw, "%s %s %s" CRLF, response->version, response->status,
+                     response->status_desc);
+    for (HTTPHeader *hdr = response->hdrs; hdr; hdr = hdr->next) {
+        offset += sprintf(raw + offset, "%s: %s" CRLF, hdr->name, hdr->value);
+    }
+    sprintf(raw + offset, CRLF);
+
+    return raw;
+}
+
+
+int construct_not_modified(HTTPResponse *response, int keep_alive,
+                           char **raw_ptr) {
+    /* Constructs a 304 for a client whose copy of the response is still
+     * good: just the headers a 304 carries (RFC 9110 15.4.5), no body */
+
+    int response_length = 0, crlf_length = strlen(CRLF);
+    int age = response->initial_age + time(NULL) - response->time_fetched;
+    char *raw = NULL;
+    char *connection = keep_alive ? CONNECTION_KEEP_ALIVE : CONNECTION_CLOSE;
+
+    // work out how much room we need so there is only one allocation
+    response_length = strlen(response->version) + 1 + strlen(NOT_MODIFIED) +
+                      crlf_length;
+    for (HTTPHeader *hdr = response->hdrs; hdr; hdr = hdr->next) {
+        if (is_not_modified_hdr(hdr->name)) {
+            response_length += strlen(hdr->name) + 2 + strlen(hdr->value) +
+                               crlf_length;
+        }
+    }
+    response_length += strlen(AGE) + 2 + snprintf(NULL, 0, "%d", age) +
+                       strlen(connection) + 3 * crlf_length;
+    if ((raw = (char *) malloc(response_length + 1)) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+
+    // status line, headers, age and our connection header
+    int offset = sprintf(raw, "%s " NOT_MODIFIED CRLF, response->version);
+    for (HTTPHeader *hdr = response->hdrs; hdr; hdr = hdr->next) {
+        if (is_not_modified_hdr(hdr->name)) {
+            offset += sprintf(raw + offset, "%s: %s" CRLF, hdr->name, hdr->value);
+        }
+    }
+    sprintf(raw + offset, AGE ": %d" CRLF "%s" CRLF CRLF, age, connection);
+
+    // set the requested pointer to our data
+    *raw_ptr = raw;
+
+    return response_length;
+}
+
+
+int is_server_error(const char *status) {
+    /* Returns 1 if the status says the server failed to answer, where a
+     * stale copy may be served instead (RFC 5861 4) */
+
+    return strcmp(status, "500") == 0 || strcmp(status, "502") == 0 ||
+           strcmp(status, "503") == 0 || strcmp(status, "504") == 0;
+}
+
+
+int is_conditional(const char *name) {
+    /* Returns 1 if the request header makes the request conditional on the
+     * client's own copy of the response */
+
+    return strcasecmp(name, IF_NONE_MATCH) == 0 ||
+           strcasecmp(name, IF_MODIFIED_SINCE) == 0;
+}
+
+
+int is_not_modified_hdr(const char *name) {
+    /* Returns 1 if the header of a response is repeated in a 304 for it */
+
+    return strcasecmp(name, CACHE_CONTROL) == 0 ||
+           strcasecmp(name, CONTENT_LOCATION) == 0 ||
+           strcasecmp(name, DATE) == 0 ||
+           strcasecmp(name, ETAG) == 0 ||
+           strcasecmp(name, EXPIRES) == 0 ||
+           strcasecmp(name, LAST_MODIFIED) == 0 ||
+           strcasecmp(name, VARY) == 0;
+}
+
+
+int not_modified_since(HTTPHeader *hdrs, HTTPResponse *response) {
+    /* Returns 1 if the client's conditional request headers say its copy is
+     * the same as the response, so a 304 will do (RFC 9110 13.2.2) */
+
+    char *if_none_match = get_hdr_value(hdrs, IF_NONE_MATCH);
+    char *if_modified_since = get_hdr_value(hdrs, IF_MODIFIED_SINCE);
+    char *etag = get_hdr_value(response->hdrs, ETAG);
+    char *last_modified = get_hdr_value(response->hdrs, LAST_MODIFIED);
+    char *tag, *strong_etag;
+    time_t since, modified;
+    size_t length;
+    int matched = 0;
+
+    if (if_none_match != NULL) {
+
+        // any of the listed tags will do, weakly compared
+        strong_etag = etag;
+        if (etag != NULL && strncmp(etag, "W/", 2) == 0) {
+            strong_etag += 2;
+        }
+        for (tag = if_none_match; *tag != '\0' && !matched; tag += length) {
+            tag += strspn(tag, " ,");
+            length = strcspn(tag, " ,");
+            if (length == 1 && *tag == '*') {
+                matched = 1;
+            } else if (strong_etag != NULL && length > 0) {
+                if (strncmp(tag, "W/", 2) == 0) {
+                    tag += 2;
+                    length -= 2;
+                }
+                matched = length == strlen(strong_etag) &&
+                          strncmp(tag, strong_etag, length) == 0;
+            }
+        }
+    } else if (if_modified_since != NULL && last_modified != NULL) {
+
+        // only looked at when there are no tags to compare
+        since = curl_getdate(if_modified_since, NULL);
+        modified = curl_getdate(last_modified, NULL);
+        matched = since >= 0 && modified >= 0 && modified <= since;
+    }
+
+    free(if_none_match);
+    free(if_modified_since);
+    free(etag);
+    free(last_modified);
+
+    return matched;
+}
+
+
+void set_hdr(HTTPHeader **hdrs, const char *name, const char *value) {
+    /* Sets the header to a copy of the value, replacing what it was if the
+     * list has it already */
+
+    // a parsed header can't be changed in place (see parsed_response), so
+    // the old one makes way for a new one
+    remove_hdr(hdrs, name);
+
+    char *name_copy = strdup(name), *value_copy = strdup(value);
+    if (name_copy == NULL || value_copy == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    add_hdr(hdrs, name_copy, value_copy);
+}
+
+
+void remove_hdr(HTTPHeader **hdrs, const char *name) {
+    /* Takes the header out of the list, every copy of it */
+
+    HTTPHeader **link = hdrs, *hdr;
+
+    while ((hdr = *link) != NULL) {
+        if (strcasecmp(hdr->name, name) == 0) {
+            *link = hdr->next;
+            hdr->next = NULL;
+            free_hdr(hdr);
+        } else {
+            link = &(hdr->next);
+        }
+    }
+}
+
+
+int write_to_socket(int sockfd, char *buffer, int buffer_length) {
+    /* Write to the given socket and return the length of the written data.
+     * Only for blocking sockets (the client's), the proxy's queue what their
+     * socket won't take (see queue_unsent) */
+
+    int writelen = 0, last_write = 0;
+
+    while (writelen < buffer_length) {
+        if ((last_write = write(sockfd, buffer + writelen,
+                                buffer_length - writelen)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_declare("Couldn't write to the socket!");
+            return -1;
+        }
+        writelen += last_write;
+    }
+
+    return writelen;
+}
+
+
+int writev_available(int sockfd, struct iovec *iov, int count) {
+    /* Writes as much of the iovecs to the socket as it takes right away,
+     * without waiting for it to take more. Returns how much that was */
+
+    int written = 0, skip = 0;
+    ssize_t last_write = 0;
+    struct iovec rest[count];
+
+    memcpy(rest, iov, count * sizeof(struct iovec));
+    while (skip < count) {
+        if ((last_write = writev(sockfd, rest + skip, count - skip)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            error_declare("Couldn't write to the socket!");
+            return -1;
+        }
+        written += last_write;
+
+        // step over what went, the socket may have stopped mid iovec
+        while (skip < count && (size_t) last_write >= rest[skip].iov_len) {
+            last_write -= rest[skip++].iov_len;
+        }
+        if (skip < count) {
+            rest[skip].iov_base = (char *) rest[skip].iov_base + last_write;
+            rest[skip].iov_len -= last_write;
+        }
+    }
+
+    return written;
+}
+
+
+long monotonic_usec() {
+    /* Returns a timestamp in microseconds for measuring intervals */
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+
+int set_nonblocking(int sockfd) {
+    /* Puts the socket in non-blocking mode, returns -1 on failure */
+
+    int flags;
+
+    if ((flags = fcntl(sockfd, F_GETFL, 0)) < 0) {
+        return -1;
+    }
+
+    return fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+int construct_response(HTTPResponse *response, int keep_alive, char **raw_ptr) {
+    /* Reconstructs a response into the provided buffer. Hop-by-hop headers
+     * are ours to set, so the server's are replaced by our own Connection.
+     * Cached responses are sent from their header block instead (see
+     * response_iovecs), this is for the ones we make up */
+
+    int head_length = header_block_length(response), tail_length;
+    char tail[RESPONSE_TAIL_SIZE], *raw;
+
+    // work out how much room we need so there is only one allocation
+    tail_length = response_tail(response, keep_alive, tail);
+    if ((raw = (char *) malloc(head_length + tail_length +
+                               response->body_length)) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    write_header_block(response, raw);
+    memcpy(raw + head_length, tail, tail_length);
+    memcpy(raw + head_length + tail_length, response->body,
+           response->body_length);
+
+    // set the requested pointer to our data
+    *raw_ptr = raw;
+
+    return head_length + tail_length + response->body_length;
+}
+
+
+char *get_header_block(HTTPResponse *response, int *length) {
+    /* Returns the status line and headers the response is sent with, minus
+     * the Age and Connection that change from one send to the next. It is
+     * built the first time it is asked for and kept with the response, so
+     * the headers must not change while it is (see drop_header_block) */
+
+    if (response->header_block == NULL) {
+        response->header_block_length = header_block_length(response);
+        if ((response->header_block =
+                (char *) malloc(response->header_block_length + 1)) == NULL) {
+            error_out("Couldn't malloc!");
+        }
+        write_header_block(response, response->header_block);
+    }
+    *length = response->header_block_length;
+
+    return response->header_block;
+}
+
+
+void drop_header_block(HTTPResponse *response) {
+    /* Forgets the response's header block, for when its headers change */
+
+    free(response->header_block);
+    response->header_block = NULL;
+    response->header_block_length = 0;
+}
+
+
+int response_iovecs(HTTPResponse *response, int keep_alive, char *tail,
+                    struct iovec *iov) {
+    /* Points iov at the response as it is to be sent: its header block, the
+     * Age and Connection headers written into tail (RESPONSE_TAIL_SIZE
+     * bytes) and its body, which are not copied. Returns how many of the
+     * three iovecs are used, the body's isn't if it is in a file */
+
+    int head_length;
+
+    iov[0].iov_base = get_header_block(response, &head_length);
+    iov[0].iov_len = head_length;
+    iov[1].iov_base = tail;
+    iov[1].iov_len = response_tail(response, keep_alive, tail);
+    iov[2].iov_base = response->body;
+    iov[2].iov_len = response->body_length;
+
+    // a body in a file is sent from there
+    return response->body_length > 0 && response->body_fd < 0 ? 3 : 2;
+}
+
+
+int header_block_length(HTTPResponse *response) {
+    /* Returns how long the response's status line and end-to-end headers
+     * are, see write_header_block */
+
+    int crlf_length = strlen(CRLF);
+    int length = strlen(response->version) + 1 + strlen(response->status) + 1 +
+                 strlen(response->status_desc) + crlf_length;
+
+    for (HTTPHeader *hdr = response->hdrs; hdr; hdr = hdr->next) {
+        if (!is_hop_by_hop(hdr->name) && strcasecmp(hdr->name, AGE) != 0) {
+            length += strlen(hdr->name) + 2 + strlen(hdr->value) + crlf_length;
+        }
+    }
+
+    return length;
+}
+
+
+void write_header_block(HTTPResponse *response, char *raw) {
+    /* Writes the response's status line and the headers that go with it
+     * however it is sent to raw, which has room for them and a '\0' */
+
+    int offset = sprintf(raw, "%s %s %s" CRLF, response->version,
+                         response->status, response->status_desc);
+
+    for (HTTPHeader *hdr = response->hdrs; hdr; hdr = hdr->next) {
+        if (!is_hop_by_hop(hdr->name) && strcasecmp(hdr->name, AGE) != 0) {
+            offset += sprintf(raw + offset, "%s: %s" CRLF, hdr->name, hdr->value);
+        }
+    }
+}
+
+
+int response_tail(HTTPResponse *response, int keep_alive, char *tail) {
+    /* Writes the headers that end the response to tail: how old it is now
+     * and whether we keep the connection open. Returns their length */
+
+    int age = response->initial_age + time(NULL) - response->time_fetched;
+    char *connection = keep_alive ? CONNECTION_KEEP_ALIVE : CONNECTION_CLOSE;
+
+    return snprintf(tail, RESPONSE_TAIL_SIZE, AGE ": %d" CRLF "%s" CRLF CRLF,
+                    age, connection);
+}
+
+
+int read_sockfd(int sockfd, Connection *connection) {
+    /* Reads from the socket straight onto the end of what the connection has
+     * buffered, making room first if the buffer is full */
+
+    int last_read = 0;
+
+    if (connection->read_len == connection->raw_size &&
+            grow_buffer(connection) < 0) {
+        return -1;
+    }
+
+    while ((last_read = read(sockfd, connection->raw + connection->read_len,
+                             connection->raw_size - connection->read_len)) < 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // drained the socket, wait for epoll to tell us about more
+            return WOULD_BLOCK;
+        }
+        error_declare("Couldn't read from client socket!");
+        return -1;
+    }
+
+    if (last_read > 0) {
+        connection->read_len += last_read;
+    }
+
+    return last_read;
+}
+
+
+int grow_buffer(Connection *connection) {
+    /* Gives the connection a buffer from the pool, or twice the room if the
+     * one it has is full. Returns -1 if it couldn't */
+
+    char *raw;
+
+    if (connection->raw == NULL) {
+        if (Spare_Buffers != NULL) {
+            connection->raw = Spare_Buffers;
+            Spare_Buffers = *(char **) Spare_Buffers;
+            Spare_Count--;
+        } else if ((connection->raw = (char *) malloc(IO_BUFFER_SIZE)) == NULL) {
+            error_declare("Couldn't malloc!");
+            return -1;
+        }
+        connection->raw_size = IO_BUFFER_SIZE;
+        return 0;
+    }
+
+    if ((raw = (char *) realloc(connection->raw, 2 * connection->raw_size)) == NULL) {
+        error_declare("Couldn't realloc!");
+        return -1;
+    }
+    connection->raw = raw;
+    connection->raw_size *= 2;
+
+    return 0;
+}
+
+
+void release_buffer(Connection *connection) {
+    /* The connection is done with what it has buffered, its buffer goes back
+     * to the pool (one that has grown is freed instead) */
 
-        // Now we can remove the intended connection safely
-        HASH_DEL(*connection_list, connection);
+    if (connection->raw != NULL) {
+        if (connection->raw_size == IO_BUFFER_SIZE &&
+                Spare_Count < MAX_SPARE_BUFFERS) {
+            *(char **) connection->raw = Spare_Buffers;
+            Spare_Buffers = connection->raw;
+            Spare_Count++;
+        } else {
+            free(connection->raw);
+        }
+    }
+    connection->raw = NULL;
+    connection->read_len = 0;
+    connection->raw_size = 0;
+}
+
+
+void queue_unsent(Connection *connection, struct iovec *iov, int count,
+                  int skip) {
+    /* Queues what is left of the iovecs after their first skip bytes for the
+     * connection's socket, behind whatever it has queued already */
+
+    int length = -skip, needed;
+
+    for (int i = 0; i < count; i++) {
+        length += iov[i].iov_len;
+    }
+
+    // what has been sent makes way before the buffer grows
+    needed = connection->unsent_len - connection->unsent_offset + length;
+    if (connection->unsent_offset > 0) {
+        memmove(connection->unsent, connection->unsent + connection->unsent_offset,
+                connection->unsent_len - connection->unsent_offset);
+        connection->unsent_len -= connection->unsent_offset;
+        connection->unsent_offset = 0;
+    }
+    if (needed > connection->unsent_size) {
+        connection->unsent_size = connection->unsent_size ? connection->unsent_size :
+                                                            IO_BUFFER_SIZE;
+        while (needed > connection->unsent_size) {
+            connection->unsent_size *= 2;
+        }
+        if ((connection->unsent = (char *) realloc(connection->unsent,
+                                                   connection->unsent_size)) == NULL) {
+            error_out("Couldn't realloc!");
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if ((size_t) skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        memcpy(connection->unsent + connection->unsent_len,
+               (char *) iov[i].iov_base + skip, iov[i].iov_len - skip);
+        connection->unsent_len += iov[i].iov_len - skip;
+        skip = 0;
+    }
+}
+
+
+int queued_bytes(Connection *connection) {
+    /* Returns how much the connection has queued in memory for its socket */
+
+    return connection->unsent_len - connection->unsent_offset;
+}
+
+
+int has_unsent(Connection *connection) {
+    /* Returns 1 if anything is still to be sent on the connection's socket,
+     * queued or from a file */
+
+    return queued_bytes(connection) > 0 || connection->body_left > 0;
+}
+
+
+int send_unsent(Connection *connection) {
+    /* Sends as much of what the connection has queued for its socket, then
+     * of the file after it, as the socket takes without waiting. Returns 1
+     * once all of it is gone, 0 if the rest has to wait for the socket to be
+     * writable again and -1 if the socket failed */
+
+    int sockfd = connection->requesting_sockfd;
+    ssize_t last_write;
+
+    while (connection->unsent_offset < connection->unsent_len) {
+        if ((last_write = write(sockfd, connection->unsent + connection->unsent_offset,
+                                connection->unsent_len - connection->unsent_offset)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            error_declare("Couldn't write to the socket!");
+            return -1;
+        }
+        connection->unsent_offset += last_write;
+    }
+
+    // an idle connection doesn't keep the room
+    free(connection->unsent);
+    connection->unsent = NULL;
+    connection->unsent_len = connection->unsent_offset = connection->unsent_size = 0;
+
+    while (connection->body_left > 0) {
+        if ((last_write = sendfile(sockfd, connection->body_fd,
+                                   &(connection->body_offset),
+                                   connection->body_left)) <= 0) {
+            if (last_write < 0 && errno == EINTR) {
+                continue;
+            }
+            if (last_write < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return 0;
+            }
+            error_declare("Couldn't send the file to the socket!");
+            return -1;
+        }
+        connection->body_left -= last_write;
+    }
+    clear_unsent(connection);
+
+    return 1;
+}
+
+
+void clear_unsent(Connection *connection) {
+    /* Forgets whatever is still to be sent on the connection's socket */
+
+    free(connection->unsent);
+    connection->unsent = NULL;
+    connection->unsent_len = 0;
+    connection->unsent_offset = 0;
+    connection->unsent_size = 0;
+    if (connection->body_fd >= 0) {
+        close(connection->body_fd);
+    }
+    connection->body_fd = -1;
+    connection->body_offset = 0;
+    connection->body_left = 0;
+}
+
+
+int open_tunnel(Connection *connection) {
+    /* Gives the connection's end of a tunnel the pipe its bytes are moved
+     * through. Returns -1 if it couldn't */
+
+    if (pipe2(connection->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        error_declare("Couldn't open a pipe for the tunnel!");
+        connection->pipe_fds[0] = connection->pipe_fds[1] = -1;
+        return -1;
+    }
+    connection->piped = 0;
+    connection->read_closed = 0;
+
+    return 1;
+}
+
+
+int splice_tunnel(Connection *connection, int target_sockfd) {
+    /* Moves what the connection's socket has for us on to target_sockfd
+     * through its pipe, without the bytes ever leaving the kernel. Returns 1
+     * once the socket would block, WOULD_BLOCK if target_sockfd can't take
+     * more (what it didn't take stays in the pipe for next time), 0 once
+     * the socket is closed and everything it sent is gone and -1 if either
+     * of them failed */
+
+    ssize_t moved;
+
+    while (1) {
+
+        // the pipe is emptied before it is filled again, so a target that
+        // is behind holds the socket back rather than our memory
+        while (connection->piped > 0) {
+            if ((moved = splice(connection->pipe_fds[0], NULL, target_sockfd,
+                                NULL, connection->piped,
+                                SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return WOULD_BLOCK;
+                }
+                error_declare("Couldn't splice to the tunnel!");
+                return -1;
+            }
+            connection->piped -= moved;
+        }
+
+        if ((moved = splice(connection->requesting_sockfd, NULL,
+                            connection->pipe_fds[1], NULL, TUNNEL_CHUNK,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            error_declare("Couldn't splice from the tunnel!");
+            return -1;
+        }
+        if (moved == 0) {
+            return 0;
+        }
+        connection->piped = moved;
+    }
+}
+
+
+void close_tunnel(Connection *connection) {
+    /* Closes the pipe of the connection's end of a tunnel, if it has one */
+
+    if (connection->pipe_fds[0] >= 0) {
+        close(connection->pipe_fds[0]);
+        close(connection->pipe_fds[1]);
+    }
+    connection->pipe_fds[0] = connection->pipe_fds[1] = -1;
+    connection->piped = 0;
+}
+
+
+int accept_client(int proxy) {
+    /* Accepts a new client and returns its sockfd */
+    
+    int sockfd;
+    struct sockaddr_in address;
+    socklen_t addr_len = sizeof(address);
+
+    // clients are served from the event loop so they must never block
+    if ((sockfd = accept4(proxy, (struct sockaddr*) &address, &addr_len,
+                          SOCK_NONBLOCK)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            error_declare("Server cannot accept incoming connections!");
+        }
+    }
+
+    return sockfd;
+}
+
+
+int add_client(int proxy, ConnectionTable *connection_list) {
+    /* Adds client to connection_list */
+
+    int n;
+
+    if ((n = accept_client(proxy)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            error_declare("Cannot accept client!");
+        }
+    } else {
+        n = add_client_connection(n, connection_list);
+    }
+
+    return n;
+}
+
+
+int add_server(int client, struct in_addr *addr, HTTPRequest *request,
+               ConnectionTable *connection_list) {
+    /* Adds server to connection_list, the connect is still in flight */
+
+    int n;
+
+    if ((n = connect_nonblocking(addr, request->port)) < 0) {
+        error_declare("Cannot connect to the server!");
+    } else {
+        n = add_server_connection(n, client, request, connection_list);
+    }
+
+    return n;
+}
+
+
+int add_client_connection(int requesting_sockfd, ConnectionTable *connection_list) {
+    /* Adds connection to our connection list
+     * NOTE: -1 means we couldn't add to our connection list */
+
+    static __thread unsigned long serial = 0;
+    Connection *connection;
+
+    if ((connection = new_connection(requesting_sockfd, connection_list)) == NULL) {
+        return -1;
+    }
+    connection->requesting_sockfd = requesting_sockfd;
+    connection->target_sockfd = -1;
+    connection->serial = ++serial;
+    connection->is_server = 0;
+    connection->keep_alive = 0;
+    connection->revalidating = 0;
+    connection->state = IDLE;
+    connection->raw = NULL;
+    connection->read_len = 0;
+    connection->raw_size = 0;
+    connection->pending = NULL;
+    connection->pending_len = 0;
+    connection->sent_at = 0;
+    connection->unsent = NULL;
+    connection->unsent_len = 0;
+    connection->unsent_offset = 0;
+    connection->unsent_size = 0;
+    connection->body_fd = -1;
+    connection->body_offset = 0;
+    connection->body_left = 0;
+    connection->paused = 0;
+    connection->reused = 0;
+    connection->pipe_fds[0] = connection->pipe_fds[1] = -1;
+    connection->piped = 0;
+    connection->read_closed = 0;
+    init_timer(&(connection->timer));
+    connection->timeout = NO_TIMEOUT;
+    init_parser(connection->parser, 0);
+    connection->request = NULL;
+    connection->response = NULL;
+
+    return requesting_sockfd;
+}
+
+
+int add_server_connection(int requesting_sockfd, int target_sockfd,
+                          HTTPRequest *request, ConnectionTable *connection_list) {
+    /* Adds connection to our connection list
+     * NOTE: -1 means we couldn't add to our connection list */
+
+    Connection *connection;
+
+    if ((connection = new_connection(requesting_sockfd, connection_list)) == NULL) {
+        return -1;
+    }
+    connection->requesting_sockfd = requesting_sockfd;
+    connection->target_sockfd = target_sockfd;
+    connection->serial = 0;
+    connection->is_server = 1;
+    connection->keep_alive = 0;
+    connection->revalidating = 0;
+    connection->state = CONNECTING;
+    connection->raw = NULL;
+    connection->read_len = 0;
+    connection->raw_size = 0;
+    connection->pending = NULL;
+    connection->pending_len = 0;
+    connection->sent_at = 0;
+    connection->unsent = NULL;
+    connection->unsent_len = 0;
+    connection->unsent_offset = 0;
+    connection->unsent_size = 0;
+    connection->body_fd = -1;
+    connection->body_offset = 0;
+    connection->body_left = 0;
+    connection->paused = 0;
+    connection->reused = 0;
+    connection->pipe_fds[0] = connection->pipe_fds[1] = -1;
+    connection->piped = 0;
+    connection->read_closed = 0;
+    init_timer(&(connection->timer));
+    connection->timeout = NO_TIMEOUT;
+    init_parser(connection->parser, 1);
+    connection->request = request;
+    connection->response = NULL;
+
+    // a server fetching for nobody has no client to point back at it
+    Connection *client_connection = search_connection(target_sockfd,
+                                                      connection_list);
+    if (client_connection != NULL) {
+        client_connection->target_sockfd = requesting_sockfd;
+        client_connection->state = CONNECTING;
+    }
+
+    return requesting_sockfd;
+}
+
+
+ConnectionTable *create_connection_table() {
+    /* Returns an empty table for a worker's connections */
+
+    ConnectionTable *connection_list;
+
+    if ((connection_list = (ConnectionTable *) malloc(sizeof(ConnectionTable))) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    if ((connection_list->slots = (Connection **) calloc(CONNECTION_SLOTS,
+                                                         sizeof(Connection *))) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    connection_list->size = CONNECTION_SLOTS;
+    connection_list->spare = NULL;
+
+    return connection_list;
+}
+
+
+Connection *new_connection(int sockfd, ConnectionTable *connection_list) {
+    /* Returns a connection for sockfd, in its slot of the table. It comes off
+     * the spare list, which is topped up a slab at a time. Returns NULL if
+     * it couldn't */
+
+    Connection *slab, **slots;
+    HTTPParser *parsers;
+    int size = connection_list->size;
+
+    // sockfds are handed out lowest first, the table only grows with the
+    // most we have open at once
+    if (sockfd >= size) {
+        while (sockfd >= size) {
+            size *= 2;
+        }
+        if ((slots = (Connection **) realloc(connection_list->slots,
+                                             size * sizeof(Connection *))) == NULL) {
+            error_declare("Couldn't malloc!");
+            return NULL;
+        }
+        memset(slots + connection_list->size, 0,
+               (size - connection_list->size) * sizeof(Connection *));
+        connection_list->slots = slots;
+        connection_list->size = size;
+    }
+
+    if (connection_list->spare == NULL) {
+        if ((slab = (Connection *) aligned_alloc(CACHE_LINE, CONNECTION_SLAB *
+                                                 sizeof(Connection))) == NULL) {
+            error_declare("Couldn't malloc!");
+            return NULL;
+        }
+        if ((parsers = (HTTPParser *) malloc(CONNECTION_SLAB *
+                                             sizeof(HTTPParser))) == NULL) {
+            free(slab);
+            error_declare("Couldn't malloc!");
+            return NULL;
+        }
+        // the spare list only runs through their first bytes, each keeps
+        // its parser for good
+        for (int i = 0; i < CONNECTION_SLAB; i++) {
+            slab[i].parser = &parsers[i];
+            *(Connection **) &slab[i] = connection_list->spare;
+            connection_list->spare = &slab[i];
+        }
+    }
+    slab = connection_list->spare;
+    connection_list->spare = *(Connection **) slab;
+    connection_list->slots[sockfd] = slab;
+
+    return slab;
+}
+
+
+void free_connection(Connection *connection, ConnectionTable *connection_list) {
+    /* Empties the connection's slot and puts it on the spare list */
+
+    connection_list->slots[connection->requesting_sockfd] = NULL;
+    *(Connection **) connection = connection_list->spare;
+    connection_list->spare = connection;
+}
+
+
+void remove_connection(int sockfd, ConnectionTable *connection_list) {
+    /* Removes client from the connection_list */
+
+    Connection *connection = search_connection(sockfd, connection_list);
+
+    if (connection != NULL) {
+
+        // Remove the target connection to avoid any future 1-sided communication
+        Connection *target = search_connection(connection->target_sockfd,
+                                               connection_list);
+        if (target != NULL) {
+            clear_connection(target);
+            free_connection(target, connection_list);
+            close(connection->target_sockfd);
+            connection->request = NULL;  // so we don't double free this pointer
+        }
+
+        // Now we can remove the intended connection safely (closing a socket
+        // also drops it from the epoll interest list)
         clear_connection(connection);
-        FD_CLR(sockfd, master);
+        free_connection(connection, connection_list);
         close(sockfd);
     }
 }
 
 
-Connection *search_connection(int sockfd, Connection **connection_list) {
+void detach_connection(int sockfd, ConnectionTable *connection_list) {
+    /* Removes the connection from the connection_list without closing its
+     * socket, for sockets that are handed on to someone else */
+
+    Connection *connection = search_connection(sockfd, connection_list);
+
+    if (connection != NULL) {
+        clear_connection(connection);
+        free_connection(connection, connection_list);
+    }
+}
+
+
+Connection *search_connection(int sockfd, ConnectionTable *connection_list) {
     /* Searches for client and returns its ID from connection_list */
 
-    Connection *connection;
-    HASH_FIND_INT(*connection_list, &sockfd, connection);
-    return connection;
+    return sockfd >= 0 && sockfd < connection_list->size ?
+           connection_list->slots[sockfd] : NULL;
 }
 
 
 void clear_connection(Connection *connection) {
-    /* Closes the socket connection and deletes all data associated with it */
+    /* Deletes all data associated with the connection, the connection itself
+     * is the table's to reuse (see free_connection) */
 
     if (connection) {
-        if (connection->raw) {
-            free(connection->raw);
-            connection->raw = NULL;
+        release_buffer(connection);
+        clear_unsent(connection);
+        close_tunnel(connection);
+        cancel_timer(&(connection->timer));
+        if (connection->pending) {
+            free(connection->pending);
+            connection->pending = NULL;
         }
         if (connection->request) {
             free_request(connection->request);
             connection->request = NULL;
         }
+        // a server's response is ours until it is cached, and one that was
+        // cut short never is
+        if (connection->is_server && connection->response) {
+            free_response(connection->response);
+            connection->response = NULL;
+        }
         // // IMPORTANT: do not free response, handling response is the cache's
         //               business
         // if (connection->response) {
         //     free_response(connection->response);
         //     connection->response = NULL;
         // }
-        free(connection);
-        connection = NULL;
     }
 }
 
@@ -911,6 +2097,7 @@ void add_hdr(HTTPHeader **hdr, char *key, char *value) {
     new_node->name = key;
     new_node->value = value;
     new_node->next = NULL;
+    new_node->in_block = 0;
 
     HTTPHeader *node = *hdr;
     if (node != NULL) {
@@ -932,7 +2119,7 @@ char *itoa_ap(int x) {
     int length = 0;
     
     length = snprintf(NULL, 0, "%d", x);
-    if ((str_x = (char *) malloc(length)) == NULL) {
+    if ((str_x = (char *) malloc(length + 1)) == NULL) {
         error_out("Couldn't malloc!");
     }
     sprintf(str_x, "%d", x);
@@ -16,25 +16,51 @@
 #ifndef AP_H
 #define AP_H
 
+#define _GNU_SOURCE
 
 #include <time.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <curl/curl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include "uthash/src/uthash.h"
+#include "scan.h"
+#include "timer.h"
 
 #define DEFAULT_HTTP_PORT 80
 #define MAX_CONNECTIONS 10
 #define CONTENT_LENGTH "Content-Length"
+#define TRANSFER_ENCODING "Transfer-Encoding"
 #define BUFFER_SIZE 2048
+#define IO_BUFFER_SIZE (16 * 1024)  // a connection's buffer, until it fills up
+#define MAX_SPARE_BUFFERS 256       // a worker keeps this many for reuse
+#define HIGH_WATERMARK (256 * 1024) // a server waits while a client of its
+#define LOW_WATERMARK (64 * 1024)   // has this much queued, until it is down
+                                    // to this (see fetch_backlog)
+#define CONNECTION_SLOTS 1024       // a worker's table to start with, doubled
+                                    // whenever a sockfd doesn't fit
+#define CONNECTION_SLAB 64          // connections allocated at a time
+#define CACHE_LINE 64               // connections start on their own
+#define TUNNEL_CHUNK (64 * 1024)    // a tunnel moves at most this much at a
+                                    // time, what its pipe holds by default
 #define TIMEOUT_INTERVAL 3
+#define WOULD_BLOCK -2
 #define CONNECT_RQ "CONNECT"
 #define OPTIONS_RQ "OPTIONS"
 #define AMPERSAND "&"
@@ -48,11 +74,40 @@
 #define CRCR "\r\r"
 #define LFLF "\n\n"
 #define HOST "Host"
+#define CONNECTION "Connection"
+#define PROXY_CONNECTION "Proxy-Connection"
+#define KEEP_ALIVE "Keep-Alive"
+#define CONNECTION_KEEP_ALIVE "Connection: keep-alive"
+#define CONNECTION_CLOSE "Connection: close"
+#define HTTP_1_1 "HTTP/1.1"
 #define AGE "Age"
+#define DATE "Date"
+#define EXPIRES "Expires"
+#define CACHE_CONTROL "Cache-Control"
+#define LAST_MODIFIED "Last-Modified"
+#define ETAG "ETag"
+#define IF_NONE_MATCH "If-None-Match"
+#define IF_MODIFIED_SINCE "If-Modified-Since"
+#define CONTENT_LOCATION "Content-Location"
+#define VARY "Vary"
+#define NOT_MODIFIED "304 Not Modified"
 #define OK " 200 Connection established"
 #define CR "\r"
 #define LF "\n"
 #define NUM_KEYWORDS 10
+#define MAX_HEADERS 100                 // a message with more is malformed
+#define MAX_HEADER_BYTES (64 * 1024)    // ...and so is a longer header
+#define PARSE_INCOMPLETE 0              // see parse_header
+#define PARSE_MALFORMED -1
+#define BODY_COMPLETE 1                 // see decode_body
+#define INITIAL_BODY_ROOM (16 * 1024)   // for a body of unknown length
+#define MAX_CONTENT_LENGTH (INT_MAX - 1)  // bodies are counted in ints, with a '\0'
+#define LARGE_BODY_BYTES (1024 * 1024)  // cached bodies this big go in a file
+#define RESPONSE_TAIL_SIZE 64           // Age and Connection, see response_iovecs
+#define BAD_REQUEST "HTTP/1.1 400 Bad Request" CRLF "Content-Length: 0" CRLF \
+                    CONNECTION_CLOSE CRLF CRLF
+#define REQUEST_TIMEOUT "HTTP/1.1 408 Request Timeout" CRLF "Content-Length: 0" CRLF \
+                        CONNECTION_CLOSE CRLF CRLF
 
 //
 // Data Structures
@@ -65,11 +120,94 @@ typedef enum HTTPMethod {
     UNSUPPORTED
 } HTTPMethod;
 
+typedef enum ConnectionState {
+    /* Where a connection is in setting up its conversation with a server */
+    IDLE,
+    RESOLVING,   // waiting on a resolver thread for the server's address
+    CONNECTING,  // non-blocking connect in flight, done when writable
+    CONNECTED,
+    WAITING,     // sharing another client's fetch of the same URL
+    SENDING      // taking the rest of a cache hit as the socket lets us
+} ConnectionState;
+
+typedef enum TimeoutKind {
+    /* Which deadline a connection is held to, see timeout_for */
+    NO_TIMEOUT,
+    IDLE_TIMEOUT,        // nothing moves either way on it
+    HEADER_TIMEOUT,      // a client's request header isn't all in yet
+    CONNECT_TIMEOUT,     // resolving and connecting to the server
+    FIRST_BYTE_TIMEOUT,  // the server hasn't started answering
+    WAIT_TIMEOUT,        // nothing has come of the fetch a client shares
+    TIMEOUT_KINDS
+} TimeoutKind;
+
+typedef enum ParserState {
+    /* Where parsing a header is, see parse_header */
+    IN_LINE,     // looking for the end of the current line
+    AFTER_CR,    // the line ended in a CR, an LF may follow
+    PARSED,
+    MALFORMED
+} ParserState;
+
+typedef enum BodyFraming {
+    /* How the end of a response's body is found (RFC 9112 6.3) */
+    NO_BODY,     // 1xx, 204 and 304 responses
+    BY_LENGTH,   // after Content-Length bytes
+    CHUNKED,     // at the last chunk
+    BY_CLOSE     // when the server closes the connection
+} BodyFraming;
+
+typedef enum ChunkState {
+    /* Where decoding a chunked body is, see decode_chunked */
+    CHUNK_SIZE,       // reading the size of the next chunk, in hex
+    CHUNK_EXTENSION,  // skipping the rest of its size line
+    CHUNK_DATA,
+    CHUNK_DATA_END,   // the line end after the data
+    CHUNK_DATA_LF,    // ...its LF, after a CR
+    CHUNK_TRAILER,    // trailer lines after the last chunk, they are dropped
+    CHUNK_DONE
+} ChunkState;
+
+typedef struct BodyDecoder {
+    /* How far reading a response's body got, it arrives in pieces */
+    BodyFraming framing;
+    ChunkState state;
+    int size_digits;     // of the chunk size read so far
+    int chunk_left;      // of the current chunk
+    int line_length;     // of the trailer line read so far
+} BodyDecoder;
+
+typedef struct HTTPSpan {
+    /* Part of a message, by where it is in the buffer it was read into */
+    int offset;
+    int length;
+} HTTPSpan;
+
+typedef struct HTTPParser {
+    /* How far parsing the header at the start of a buffer got. The buffer
+     * may grow between calls and parsing picks up where it stopped, so
+     * every byte is only looked at once */
+    ParserState state;
+    int is_response;
+    int offset;          // the next byte to look at
+    int line;            // where the current line starts
+    int line_end;        // ...and ends, once we know
+    int bare_cr;         // the last line ended in a CR alone
+    int length;          // of the whole header, once parsed
+    HTTPSpan start[3];   // method, target and version, or version, status
+                         // and description
+    int header_count;    // -1 until the start line has been parsed
+    HTTPSpan names[MAX_HEADERS];
+    HTTPSpan values[MAX_HEADERS];
+} HTTPParser;
+
 typedef struct HTTPHeader {
     /* HTTP Headers will be represented as a linked list, this is a node */
     char *name;
     char *value;
     struct HTTPHeader *next;
+    int in_block;  // parsed, so part of its message's allocation (see
+                   // parsed_request) and not freed on its own
 } HTTPHeader;
 
 typedef struct HTTPRequest {
@@ -91,23 +229,67 @@ typedef struct HTTPResponse {
     char *status_desc;
     HTTPHeader *hdrs;
     int body_length;
-    int total_body_length;
+    int total_body_length; // -1 until it is all in, if nothing says
+    int body_room;         // how much body has room for
     char *body;
+    int body_fd;           // -1, or the memfd a large body is kept in (see
+                           // file_body), body then maps it read-only
     char *keywords[NUM_KEYWORDS]; 
     time_t time_fetched;
+    int initial_age;       // how old it already was when we got it
+    long fetch_latency;    // microseconds the server took to send it all
+    char *header_block;    // the status line and headers it is sent with,
+    int header_block_length;  // built on its first hit (see get_header_block)
 } HTTPResponse;
 
 typedef struct Connection {
-    /* We will map sockfd to this other data */
+    /* We will map sockfd to this other data. What every event looks at
+     * comes first, in the first cache line */
     int requesting_sockfd; // key
     int target_sockfd;
-    char *raw;
+    unsigned long serial;  // tells apart connections that reuse a sockfd
+    int is_server;         // we opened it to a server on a client's behalf
+    int keep_alive;        // the client wants the connection kept open
+    ConnectionState state;
+    int paused;            // a server not read from until its clients catch up
+    int reused;            // a server taken from the pool, see retry_server
+    char *raw;             // read into directly, see read_sockfd
     int read_len;
-    // int got_header;
+    int raw_size;          // ...and how much room it has
     HTTPRequest *request;
     HTTPResponse *response;
-	UT_hash_handle hh;
-} Connection;
+    int revalidating;      // the client's miss asks the server if our stale
+                           // copy is still good
+    char *pending;         // bytes for the target once it is connected
+    int pending_len;
+    long sent_at;          // when the request went to the server (usec)
+    char *unsent;          // queued for the socket, it didn't take it
+    int unsent_len;        // straight away (see queue_unsent)
+    int unsent_offset;     // ...how much of it has gone since
+    int unsent_size;       // ...and how much room there is
+    int body_fd;           // ...then the rest of its body from this file,
+    off_t body_offset;     // -1 if none
+    size_t body_left;
+    int pipe_fds[2];       // a tunnel end's bytes pass through this on their
+                           // way to the other end, -1 if it isn't one
+    int piped;             // ...how many are in it (see splice_tunnel)
+    int read_closed;       // ...and whether this end has sent all it will
+    Timer timer;           // the deadline it is held to, in its worker's
+    TimeoutKind timeout;   // wheel, and what for
+    HTTPParser *parser;    // for the header at the start of raw, kept out
+                           // of line in its slab's parsers, it is most of
+                           // the size of a connection and seldom looked at
+    BodyDecoder decoder;   // ...and the body after it, from servers
+} __attribute__((aligned(CACHE_LINE))) Connection;
+
+typedef struct ConnectionTable {
+    /* A worker's connections, found by their sockfd with a single index.
+     * Connections are carved out of slabs and go on a free list once they
+     * are removed, so connections coming and going don't touch malloc */
+    Connection **slots;    // by sockfd, NULL for ones that aren't ours
+    int size;              // ...and how many sockfds it has room for
+    Connection *spare;     // linked through their first bytes
+} ConnectionTable;
 
 
 
@@ -117,36 +299,76 @@ typedef struct Connection {
 void error_out(const char *msg);
 void error_declare(const char *msg);
 
-int add_client(int proxy, Connection **connection_list);
-int add_server(int proxy, int client, HTTPRequest *request,
-               Connection **connection_list);
-int add_client_connection(int requesting_sockfd, Connection **connection_list);
+int add_client(int proxy, ConnectionTable *connection_list);
+int add_server(int client, struct in_addr *addr, HTTPRequest *request,
+               ConnectionTable *connection_list);
+int add_client_connection(int requesting_sockfd, ConnectionTable *connection_list);
 int add_server_connection(int requesting_sockfd, int target_sockfd,
-                          HTTPRequest *request, Connection **connection_list);
+                          HTTPRequest *request, ConnectionTable *connection_list);
+ConnectionTable *create_connection_table();
 void clear_connection(Connection *connection);
-void remove_connection(int sockfd, fd_set *master, Connection **connection_list);
-Connection *search_connection(int sockfd, Connection **connection_list);
+void remove_connection(int sockfd, ConnectionTable *connection_list);
+void detach_connection(int sockfd, ConnectionTable *connection_list);
+Connection *search_connection(int sockfd, ConnectionTable *connection_list);
 
 int accept_client(int proxy);
+int set_nonblocking(int sockfd);
+long monotonic_usec();
 int write_to_socket(int sockfd, char *buffer, int buffer_length);
+int writev_available(int sockfd, struct iovec *iov, int count);
 int connect_to_server(char *hostname, int port_num);
+int connect_nonblocking(struct in_addr *addr, int port_num);
 int read_all(int sockfd, char **raw);
 int read_hdr(int sockfd, char **raw);
-int read_sockfd(int sockfd, char *buffer, Connection *connection);
-int header_not_completed(char *raw, int raw_len);
+int read_sockfd(int sockfd, Connection *connection);
+void release_buffer(Connection *connection);
+void queue_unsent(Connection *connection, struct iovec *iov, int count,
+                  int skip);
+int queued_bytes(Connection *connection);
+int has_unsent(Connection *connection);
+int send_unsent(Connection *connection);
+void clear_unsent(Connection *connection);
+int open_tunnel(Connection *connection);
+int splice_tunnel(Connection *connection, int target_sockfd);
+void close_tunnel(Connection *connection);
 void add_hdr(HTTPHeader **hdr, char *key, char *value);
 char *get_hdr_value(HTTPHeader *hdrs, const char *name);
+char *find_hdr(HTTPHeader *hdrs, const char *name);
 char *itoa_ap(int x);
 
 void free_hdr(HTTPHeader *hdr);
 void free_request(HTTPRequest *request);
 void free_response(HTTPResponse *response);
+void file_body(HTTPResponse *response);
+void free_body(HTTPResponse *response);
 void display_request(HTTPRequest *request);
 void display_response(HTTPResponse *response);
-HTTPHeader *parse_headers(int *offset, char **raw_ptr);
+void init_parser(HTTPParser *parser, int is_response);
+int parse_header(HTTPParser *parser, char *raw, int raw_len);
+HTTPRequest *parsed_request(HTTPParser *parser, char *raw, int length);
+HTTPResponse *parsed_response(HTTPParser *parser, char *raw);
+void init_decoder(BodyDecoder *decoder, HTTPResponse *response);
+int decode_body(BodyDecoder *decoder, HTTPResponse *response, char *data,
+                int length);
+int end_body(BodyDecoder *decoder, HTTPResponse *response);
 HTTPRequest *parse_request(int length, char *raw);
 HTTPResponse *parse_response(int length, char *raw);
-int construct_response(HTTPResponse *response, char **raw);
+int construct_response(HTTPResponse *response, int keep_alive, char **raw);
+char *get_header_block(HTTPResponse *response, int *length);
+void drop_header_block(HTTPResponse *response);
+int response_iovecs(HTTPResponse *response, int keep_alive, char *tail,
+                    struct iovec *iov);
+int construct_request(HTTPRequest *request, HTTPResponse *stale, char **raw);
+int construct_not_modified(HTTPResponse *response, int keep_alive, char **raw);
+char *serialize_headers(HTTPResponse *response, int *length);
+int is_hop_by_hop(const char *name);
+int is_conditional(const char *name);
+int is_server_error(const char *status);
+int is_not_modified_hdr(const char *name);
+int not_modified_since(HTTPHeader *hdrs, HTTPResponse *response);
+void set_hdr(HTTPHeader **hdrs, const char *name, const char *value);
+void remove_hdr(HTTPHeader **hdrs, const char *name);
+int is_persistent(char *version, HTTPHeader *hdrs);
 
 
 #endif /* AP_H */
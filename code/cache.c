@@ -1,19 +1,42 @@
 // Cache module
 #include "cache.h"
+#include "search_engine.h"
+#include "policy.h"
+#include "disk.h"
 
 // Global
 CacheObject *cache = NULL;
 FILE *cache_log;
-char *eviction_policy;
+EvictionPolicy *eviction_policy;
+pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+size_t cache_bytes = DEFAULT_CACHE_BYTES;           // budget
+size_t max_object_bytes = DEFAULT_MAX_OBJECT_BYTES;
+size_t cache_used = 0;                              // bytes charged so far
+CacheObject **expiry_heap = NULL;                   // soonest to be worthless first
+size_t expiry_size = 0, expiry_capacity = 0;
 
-void init_cache(char *eviction) {
+void demote(CacheObject *item);
+void expiry_swap(size_t i, size_t j);
+void expiry_up(size_t i);
+void expiry_down(size_t i);
+
+void init_cache(char *eviction, size_t max_bytes, size_t max_object) {
 
     cache_log = fopen("cache.log", "w");
     if (cache_log == NULL) {
         // fprintf(stderr, "Could not create cache logging file\n");
     }
-    eviction_policy = eviction;
-    fprintf(cache_log, "Eviction policy: %s\n\n", eviction);
+    if ((eviction_policy = find_policy(eviction)) == NULL) {
+        eviction_policy = find_policy(NULL); // LRU default
+    }
+    cache_bytes = max_bytes;
+    max_object_bytes = max_object;
+    if (eviction_policy->init) {
+        eviction_policy->init(cache_bytes);
+    }
+    fprintf(cache_log, "Eviction policy: %s\n", eviction_policy->name);
+    fprintf(cache_log, "Capacity: %zu bytes, objects up to %zu bytes\n\n",
+            cache_bytes, max_object_bytes);
     fflush(cache_log);
 }
 
@@ -24,156 +47,346 @@ HTTPResponse *get_data_from_cache(char *url) {
     struct tm* current_time = localtime(&s); 
 
     HASH_FIND_STR(cache, url, curr);
+    if (eviction_policy->lookup) {
+        eviction_policy->lookup(url);
+    }
 
-    if (curr != NULL) {
+    // stale objects stay until they are replaced or swept, but aren't served
+    if (curr != NULL && curr->expires > s) {
         fprintf(cache_log, "%02d:%02d:%02d FETCH %s\n", current_time->tm_hour, 
            current_time->tm_min, 
            current_time->tm_sec, url);
         fflush(cache_log);
         curr->last_accessed = time(NULL);
+        if (eviction_policy->used) {
+            eviction_policy->used(curr);
+        }
         return curr->response;
     }
     
     return NULL; 
 }
 
-HTTPResponse *check_cache_capacity() {
-    CacheObject *eviction_item = NULL;
-
-    // Returns the HTTPResponse if eviction is needed (i.e. cache is full)
-    // Returns NULL if cache is not full
-    if (HASH_COUNT(cache) >= MAX_CACHE_SIZE) { // Cache is full, must evict something 
-            // TODO: look for stale items first?
-            if (eviction_policy == NULL) {
-                eviction_item = lru_evict(); // LRU default
-            } else {
-              if (strcmp(eviction_policy, "lru") == 0) {
-                    eviction_item = lru_evict();
-                } else if (strcmp(eviction_policy, "mru") == 0) {
-                    eviction_item = mru_evict();
-                } else if (strcmp(eviction_policy, "random") == 0) {
-                    eviction_item = random_evict();
-                } else { // LRU default
-                    eviction_item = lru_evict();
-                }              
-            }
+/* Returns the stale copy of url if it is of the given use: to ask the
+ * server whether it is still good (see construct_request), or to be served
+ * as it is while we do (stale-while-revalidate) or because the server failed
+ * us (stale-if-error, RFC 5861). NULL if it has to be fetched again */
+HTTPResponse *get_stale_from_cache(char *url, int use) {
+    CacheObject *curr;
+    time_t s = time(NULL);
+    struct tm* current_time = localtime(&s); 
+    int usable = 0;
+
+    HASH_FIND_STR(cache, url, curr);
+    if (curr == NULL || curr->expires > s) {
+        return NULL;
+    }
+    if (use == STALE_TO_REVALIDATE) {
+        return can_revalidate(curr->response) ? curr->response : NULL;
     }
 
-    if (eviction_item != NULL) {
-        return eviction_item->response;
+    if (use == STALE_WHILE_REVALIDATE) {
+        usable = s < curr->expires + curr->stale_while_revalidate;
+    } else if (use == STALE_IF_ERROR) {
+        usable = s < curr->expires + curr->stale_if_error;
+    }
+    if (!usable) {
+        return NULL;
     }
 
-    return NULL;
-}
+    // it is served, so it counts as a hit
+    fprintf(cache_log, "%02d:%02d:%02d STALE %s\n", current_time->tm_hour,
+           current_time->tm_min, current_time->tm_sec, url);
+    fflush(cache_log);
+    curr->last_accessed = s;
+    if (eviction_policy->used) {
+        eviction_policy->used(curr);
+    }
 
+    return curr->response;
+}
 
-CacheObject *add_data_to_cache(char *url, HTTPResponse *response) {
-    CacheObject *curr = NULL;
-    CacheObject *eviction_item;
+/* Freshens the copy of url with the server's 304 for it (RFC 9111 4.3.4):
+ * the 304's headers replace the ones we had, the body and its keywords stay
+ * as they are. Returns the refreshed response, or NULL if it has been evicted
+ * since we asked */
+HTTPResponse *refresh_cache(char *url, HTTPResponse *not_modified) {
+    CacheObject *curr;
+    int lifetime;
     time_t s = time(NULL);
     struct tm* current_time = localtime(&s); 
 
-    HASH_FIND_STR(cache, url, curr); // Check if already in cache - if yes, probably want to modify age?
-
-    if (curr == NULL) { // Data is not in cache yet
-        if (HASH_COUNT(cache) >= MAX_CACHE_SIZE) { // Cache is full, must evict something 
-            // TODO: look for stale items first?
-            if (eviction_policy == NULL) {
-                eviction_item = lru_evict(); // LRU default
-                evict(eviction_item);
-            } else {
-              if (strcmp(eviction_policy, "lru") == 0) {
-                    eviction_item = lru_evict();
-                    evict(eviction_item);
-                } else if (strcmp(eviction_policy, "mru") == 0) {
-                    eviction_item = mru_evict();
-                    evict(eviction_item);
-                } else if (strcmp(eviction_policy, "random") == 0) {
-                    eviction_item = random_evict();
-                    evict(eviction_item);
-                } else { // LRU default
-                    eviction_item = lru_evict();
-                    evict(eviction_item);
-                }              
-            }
+    HASH_FIND_STR(cache, url, curr);
+    if (curr == NULL) {
+        return NULL;
+    }
+
+    // the length is of the body we have, not of the empty 304
+    for (HTTPHeader *hdr = not_modified->hdrs; hdr; hdr = hdr->next) {
+        if (!is_hop_by_hop(hdr->name) &&
+                strcasecmp(hdr->name, CONTENT_LENGTH) != 0) {
+            set_hdr(&(curr->response->hdrs), hdr->name, hdr->value);
         }
+    }
+    drop_header_block(curr->response);
+    curr->response->time_fetched = not_modified->time_fetched;
+    curr->response->initial_age = not_modified->initial_age;
+
+    // it is charged what it was when added, the policies know it by that size.
+    // If the server no longer wants it stored it is served this once
+    if ((lifetime = freshness_lifetime(curr->response)) < 0) {
+        curr->expires = curr->keep_until = s;
+        curr->stale_while_revalidate = curr->stale_if_error = 0;
+    } else {
+        set_expiry(curr, lifetime);
+    }
+    expiry_up(curr->expiry_index);
+    expiry_down(curr->expiry_index);
 
-        // Add to cache
-        curr = malloc(sizeof(CacheObject));
-        curr->url = strdup(url);
-        curr->response = response;
-        curr->last_accessed = time(NULL);
-        fprintf(cache_log, "%02d:%02d:%02d ADD %s\n", current_time->tm_hour, 
-           current_time->tm_min, 
-           current_time->tm_sec, url);
-        fflush(cache_log);
-        HASH_ADD_KEYPTR(hh, cache, curr->url, strlen(curr->url), curr);
+    fprintf(cache_log, "%02d:%02d:%02d REFRESH %s\n", current_time->tm_hour,
+           current_time->tm_min, current_time->tm_sec, url);
+    fflush(cache_log);
+    curr->last_accessed = s;
+    if (eviction_policy->used) {
+        eviction_policy->used(curr);
+    }
+
+    return curr->response;
+}
+
+/* Returns 1 if the response has a validator to ask the server about it with */
+int can_revalidate(HTTPResponse *response) {
+    char *etag = get_hdr_value(response->hdrs, ETAG);
+    char *last_modified = get_hdr_value(response->hdrs, LAST_MODIFIED);
+    int revalidate = etag != NULL || last_modified != NULL;
+
+    free(etag);
+    free(last_modified);
+
+    return revalidate;
+}
 
+/* Sets when the object goes stale, and until when it is still of some use
+ * after that: to be revalidated, or served stale where the server allows it.
+ * must-revalidate (and proxy-revalidate) rule out the latter */
+void set_expiry(CacheObject *item, int lifetime) {
+    char *cache_control = get_hdr_value(item->response->hdrs, CACHE_CONTROL);
+    int value;
+
+    item->expires = item->response->time_fetched - item->response->initial_age +
+                    lifetime;
+    item->stale_while_revalidate = item->stale_if_error = 0;
+    if (cache_control != NULL &&
+            !find_directive(cache_control, "must-revalidate", NULL) &&
+            !find_directive(cache_control, "proxy-revalidate", NULL)) {
+        if (find_directive(cache_control, "stale-while-revalidate", &value) &&
+                value > 0) {
+            item->stale_while_revalidate = value;
+        }
+        if (find_directive(cache_control, "stale-if-error", &value) && value > 0) {
+            item->stale_if_error = value;
+        }
     }
+    free(cache_control);
 
-    return curr;
+    item->keep_until = item->expires +
+                       (can_revalidate(item->response) ? STALE_RETENTION : 0);
+    if (item->expires + item->stale_while_revalidate > item->keep_until) {
+        item->keep_until = item->expires + item->stale_while_revalidate;
+    }
+    if (item->expires + item->stale_if_error > item->keep_until) {
+        item->keep_until = item->expires + item->stale_if_error;
+    }
 }
 
-CacheObject *lru_evict() {
-    CacheObject *curr, *lru, *tmp;
-    time_t s = time(NULL);
-    struct tm* current_time = localtime(&s); 
+/* Returns 1 if an object of this many bytes may be cached at all. Used to
+ * let huge downloads bypass the cache before their body is buffered */
+int fits_in_cache(size_t size) {
+    return size <= max_object_bytes && size <= cache_bytes;
+}
+
+/* Returns how many seconds the response stays fresh for (RFC 9111 4.2.1),
+ * or -1 if a shared cache must not store it at all */
+int freshness_lifetime(HTTPResponse *response) {
+    char *cache_control = get_hdr_value(response->hdrs, CACHE_CONTROL);
+    char *expires = get_hdr_value(response->hdrs, EXPIRES);
+    char *date = get_hdr_value(response->hdrs, DATE);
+    char *last_modified = get_hdr_value(response->hdrs, LAST_MODIFIED);
+    time_t sent = date != NULL ? curl_getdate(date, NULL) : -1;
+    time_t expiry, modified;
+    int lifetime = -1, value, status = atoi(response->status);
+
+    if (sent < 0) {
+        sent = response->time_fetched;
+    }
 
-    // Set the first object to the first entry in cache
-    HASH_ITER(hh, cache, lru, tmp) {
-        break;
-    }   
+    if (status < 200 || status == 206 || status == 304) {
+        lifetime = -1; // not a whole response, only part of one or none at all
+    } else if (cache_control != NULL && (find_directive(cache_control, "no-store", NULL) ||
+                                  find_directive(cache_control, "private", NULL))) {
+        lifetime = -1;
+    } else if (cache_control != NULL &&
+               find_directive(cache_control, "no-cache", NULL)) {
+        lifetime = 0; // may be stored, but has to be revalidated every time
+    } else if (cache_control != NULL &&
+               find_directive(cache_control, "s-maxage", &value)) {
+        lifetime = value; // meant for shared caches like us
+    } else if (cache_control != NULL &&
+               find_directive(cache_control, "max-age", &value)) {
+        lifetime = value;
+    } else if (expires != NULL) {
+        // an invalid date (like "0") means already expired
+        expiry = curl_getdate(expires, NULL);
+        lifetime = expiry > sent ? expiry - sent : 0;
+    } else if (status == 200 || status == 203 || status == 204 ||
+               status == 300 || status == 301 || status == 308 ||
+               status == 404 || status == 405 || status == 410 ||
+               status == 414 || status == 501) {
+        // heuristic: a fraction of how long it has gone unchanged, or if
+        // we can't tell that a short while, so repeat requests still hit
+        lifetime = DEFAULT_HEURISTIC_LIFETIME;
+        if (last_modified != NULL &&
+                (modified = curl_getdate(last_modified, NULL)) > 0 &&
+                modified < sent) {
+            lifetime = (sent - modified) / HEURISTIC_FRACTION;
+            if (lifetime > MAX_HEURISTIC_LIFETIME) {
+                lifetime = MAX_HEURISTIC_LIFETIME;
+            }
+        }
+    }
 
-    for (curr = cache; curr != NULL; curr = curr->hh.next) {
-        if (curr->last_accessed < lru->last_accessed) {
-            lru = curr;
-        }        
-    } 
+    free(cache_control);
+    free(expires);
+    free(date);
+    free(last_modified);
 
-    return lru;
+    return lifetime;
 }
 
-CacheObject *mru_evict() {
-    CacheObject *curr, *mru, *tmp;
+/* Returns 1 if the Cache-Control value has the directive, and its argument
+ * in value if it has one and value isn't NULL */
+int find_directive(char *cache_control, char *directive, int *value) {
+    size_t length = strlen(directive);
+    char *token = cache_control;
 
-    // Set the first object to the first entry in cache
-    HASH_ITER(hh, cache, mru, tmp) {
-        break;
-    }   
+    while (*token != '\0') {
+        while (*token == ' ' || *token == ',') {
+            token++;
+        }
+        if (strncasecmp(token, directive, length) == 0 &&
+                (token[length] == '\0' || token[length] == ',' ||
+                 token[length] == ' ' || token[length] == '=')) {
+            if (value != NULL) {
+                *value = token[length] == '=' ?
+                         atoi(token + length + 1 + (token[length + 1] == '"')) : 0;
+            }
+            return 1;
+        }
+        token += strcspn(token, ",");
+    }
+
+    return 0;
+}
 
-    for (curr = cache; curr != NULL; curr = curr->hh.next) {
-        if (curr->last_accessed > mru->last_accessed) {
-            mru = curr;
-        }        
-    } 
+/* Bytes an object is charged: the header, the body and what it takes to
+ * index it */
+size_t object_size(char *url, HTTPResponse *response) {
+    size_t size = sizeof(CacheObject) + sizeof(HTTPResponse) + strlen(url) + 1;
 
-    return mru;
+    size += strlen(response->version) + strlen(response->status) +
+            strlen(response->status_desc) + 3;
+    for (HTTPHeader *hdr = response->hdrs; hdr; hdr = hdr->next) {
+        size += sizeof(HTTPHeader) + strlen(hdr->name) + strlen(hdr->value) + 2;
+    }
+    size += response->total_body_length + 1;
+
+    return size;
 }
 
-CacheObject *random_evict() {
-    CacheObject *curr, *random, *tmp;
+/* Caches the response under url, evicting until it fits. Returns NULL if
+ * the response is too big or not allowed to be cached (or would be of no use
+ * straight away: stale, with no way to revalidate or serve it stale), the
+ * caller still owns it then */
+CacheObject *add_data_to_cache(char *url, HTTPResponse *response) {
+    CacheObject *curr = NULL, *item;
+    size_t size = object_size(url, response);
+    int lifetime = freshness_lifetime(response);
     time_t s = time(NULL);
     struct tm* current_time = localtime(&s); 
 
-    // Set the first object to the first entry in cache
-    HASH_ITER(hh, cache, random, tmp) {
-        break;
-    }
-
-    int count;
-    count = HASH_COUNT(cache);
-    srand(time(0)); // Use current time as seed for random generator 
-    int n = rand() % count;
-    // fprintf(stderr, "--- RANDOM IS %d", n);
-    for (curr = cache; curr != NULL; curr = curr->hh.next) {
-        if (n > 0) {
-            // fprintf(stderr, "changing\n");
-            random = curr;
-        } 
-        n--;
-    } 
-    
-    return random;
+    if ((item = malloc(sizeof(CacheObject))) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    item->response = response;
+    if (lifetime >= 0) {
+        set_expiry(item, lifetime);
+    }
+
+    if (lifetime < 0 || item->keep_until <= s) {
+        fprintf(cache_log, "%02d:%02d:%02d SKIP %s (not cacheable)\n",
+           current_time->tm_hour, current_time->tm_min, current_time->tm_sec,
+           url);
+        fflush(cache_log);
+        free(item);
+        return NULL;
+    }
+
+    if (!fits_in_cache(size)) {
+        fprintf(cache_log, "%02d:%02d:%02d BYPASS %s (%zu bytes)\n",
+           current_time->tm_hour, current_time->tm_min, current_time->tm_sec,
+           url, size);
+        fflush(cache_log);
+        free(item);
+        return NULL;
+    }
+
+    // a newer copy replaces the one we have, in memory or on disk
+    HASH_FIND_STR(cache, url, curr);
+    if (curr != NULL) {
+        evict(curr);
+    }
+    drop_from_disk(url);
+
+    // make room, one object may need several smaller ones to go
+    if (eviction_policy->incoming) {
+        eviction_policy->incoming(url, size);
+    }
+    while (cache_used + size > cache_bytes && cache != NULL) {
+        // whatever is worthless goes before anything that is still of use
+        if (expiry_size > 0 && expiry_heap[0]->keep_until <= s) {
+            evict(expiry_heap[0]);
+        } else {
+            demote(eviction_policy->victim());
+        }
+    }
+
+    // Add to cache, a large body is sent from a file from now on
+    file_body(response);
+    curr = item;
+    curr->url = strdup(url);
+    curr->last_accessed = time(NULL);
+    curr->size = size;
+    cache_used += size;
+    fprintf(cache_log, "%02d:%02d:%02d ADD %s (%zu bytes, %zu/%zu used)\n",
+       current_time->tm_hour, current_time->tm_min, current_time->tm_sec,
+       url, size, cache_used, cache_bytes);
+    fflush(cache_log);
+    HASH_ADD_KEYPTR(hh, cache, curr->url, strlen(curr->url), curr);
+    eviction_policy->added(curr);
+
+    // keep track of when it is no longer worth keeping
+    if (expiry_size == expiry_capacity) {
+        expiry_capacity = expiry_capacity ? 2 * expiry_capacity : INITIAL_EXPIRY_HEAP;
+        if ((expiry_heap = (CacheObject **) realloc(expiry_heap, expiry_capacity *
+                                                    sizeof(CacheObject *))) == NULL) {
+            error_out("Couldn't realloc!");
+        }
+    }
+    curr->expiry_index = expiry_size;
+    expiry_heap[expiry_size++] = curr;
+    expiry_up(curr->expiry_index);
+
+    return curr;
 }
 
 void evict(CacheObject *item) {
@@ -185,12 +398,124 @@ void evict(CacheObject *item) {
            current_time->tm_sec, item->url);
     fflush(cache_log);
     HASH_DEL(cache, item);
+    eviction_policy->removed(item);
+    expiry_size--;
+    if (item->expiry_index != expiry_size) {
+        size_t i = item->expiry_index;
+        expiry_swap(i, expiry_size);
+        expiry_up(i);
+        expiry_down(i);
+    }
+    cache_used -= item->size;
+    // the search engine must stop pointing at it too (see demote)
+    if (item->response != NULL) {
+        remove_keywords_from_keywords_table(item);
+    }
     free_response(item->response);
+    free(item->url);
     free(item);   
 }
 
+/* Evicts the object to make room. If it is still fresh it moves to the disk
+ * tier, which takes its headers and writes out its body. The disk tier isn't
+ * searched, so its keywords go either way */
+void demote(CacheObject *item) {
+    time_t s = time(NULL);
+    struct tm* current_time = localtime(&s); 
+
+    if (item->expires > s) {
+        remove_keywords_from_keywords_table(item);
+        for (int i = 0; i < NUM_KEYWORDS; i++) {
+            free(item->response->keywords[i]);
+            item->response->keywords[i] = NULL;
+        }
+        if (demote_to_disk(item->url, item->response, item->expires)) {
+            fprintf(cache_log, "%02d:%02d:%02d DEMOTE %s\n", current_time->tm_hour,
+                   current_time->tm_min, current_time->tm_sec, item->url);
+            fflush(cache_log);
+            item->response = NULL;
+        }
+    }
+    evict(item);
+}
+
+/* Evicts everything that has expired and can't be revalidated or served
+ * stale (or has been stale too long to bother). Called periodically, so stale objects don't sit
+ * around until space runs out */
+void sweep_expired_cache() {
+    time_t now = time(NULL);
+
+    while (expiry_size > 0 && expiry_heap[0]->keep_until <= now) {
+        evict(expiry_heap[0]);
+    }
+}
+
+/* Returns everything in the cache in the order the eviction policy keeps it,
+ * oldest first, in an array that is the caller's to free. count is set to
+ * how many there are */
+CacheObject **cached_objects(size_t *count) {
+    CacheObject **objects, *curr;
+    size_t i = 0;
+
+    *count = HASH_COUNT(cache);
+    if ((objects = (CacheObject **) malloc((*count + 1) * sizeof(CacheObject *))) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    for (curr = eviction_policy->walk(NULL); curr != NULL && i < *count;
+         curr = eviction_policy->walk(curr)) {
+        objects[i++] = curr;
+    }
+
+    return objects;
+}
+
+void expiry_swap(size_t i, size_t j) {
+    CacheObject *item = expiry_heap[i];
+
+    expiry_heap[i] = expiry_heap[j];
+    expiry_heap[j] = item;
+    expiry_heap[i]->expiry_index = i;
+    expiry_heap[j]->expiry_index = j;
+}
+
+void expiry_up(size_t i) {
+    while (i > 0 && expiry_heap[(i - 1) / 2]->keep_until > expiry_heap[i]->keep_until) {
+        expiry_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+void expiry_down(size_t i) {
+    size_t soonest, child;
+
+    while (1) {
+        soonest = i;
+        for (child = 2 * i + 1; child <= 2 * i + 2 && child < expiry_size; child++) {
+            if (expiry_heap[child]->keep_until < expiry_heap[soonest]->keep_until) {
+                soonest = child;
+            }
+        }
+        if (soonest == i) {
+            return;
+        }
+        expiry_swap(i, soonest);
+        i = soonest;
+    }
+}
+
 void destroy_cache() {
     fclose(cache_log);
 }
 
+// The cache and the keywords table are shared by every worker thread. Hold
+// the lock for as long as a response handed out by the cache is being used,
+// otherwise another worker may evict it from under us.
+void cache_lock() {
+    pthread_mutex_lock(&cache_mutex);
+}
+
+void cache_unlock() {
+    pthread_mutex_unlock(&cache_mutex);
+}
+
 
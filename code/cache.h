@@ -1,25 +1,61 @@
 // Cache module
 // key = url, value = HTTPResponse
 
+#ifndef CACHE_H
+#define CACHE_H
+
 #include "ap_utilities.h"
+#include "uthash/src/utlist.h"
 
 
-#define MAX_CACHE_SIZE 3
+#define DEFAULT_CACHE_BYTES (64 * 1024 * 1024)      // whole cache
+#define DEFAULT_MAX_OBJECT_BYTES (8 * 1024 * 1024)  // anything bigger bypasses it
+#define HEURISTIC_FRACTION 10                       // of the time since Last-Modified
+#define MAX_HEURISTIC_LIFETIME (24 * 60 * 60)
+#define DEFAULT_HEURISTIC_LIFETIME 60               // with nothing to go on at all
+#define INITIAL_EXPIRY_HEAP 1024
+#define STALE_RETENTION (60 * 60)  // how long stale objects with validators are
+                                   // kept around to be revalidated
+#define STALE_NEVER -1             // what a stale object is wanted for, see
+#define STALE_TO_REVALIDATE 0      // get_stale_from_cache
+#define STALE_WHILE_REVALIDATE 1
+#define STALE_IF_ERROR 2
 
 typedef struct CacheObject {
 	char *url; // Key value
 	HTTPResponse *response;
     time_t last_accessed;
+    size_t size; // bytes charged against the cache budget
+    struct CacheObject *prev, *next; // the eviction policy's queue it is on
+    int queue;                       // ...which one that is
+    int freq;                        // hits, as the eviction policy counts them
+    time_t expires;                  // stale from then on
+    time_t keep_until;               // worthless from then on
+    int stale_while_revalidate;      // seconds it may be served stale for
+    int stale_if_error;              // ...and if the server fails us
+    size_t expiry_index;             // where it is in the expiry heap
+    double priority;                 // GDSF: the lowest is evicted first
+    size_t heap_index;               // GDSF: where it is in the heap
 	UT_hash_handle hh;
 } CacheObject;
 
 
 CacheObject *add_data_to_cache(char *url, HTTPResponse *response);
 HTTPResponse *get_data_from_cache(char *url);
-HTTPResponse *check_cache_capacity();
-CacheObject *lru_evict();
-CacheObject *mru_evict();
-CacheObject *random_evict();
+HTTPResponse *get_stale_from_cache(char *url, int use);
+HTTPResponse *refresh_cache(char *url, HTTPResponse *not_modified);
+int can_revalidate(HTTPResponse *response);
+void set_expiry(CacheObject *item, int lifetime);
+int fits_in_cache(size_t size);
+int freshness_lifetime(HTTPResponse *response);
+int find_directive(char *cache_control, char *directive, int *value);
+void sweep_expired_cache();
+CacheObject **cached_objects(size_t *count);
+size_t object_size(char *url, HTTPResponse *response);
 void evict(CacheObject *item);
-void init_cache(char *eviction);
+void init_cache(char *eviction, size_t max_bytes, size_t max_object);
 void destroy_cache();
+void cache_lock();
+void cache_unlock();
+
+#endif /* CACHE_H */
@@ -0,0 +1,179 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Unit test for decoding chunked bodies: split *
+ *                               anywhere they must decode the same, and      *
+ *                               broken ones must be found out                *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+#include "ap_utilities.h"
+
+#define CHUNKED_HEADER "HTTP/1.1 200 OK" CRLF "Transfer-Encoding: chunked" CRLF CRLF
+#define CUT_SHORT "5\r\nhello\r\n0\r\n"  // the server went before the end
+
+
+//
+// Data Structures
+//
+typedef struct ChunkedCase {
+    /* A chunked body as a server may send it, and what it should decode
+     * into. A malformed one has a NULL body */
+    const char *name;
+    const char *raw;
+    const char *body;
+} ChunkedCase;
+
+
+//
+// Globals
+//
+ChunkedCase chunked_cases[] = {
+    {"chunks", "5\r\nhello\r\n7\r\n, world\r\n0\r\n\r\n", "hello, world"},
+    {"hex sizes", "A\r\n0123456789\r\nf\r\nabcdefghijklmno\r\n0\r\n\r\n",
+     "0123456789abcdefghijklmno"},
+    {"extensions", "5;name=value\r\nhello\r\n0;last\r\n\r\n", "hello"},
+    {"trailers", "5\r\nhello\r\n0\r\nExpires: never\r\nX-Check: 1\r\n\r\n",
+     "hello"},
+    {"LF lines", "5\nhello\n0\n\n", "hello"},
+    {"empty", "0\r\n\r\n", ""},
+    {"what follows ignored", "5\r\nhello\r\n0\r\n\r\nHTTP/1.1 200 OK\r\n", "hello"},
+    {"no size", "\r\nhello\r\n0\r\n\r\n", NULL},
+    {"not hex", "5z\r\nhello\r\n0\r\n\r\n", NULL},
+    {"data too long", "5\r\nhello!\r\n0\r\n\r\n", NULL},
+    {"oversized chunk", "fffffffff\r\n", NULL},
+};
+
+
+//
+// Forward Declarations
+//
+int check_case(ChunkedCase *test);
+int decode_split(ChunkedCase *test, int split, int step);
+int check_cut_short();
+HTTPResponse *chunked_response();
+
+
+//
+// Implementation
+//
+int main() {
+    /* Runs every case. Exits non-zero if any of them failed */
+
+    int num_cases = sizeof(chunked_cases) / sizeof(chunked_cases[0]);
+    int failures = 0;
+
+    for (int i = 0; i < num_cases; i++) {
+        failures += check_case(&chunked_cases[i]);
+    }
+    failures += check_cut_short();
+    if (failures == 0) {
+        printf("--------- CHUNKED PASSED --------\n");
+    } else {
+        printf("--------- CHUNKED FAILED --------\n");
+    }
+
+    return failures != 0;
+}
+
+
+int check_case(ChunkedCase *test) {
+    /* Decodes the case in two pieces split at every byte, and a byte at a
+     * time. Returns 1 if any of them went wrong */
+
+    int length = strlen(test->raw);
+
+    for (int split = 0; split <= length; split++) {
+        if (decode_split(test, split, length) != 0) {
+            fprintf(stderr, "%s: split at %d went wrong\n", test->name, split);
+            return 1;
+        }
+    }
+    if (decode_split(test, 0, 1) != 0) {
+        fprintf(stderr, "%s: a byte at a time went wrong\n", test->name);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+int decode_split(ChunkedCase *test, int split, int step) {
+    /* Hands the decoder the first split bytes, then the rest step at a time.
+     * Everything before the end must leave it wanting more, then it must
+     * finish with the body (or find it malformed, and never finish).
+     * Returns 1 if it didn't */
+
+    HTTPResponse *response = chunked_response();
+    BodyDecoder decoder;
+    char *raw = strdup(test->raw);
+    int length = strlen(raw), offset = 0, take, status, failed;
+
+    init_decoder(&decoder, response);
+    status = decode_body(&decoder, response, raw, split);
+    for (offset = split; status == PARSE_INCOMPLETE && offset < length;
+         offset += take) {
+        take = length - offset < step ? length - offset : step;
+        status = decode_body(&decoder, response, raw + offset, take);
+    }
+
+    if (test->body == NULL) {
+        failed = status != PARSE_MALFORMED;
+    } else {
+        // once it is whole the length it is sent on with replaces the
+        // chunking, and the server closing can't end it in its place
+        failed = status != BODY_COMPLETE ||
+                 response->body_length != (int) strlen(test->body) ||
+                 memcmp(response->body, test->body, response->body_length) != 0 ||
+                 find_hdr(response->hdrs, TRANSFER_ENCODING) != NULL ||
+                 find_hdr(response->hdrs, CONTENT_LENGTH) == NULL ||
+                 atoi(find_hdr(response->hdrs, CONTENT_LENGTH)) !=
+                 response->body_length ||
+                 end_body(&decoder, response) != PARSE_MALFORMED;
+    }
+
+    free_response(response);
+    free(raw);
+    return failed;
+}
+
+
+int check_cut_short() {
+    /* A body the server stops sending part way through must not pass for a
+     * whole one when it closes. Returns 1 if it did */
+
+    HTTPResponse *response = chunked_response();
+    BodyDecoder decoder;
+    char *raw = strdup(CUT_SHORT);
+    int failed;
+
+    init_decoder(&decoder, response);
+    failed = decode_body(&decoder, response, raw, strlen(raw)) != PARSE_INCOMPLETE ||
+             end_body(&decoder, response) != PARSE_MALFORMED;
+    if (failed) {
+        fprintf(stderr, "cut short: passed for a whole body\n");
+    }
+
+    free_response(response);
+    free(raw);
+    return failed;
+}
+
+
+HTTPResponse *chunked_response() {
+    /* Returns a response whose body is chunked, none of it in yet */
+
+    char *raw = strdup(CHUNKED_HEADER);
+    HTTPResponse *response = parse_response(strlen(raw), raw);
+
+    if (response == NULL) {
+        error_out("The chunked header didn't parse!");
+    }
+    free(raw);
+
+    return response;
+}
@@ -0,0 +1,363 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: A second, much larger tier for the cache on  *
+ *                               local disk. Objects evicted from memory are  *
+ *                               appended to segment files and served from    *
+ *                               there with sendfile                          *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Interface
+//
+#include "disk.h"
+
+
+//
+// Globals
+//
+char *disk_dir = NULL;           // NULL while the tier is off
+size_t disk_bytes = DEFAULT_DISK_BYTES;
+size_t segment_bytes = SEGMENT_BYTES;
+size_t disk_used = 0;            // bytes in the segments, live or not
+int next_segment = 0;
+Segment *segments = NULL;        // oldest first, the last one is appended to
+DiskObject *disk_index = NULL;
+
+// demotions waiting for the writer thread (FIFO)
+DiskWrite *writes_head = NULL, *writes_tail = NULL;
+pthread_mutex_t writes_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t writes_cond = PTHREAD_COND_INITIALIZER;
+
+
+//
+// Forward Declarations
+//
+Segment *open_segment();
+void drop_segment(Segment *segment);
+void remove_disk_object(DiskObject *object);
+void free_disk_object(DiskObject *object);
+void queue_write(DiskWrite *job);
+void *run_disk_writer(void *arg);
+int write_at(int fd, char *buffer, size_t length, off_t offset);
+
+
+//
+// Implementation
+//
+void init_disk(char *dir, size_t max_bytes) {
+    /* Turns the tier on, keeping its segments in dir, and starts the thread
+     * that writes them. Whatever segments a previous run left there are of
+     * no use without their index */
+
+    DIR *entries;
+    struct dirent *entry;
+    char path[PATH_MAX];
+    pthread_t thread;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        error_out("Couldn't create the disk cache directory!");
+    }
+    if ((entries = opendir(dir)) == NULL) {
+        error_out("Couldn't open the disk cache directory!");
+    }
+    while ((entry = readdir(entries)) != NULL) {
+        if (strncmp(entry->d_name, SEGMENT_PREFIX, strlen(SEGMENT_PREFIX)) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(entries);
+
+    disk_dir = strdup(dir);
+    disk_bytes = max_bytes;
+    if (disk_bytes / MIN_SEGMENTS < segment_bytes) {
+        segment_bytes = disk_bytes / MIN_SEGMENTS;
+    }
+    if (pthread_create(&thread, NULL, run_disk_writer, NULL) != 0) {
+        error_out("Couldn't start the disk writer!");
+    }
+    pthread_detach(thread);
+}
+
+
+int demote_to_disk(char *url, HTTPResponse *response, time_t expires) {
+    /* Makes room for the object at the end of the newest segment, dropping
+     * the oldest ones if the tier is full, and hands it to the writer
+     * thread. It is served from memory until the write lands. Returns 1 if
+     * the tier took it, it then owns the response, 0 if the caller still
+     * does */
+
+    DiskRecord record;
+    DiskObject *object;
+    DiskWrite *job;
+    Segment *segment;
+    char *headers;
+    int header_length;
+    size_t url_length = strlen(url), length;
+
+    if (disk_dir == NULL) {
+        return 0;
+    }
+    headers = serialize_headers(response, &header_length);
+    length = sizeof(record) + url_length + header_length + response->body_length;
+    if (length > segment_bytes) {
+        free(headers);
+        return 0;
+    }
+
+    // the newest segment takes it if there is room, else a new one does
+    segment = segments != NULL ? segments->prev : NULL;
+    if (segment == NULL || segment->size + length > segment_bytes) {
+        while (segments != NULL && disk_used + segment_bytes > disk_bytes) {
+            drop_segment(segments);
+        }
+        if ((segment = open_segment()) == NULL) {
+            free(headers);
+            return 0;
+        }
+    }
+
+    // a copy we had of it before is out of date
+    drop_from_disk(url);
+
+    record.magic = DISK_MAGIC;
+    record.url_length = url_length;
+    record.header_length = header_length;
+    record.body_length = response->body_length;
+    record.time_fetched = response->time_fetched;
+    record.expires = expires;
+    record.initial_age = response->initial_age;
+    record.padding = 0;
+    if ((job = (DiskWrite *) malloc(sizeof(DiskWrite))) == NULL ||
+            (job->head = (char *) malloc(sizeof(record) + url_length +
+                                           header_length)) == NULL ||
+            (object = (DiskObject *) malloc(sizeof(DiskObject))) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    if ((job->fd = dup(segment->fd)) < 0) {
+        error_declare("Couldn't write to the disk cache!");
+        free(job->head);
+        free(job);
+        free(object);
+        free(headers);
+        return 0;
+    }
+    memcpy(job->head, &record, sizeof(record));
+    memcpy(job->head + sizeof(record), url, url_length);
+    memcpy(job->head + sizeof(record) + url_length, headers, header_length);
+    job->head_length = sizeof(record) + url_length + header_length;
+    job->offset = segment->size;
+    free(headers);
+
+    // its room is taken now, whether or not the write goes through
+    object->url = strdup(url);
+    object->response = response;
+    object->writing = 1;
+    object->segment = segment;
+    object->offset = job->offset + job->head_length;
+    object->length = response->body_length;
+    object->expires = expires;
+    segment->size += length;
+    disk_used += length;
+    DL_APPEND(segment->objects, object);
+    HASH_ADD_KEYPTR(hh, disk_index, object->url, strlen(object->url), object);
+
+    job->object = object;
+    queue_write(job);
+
+    return 1;
+}
+
+
+DiskObject *get_data_from_disk(char *url) {
+    /* Returns the object if the tier has it and it is still fresh. The
+     * tier has no way to revalidate, stale objects are dropped */
+
+    DiskObject *object;
+
+    HASH_FIND_STR(disk_index, url, object);
+    if (object != NULL && object->expires <= time(NULL)) {
+        remove_disk_object(object);
+        object = NULL;
+    }
+
+    return object;
+}
+
+
+int open_disk_body(DiskObject *object) {
+    /* Returns a descriptor the object's body can be read from at its offset.
+     * It stays readable after the lock is let go, even if the segment is
+     * dropped meanwhile, and is the caller's to close */
+
+    return dup(object->segment->fd);
+}
+
+
+void drop_from_disk(char *url) {
+    /* Forgets the tier's copy of url, if it has one. Its bytes are reclaimed
+     * when its segment is dropped */
+
+    DiskObject *object;
+
+    HASH_FIND_STR(disk_index, url, object);
+    if (object != NULL) {
+        remove_disk_object(object);
+    }
+}
+
+
+Segment *open_segment() {
+    /* Creates a new segment to append to */
+
+    Segment *segment;
+    char path[PATH_MAX];
+
+    if ((segment = (Segment *) malloc(sizeof(Segment))) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    segment->id = next_segment++;
+    snprintf(path, sizeof(path), "%s/" SEGMENT_PREFIX "%d", disk_dir, segment->id);
+    if ((segment->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+        error_declare("Couldn't create a disk cache segment!");
+        free(segment);
+        return NULL;
+    }
+    segment->size = 0;
+    segment->objects = NULL;
+    DL_APPEND(segments, segment);
+
+    return segment;
+}
+
+
+void drop_segment(Segment *segment) {
+    /* Drops the segment and everything still in it. Bodies being sent from
+     * it keep their own descriptor (see open_disk_body) */
+
+    char path[PATH_MAX];
+
+    while (segment->objects != NULL) {
+        remove_disk_object(segment->objects);
+    }
+    DL_DELETE(segments, segment);
+    disk_used -= segment->size;
+    close(segment->fd);
+    snprintf(path, sizeof(path), "%s/" SEGMENT_PREFIX "%d", disk_dir, segment->id);
+    unlink(path);
+    free(segment);
+}
+
+
+void remove_disk_object(DiskObject *object) {
+    /* Takes the object out of the index and its segment. One still being
+     * written is freed by the writer thread when it is done with it */
+
+    HASH_DEL(disk_index, object);
+    DL_DELETE(object->segment->objects, object);
+    object->segment = NULL;
+    if (!object->writing) {
+        free_disk_object(object);
+    }
+}
+
+
+void free_disk_object(DiskObject *object) {
+    /* Frees the DiskObject structure */
+
+    free_response(object->response);
+    free(object->url);
+    free(object);
+}
+
+
+void queue_write(DiskWrite *job) {
+    /* Hands the write to the writer thread */
+
+    job->next = NULL;
+    pthread_mutex_lock(&writes_mutex);
+    if (writes_tail != NULL) {
+        writes_tail->next = job;
+    } else {
+        writes_head = job;
+    }
+    writes_tail = job;
+    pthread_cond_signal(&writes_cond);
+    pthread_mutex_unlock(&writes_mutex);
+}
+
+
+void *run_disk_writer(void *arg) {
+    /* Writer thread: appends demoted objects to their segments so the event
+     * loops never wait on the disk, then lets go of their bodies */
+
+    DiskWrite *job;
+    DiskObject *object;
+    int failed;
+
+    (void) arg;
+    while (1) {
+        pthread_mutex_lock(&writes_mutex);
+        while (writes_head == NULL) {
+            pthread_cond_wait(&writes_cond, &writes_mutex);
+        }
+        job = writes_head;
+        if ((writes_head = job->next) == NULL) {
+            writes_tail = NULL;
+        }
+        pthread_mutex_unlock(&writes_mutex);
+
+        // the body is only read meanwhile, and isn't freed until writing is
+        // cleared
+        object = job->object;
+        failed = write_at(job->fd, job->head, job->head_length,
+                          job->offset) < 0 ||
+                 write_at(job->fd, object->response->body, object->length,
+                          object->offset) < 0;
+        close(job->fd);
+        free(job->head);
+        free(job);
+
+        // from now on it is served from its segment, unless it was dropped
+        // meanwhile or couldn't be written
+        cache_lock();
+        object->writing = 0;
+        if (object->segment == NULL) {
+            free_disk_object(object);
+        } else if (failed) {
+            error_declare("Couldn't write to the disk cache!");
+            remove_disk_object(object);
+        } else {
+            free_body(object->response);
+            object->response->body_length = 0;
+        }
+        cache_unlock();
+    }
+
+    return NULL;
+}
+
+
+int write_at(int fd, char *buffer, size_t length, off_t offset) {
+    /* Writes all of the buffer to the file at offset, returns -1 if it
+     * couldn't */
+
+    ssize_t written;
+
+    while (length > 0) {
+        if ((written = pwrite(fd, buffer, length, offset)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+        offset += written;
+    }
+
+    return 0;
+}
@@ -0,0 +1,98 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Header for the disk tier of the cache        *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+
+#ifndef DISK_H
+#define DISK_H
+
+
+#include <stdint.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "ap_utilities.h"
+#include "cache.h"
+#include "uthash/src/utlist.h"
+
+#define DEFAULT_DISK_BYTES (4ULL * 1024 * 1024 * 1024)
+#define SEGMENT_BYTES (64 * 1024 * 1024)  // at most, see init_disk
+#define MIN_SEGMENTS 4      // so dropping the oldest only loses part of it
+#define SEGMENT_PREFIX "segment."
+#define DISK_MAGIC 0x70637364  // "pcsd"
+
+
+//
+// Data Structures
+//
+typedef struct DiskRecord {
+    /* What an object starts with in its segment, so a segment can be read
+     * back without the index. The url, the status line and headers, then
+     * the body follow it */
+    uint32_t magic;
+    uint32_t url_length;
+    uint32_t header_length;
+    uint32_t body_length;
+    int64_t time_fetched;
+    int64_t expires;
+    int32_t initial_age;
+    int32_t padding;
+} DiskRecord;
+
+typedef struct DiskObject {
+    /* An object the memory tier evicted while it was still fresh. Its
+     * headers stay in memory, the body is read from its segment once the
+     * writer thread has put it there */
+    char *url; // key
+    HTTPResponse *response;          // headers only, body is NULL once written
+    int writing;                     // ...until then it is served from memory
+    struct Segment *segment;
+    off_t offset;                    // of the body in the segment
+    size_t length;                   // ...and its length
+    time_t expires;
+    struct DiskObject *prev, *next;  // the segment's objects
+    UT_hash_handle hh;
+} DiskObject;
+
+typedef struct DiskWrite {
+    /* An object on its way to its segment. The cache isn't locked while it
+     * is written, the body is only read and stays the object's */
+    DiskObject *object;
+    int fd;                          // our own descriptor of its segment
+    off_t offset;                    // of its record
+    char *head;                      // its record, url and headers
+    size_t head_length;
+    struct DiskWrite *next;
+} DiskWrite;
+
+typedef struct Segment {
+    /* An append-only file of objects. When the tier is full the oldest
+     * segment is dropped whole, with whatever is still in it */
+    int id;
+    int fd;
+    size_t size;
+    DiskObject *objects;
+    struct Segment *prev, *next;
+} Segment;
+
+
+//
+// Forward Declarations
+//
+// The disk tier is shared by every worker like the memory tier, and is
+// guarded by the same lock (see cache_lock)
+void init_disk(char *dir, size_t max_bytes);
+int demote_to_disk(char *url, HTTPResponse *response, time_t expires);
+DiskObject *get_data_from_disk(char *url);
+int open_disk_body(DiskObject *object);
+void drop_from_disk(char *url);
+
+
+#endif /* DISK_H */
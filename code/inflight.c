@@ -0,0 +1,136 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Coalesces concurrent misses on the same URL  *
+ *                               so a popular page that just expired is only  *
+ *                               fetched from the origin once                 *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Interface
+//
+#include "inflight.h"
+
+
+//
+// Implementation
+//
+Fetch *find_fetch(Fetch **fetches, char *url) {
+    /* Returns the fetch in flight for url, or NULL if there is none */
+
+    Fetch *fetch;
+
+    HASH_FIND_STR(*fetches, url, fetch);
+
+    return fetch;
+}
+
+
+Fetch *start_fetch(Fetch **fetches, char *url, int sockfd, unsigned long serial) {
+    /* Records that the client on sockfd is fetching url from the origin */
+
+    Fetch *fetch;
+
+    if ((fetch = (Fetch *) malloc(sizeof(Fetch))) == NULL ||
+            (fetch->url = strdup(url)) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    fetch->sockfd = sockfd;
+    fetch->serial = serial;
+    fetch->relayed = NULL;
+    fetch->relayed_len = 0;
+    fetch->relayed_room = 0;
+    fetch->closed = 0;
+    fetch->waiters = NULL;
+    HASH_ADD_KEYPTR(hh, *fetches, fetch->url, strlen(fetch->url), fetch);
+
+    return fetch;
+}
+
+
+void add_waiter(Fetch *fetch, int sockfd, unsigned long serial) {
+    /* Attaches the client on sockfd to the fetch */
+
+    Waiter *waiter;
+
+    if ((waiter = (Waiter *) malloc(sizeof(Waiter))) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    waiter->sockfd = sockfd;
+    waiter->serial = serial;
+    waiter->next = fetch->waiters;
+    fetch->waiters = waiter;
+}
+
+
+Waiter *take_waiter(Fetch *fetch) {
+    /* Takes the longest waiting client off the fetch, NULL if there is none.
+     * Freeing it is up to the caller */
+
+    Waiter **link = &(fetch->waiters), *waiter;
+
+    if (*link == NULL) {
+        return NULL;
+    }
+    while ((*link)->next != NULL) {
+        link = &((*link)->next);
+    }
+    waiter = *link;
+    *link = NULL;
+
+    return waiter;
+}
+
+
+void record_fetch(Fetch *fetch, char *data, int length) {
+    /* Keeps a copy of bytes relayed from the origin, a client that attaches
+     * later is sent these first. The copy doubles as it fills, so keeping
+     * a response costs about as much as the response */
+
+    if (fetch->closed) {
+        return;
+    }
+    if (fetch->relayed_len + length > fetch->relayed_room) {
+        if (fetch->relayed_room == 0) {
+            fetch->relayed_room = INITIAL_RELAYED_ROOM;
+        }
+        while (fetch->relayed_len + length > fetch->relayed_room) {
+            fetch->relayed_room *= 2;
+        }
+        if ((fetch->relayed = (char *) realloc(fetch->relayed,
+                                               fetch->relayed_room)) == NULL) {
+            error_out("Couldn't realloc!");
+        }
+    }
+    memcpy(fetch->relayed + fetch->relayed_len, data, length);
+    fetch->relayed_len += length;
+}
+
+
+void close_fetch(Fetch *fetch) {
+    /* The response won't be cached, so it isn't kept for clients that come
+     * later either: they go to the origin themselves. Those waiting already
+     * are still streamed the rest */
+
+    free(fetch->relayed);
+    fetch->relayed = NULL;
+    fetch->relayed_len = fetch->relayed_room = 0;
+    fetch->closed = 1;
+}
+
+
+Waiter *end_fetch(Fetch **fetches, Fetch *fetch) {
+    /* Takes the fetch out of the table and frees it. Its waiters are handed
+     * back, seeing to them (and freeing them) is up to the caller */
+
+    Waiter *waiters = fetch->waiters;
+
+    HASH_DEL(*fetches, fetch);
+    free(fetch->relayed);
+    free(fetch->url);
+    free(fetch);
+
+    return waiters;
+}
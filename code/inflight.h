@@ -0,0 +1,60 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Header for the table of fetches that are     *
+ *                               in flight, so concurrent misses on the same  *
+ *                               URL share a single trip to the origin        *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+
+#include "ap_utilities.h"
+
+#define INITIAL_RELAYED_ROOM 4096  // doubled as the response comes in
+
+
+//
+// Data Structures
+//
+typedef struct Waiter {
+    /* A client that asked for a URL while someone else was fetching it */
+    int sockfd;
+    unsigned long serial;  // ...and which client on that sockfd it was
+    struct Waiter *next;
+} Waiter;
+
+typedef struct Fetch {
+    /* A miss on its way back from the origin */
+    char *url; // key
+    int sockfd;            // the client whose miss started the fetch
+    unsigned long serial;
+    char *relayed;         // everything relayed so far, for late waiters
+    int relayed_len;
+    int relayed_room;
+    int closed;            // the response won't be cached, nobody may join
+    Waiter *waiters;
+    UT_hash_handle hh;
+} Fetch;
+
+
+//
+// Forward Declarations
+//
+Fetch *find_fetch(Fetch **fetches, char *url);
+Fetch *start_fetch(Fetch **fetches, char *url, int sockfd, unsigned long serial);
+void add_waiter(Fetch *fetch, int sockfd, unsigned long serial);
+Waiter *take_waiter(Fetch *fetch);
+void record_fetch(Fetch *fetch, char *data, int length);
+void close_fetch(Fetch *fetch);
+Waiter *end_fetch(Fetch **fetches, Fetch *fetch);
+
+
+#endif /* INFLIGHT_H */
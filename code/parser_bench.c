@@ -0,0 +1,369 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Microbenchmark for header parsing: the old   *
+ *                               parse_headers() against the incremental      *
+ *                               parser on each scanning kernel               *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+#include "ap_utilities.h"
+
+#define DEFAULT_ITERATIONS 100000
+#define READ_SIZE 512  // headers arrive over several reads like this
+
+
+//
+// Data Structures
+//
+typedef struct HeaderSet {
+    /* A captured header, as it came over the wire */
+    const char *name;
+    int is_response;
+    const char *raw;
+} HeaderSet;
+
+
+//
+// Globals
+//
+HeaderSet header_sets[] = {
+    {"chrome navigation", 0,
+     "GET http://www.example.com/news/2019/04/index.html?ref=front HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "Proxy-Connection: keep-alive\r\n"
+     "Upgrade-Insecure-Requests: 1\r\n"
+     "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_14_4) AppleWebKit/537.36 "
+     "(KHTML, like Gecko) Chrome/73.0.3683.103 Safari/537.36\r\n"
+     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,"
+     "image/apng,*/*;q=0.8,application/signed-exchange;v=b3\r\n"
+     "Referer: http://www.example.com/\r\n"
+     "Accept-Encoding: gzip, deflate\r\n"
+     "Accept-Language: en-US,en;q=0.9\r\n"
+     "Cookie: _ga=GA1.2.1234567890.1555555555; _gid=GA1.2.987654321.1556666666; "
+     "session=eyJ1c2VyIjoiYW5vbiIsInRzIjoxNTU2NjY2NjY2fQ; prefs=theme%3Ddark%26lang%3Den\r\n"
+     "If-None-Match: W/\"5cc1f3a2-3b2e\"\r\n"
+     "If-Modified-Since: Thu, 25 Apr 2019 17:32:50 GMT\r\n"
+     "\r\n"},
+    {"curl", 0,
+     "GET http://api.example.com/v1/items?page=2 HTTP/1.1\r\n"
+     "Host: api.example.com\r\n"
+     "User-Agent: curl/7.58.0\r\n"
+     "Accept: */*\r\n"
+     "Proxy-Connection: Keep-Alive\r\n"
+     "\r\n"},
+    {"nginx html", 1,
+     "HTTP/1.1 200 OK\r\n"
+     "Server: nginx/1.14.0 (Ubuntu)\r\n"
+     "Date: Sat, 27 Apr 2019 20:14:07 GMT\r\n"
+     "Content-Type: text/html; charset=UTF-8\r\n"
+     "Content-Length: 15182\r\n"
+     "Connection: keep-alive\r\n"
+     "Vary: Accept-Encoding\r\n"
+     "Last-Modified: Thu, 25 Apr 2019 17:32:50 GMT\r\n"
+     "ETag: \"5cc1f3a2-3b4e\"\r\n"
+     "Cache-Control: max-age=600\r\n"
+     "Expires: Sat, 27 Apr 2019 20:24:07 GMT\r\n"
+     "Accept-Ranges: bytes\r\n"
+     "\r\n"},
+    {"cdn image", 1,
+     "HTTP/1.1 200 OK\r\n"
+     "Content-Type: image/jpeg\r\n"
+     "Content-Length: 48213\r\n"
+     "Connection: keep-alive\r\n"
+     "Date: Sat, 27 Apr 2019 20:14:08 GMT\r\n"
+     "Last-Modified: Mon, 01 Apr 2019 09:12:44 GMT\r\n"
+     "ETag: \"a5e0f2b7c1d9e8f3a4b6c7d8e9f0a1b2\"\r\n"
+     "Cache-Control: public, max-age=31536000, immutable\r\n"
+     "Accept-Ranges: bytes\r\n"
+     "Server: AmazonS3\r\n"
+     "X-Amz-Id-2: 4bT1mQk7XwG2vYb9kqZ8r3Yx5c+JH0s2PjQ6lW8cNnR1oFhU0aKzVd3tE7iL9gSxMpQ5uYwZbC=\r\n"
+     "X-Amz-Request-Id: 8F3C2A1B0D9E7F65\r\n"
+     "X-Cache: Hit from cloudfront\r\n"
+     "Via: 1.1 3f2a5c9e1b7d4e8f0a6c2b9d5e1f7a3c.cloudfront.net (CloudFront)\r\n"
+     "X-Amz-Cf-Pop: BOS50-C1\r\n"
+     "X-Amz-Cf-Id: Qm0kz7yJ3vX9b2Lw5nR8tC1pF4hG6jK0sD3aE7iU9oY2xW5qZ8mN1b==\r\n"
+     "Age: 86213\r\n"
+     "Timing-Allow-Origin: *\r\n"
+     "Access-Control-Allow-Origin: *\r\n"
+     "\r\n"},
+    {"json api", 1,
+     "HTTP/1.1 200 OK\r\n"
+     "Date: Sat, 27 Apr 2019 20:14:09 GMT\r\n"
+     "Content-Type: application/json; charset=utf-8\r\n"
+     "Content-Length: 2291\r\n"
+     "Connection: keep-alive\r\n"
+     "X-Powered-By: Express\r\n"
+     "Cache-Control: private, no-cache\r\n"
+     "ETag: W/\"8f3-Jx2mYc0q5Zb8u1Kp\"\r\n"
+     "Vary: Origin, Accept-Encoding\r\n"
+     "Set-Cookie: sid=s%3AaB3dE5fG7hJ9kL1mN3pQ5rS7tU9vW1xY.Zq8w2e4r6t8y0u2i4o6p8a0s2d4f6g8h0j2k4l6; "
+     "Path=/; Expires=Sun, 28 Apr 2019 20:14:09 GMT; HttpOnly\r\n"
+     "X-RateLimit-Limit: 5000\r\n"
+     "X-RateLimit-Remaining: 4987\r\n"
+     "X-RateLimit-Reset: 1556399649\r\n"
+     "\r\n"},
+};
+
+
+//
+// Forward Declarations
+//
+long now_nsec();
+int legacy_header_length(char *raw, int raw_len);
+HTTPHeader *legacy_parse_headers(int *offset, char **raw_ptr);
+void legacy_parse(char *raw, int length, int is_response);
+void parser_parse(HTTPParser *parser, char *raw, int length, int is_response);
+double bench_legacy(HeaderSet *set, int iterations);
+double bench_parser(HeaderSet *set, int iterations);
+
+
+//
+// Implementation
+//
+int main(int argc, char **argv) {
+    /* Times each header set arriving in READ_SIZE reads and parsed into a
+     * message, the old way and then with the parser on every kernel the CPU
+     * has. Prints nanoseconds per header */
+
+    const char *kernels[] = {SCAN_SCALAR, SCAN_SSE42, SCAN_AVX2};
+    int num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+    int num_sets = sizeof(header_sets) / sizeof(header_sets[0]);
+    int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    double legacy, parser;
+
+    printf("%-20s %6s %12s", "header set", "bytes", "legacy ns");
+    for (int k = 0; k < num_kernels; k++) {
+        printf(" %12s", kernels[k]);
+    }
+    printf("\n");
+
+    for (int i = 0; i < num_sets; i++) {
+        legacy = bench_legacy(&header_sets[i], iterations);
+        printf("%-20s %6zu %12.1f", header_sets[i].name,
+               strlen(header_sets[i].raw), legacy);
+        for (int k = 0; k < num_kernels; k++) {
+            if (set_scan_kernel(kernels[k]) < 0) {
+                printf(" %12s", "n/a");
+                continue;
+            }
+            parser = bench_parser(&header_sets[i], iterations);
+            printf(" %6.1f (%3.1fx)", parser, legacy / parser);
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
+
+
+long now_nsec() {
+    /* Returns a monotonic timestamp in nanoseconds */
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+
+double bench_legacy(HeaderSet *set, int iterations) {
+    /* The old way: look for the end of the header in everything read so far
+     * after every read, then parse it field by field */
+
+    int length = strlen(set->raw), read_len;
+    char *raw = strdup(set->raw);
+    long start = now_nsec();
+
+    for (int i = 0; i < iterations; i++) {
+        for (read_len = READ_SIZE < length ? READ_SIZE : length;
+             legacy_header_length(raw, read_len) == 0;
+             read_len = read_len + READ_SIZE < length ? read_len + READ_SIZE : length);
+        legacy_parse(raw, read_len, set->is_response);
+    }
+
+    free(raw);
+    return (double) (now_nsec() - start) / iterations;
+}
+
+
+double bench_parser(HeaderSet *set, int iterations) {
+    /* The parser: pick up where the last read stopped, then copy the
+     * message out in one go */
+
+    int length = strlen(set->raw);
+    char *raw = strdup(set->raw);
+    HTTPParser parser;
+    long start = now_nsec();
+
+    for (int i = 0; i < iterations; i++) {
+        parser_parse(&parser, raw, length, set->is_response);
+    }
+
+    free(raw);
+    return (double) (now_nsec() - start) / iterations;
+}
+
+
+void parser_parse(HTTPParser *parser, char *raw, int length, int is_response) {
+    /* Parses raw as it would arrive in READ_SIZE reads */
+
+    int read_len = 0, header_length = PARSE_INCOMPLETE;
+    HTTPResponse *response;
+    BodyDecoder decoder;
+
+    init_parser(parser, is_response);
+    while (header_length == PARSE_INCOMPLETE && read_len < length) {
+        read_len = read_len + READ_SIZE < length ? read_len + READ_SIZE : length;
+        header_length = parse_header(parser, raw, read_len);
+    }
+    if (header_length <= 0) {
+        error_out("Header set didn't parse!");
+    }
+    if (is_response) {
+        response = parsed_response(parser, raw);
+        init_decoder(&decoder, response);
+        decode_body(&decoder, response, raw + header_length,
+                    read_len - header_length);
+        free_response(response);
+    } else {
+        free_request(parsed_request(parser, raw, read_len));
+    }
+}
+
+
+int legacy_header_length(char *raw, int raw_len) {
+    /* header_length() as it was before the parser: every terminator is
+     * searched for from the start of the buffer */
+
+    char *terminators[] = {CRLF2, CRCR, LFLF};
+    char *end, *first = NULL;
+    int length = 0;
+
+    for (int i = 0; i < 3; i++) {
+        end = memmem(raw, raw_len, terminators[i], strlen(terminators[i]));
+        if (end != NULL && (first == NULL || end < first)) {
+            first = end;
+            length = end - raw + strlen(terminators[i]);
+        }
+    }
+
+    return length;
+}
+
+
+void legacy_parse(char *raw, int length, int is_response) {
+    /* parse_request()/parse_response() as they were: every field of the
+     * start line and every header name and value gets its own allocation.
+     * A response's body and age are set up the way the parser does too */
+
+    int offset = 0, total_body_length;
+    size_t part_length;
+    char *start = raw, *parts[3], *body, *content_length, *age, *date;
+    HTTPHeader *hdrs, *next;
+
+    for (int i = 0; i < 3; i++) {
+        part_length = strcspn(raw, i < 2 ? " " : CRLF);
+        if ((parts[i] = (char *) malloc(part_length + 1)) == NULL) {
+            error_out("Couldn't malloc!");
+        }
+        memcpy(parts[i], raw, part_length);
+        parts[i][part_length] = '\0';
+        raw += part_length;
+        if (i < 2) {
+            raw++;
+        } else {
+            raw += *raw == '\r';
+            raw += *raw == '\n';
+        }
+    }
+    offset = raw - start;
+    hdrs = legacy_parse_headers(&offset, &raw);
+    offset += raw[0] == '\r' ? 2 : 1;
+
+    if (is_response) {
+        content_length = get_hdr_value(hdrs, CONTENT_LENGTH);
+        total_body_length = content_length != NULL ? atoi(content_length) : 0;
+        if ((body = (char *) malloc(total_body_length + 1)) == NULL) {
+            error_out("Couldn't malloc!");
+        }
+        memcpy(body, start + offset, length - offset);
+        age = get_hdr_value(hdrs, AGE);
+        date = get_hdr_value(hdrs, DATE);
+        if (date != NULL) {
+            curl_getdate(date, NULL);
+        }
+        free(content_length);
+        free(age);
+        free(date);
+        free(body);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        free(parts[i]);
+    }
+    for (; hdrs != NULL; hdrs = next) {
+        next = hdrs->next;
+        free(hdrs->name);
+        free(hdrs->value);
+        free(hdrs);
+    }
+}
+
+
+HTTPHeader *legacy_parse_headers(int *offset, char **raw_ptr) {
+    /* parse_headers() as it was before the parser */
+
+    int length = 0;
+    char *raw = *raw_ptr;
+    HTTPHeader *hdr = NULL, *lst = NULL;
+
+    while (strncmp(raw, CRLF, strlen(CRLF)) != 0) {
+        lst = hdr;
+        if ((hdr = (HTTPHeader *) malloc(sizeof(HTTPHeader))) == NULL) {
+            error_out("Couldn't malloc!");
+        }
+
+        // header field name
+        size_t name_length = strcspn(raw, ":");
+        if ((hdr->name = (char *) malloc(name_length + 1)) == NULL) {
+            error_out("Couldn't malloc!");
+        }
+        memcpy(hdr->name, raw, name_length);
+        hdr->name[name_length] = '\0';
+        raw += name_length + 1;
+        length += name_length + 1;
+        while (*raw == ' ') {
+            raw++;
+            length++;
+        }
+
+        // header field value
+        size_t value_length = strcspn(raw, CRLF);
+        if ((hdr->value = (char *) malloc(value_length + 1)) == NULL) {
+            error_out("Couldn't malloc!");
+        }
+        memcpy(hdr->value, raw, value_length);
+        hdr->value[value_length] = '\0';
+        raw += value_length;
+        length += value_length;
+        if (strncmp(raw, CR, strlen(CR)) == 0) {
+            raw += strlen(CR);
+            length += strlen(CR);
+        }
+        if (strncmp(raw, LF, strlen(LF)) == 0) {
+            raw += strlen(LF);
+            length += strlen(LF);
+        }
+        hdr->next = lst;
+    }
+
+    *raw_ptr = raw;
+    *offset += length;
+
+    return hdr;
+}
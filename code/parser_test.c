@@ -0,0 +1,333 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Unit test for the incremental header parser: *
+ *                               headers fed a byte at a time must parse as   *
+ *                               they do in one go                            *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+#include "ap_utilities.h"
+
+#define LONG_BODY 1000000  // bytes, far more than a response starts out with
+#define LONG_HEADER "HTTP/1.1 200 OK" CRLF "Content-Length: 1000000" CRLF CRLF
+
+
+//
+// Data Structures
+//
+typedef struct ParserCase {
+    /* A header, what may follow it, and what it should parse into. A
+     * malformed one has a NULL first */
+    const char *name;
+    int is_response;
+    const char *raw;
+    int header_length;         // where the header ends in raw
+    const char *first;         // method or version
+    const char *second;        // target or status
+    const char *third;         // version or description
+    const char *hdr_name;      // a header to look for...
+    const char *hdr_value;     // ...and the value it should have
+} ParserCase;
+
+
+//
+// Globals
+//
+ParserCase parser_cases[] = {
+    {"request", 0,
+     "GET http://example.com:8080/a?b=c HTTP/1.1\r\n"
+     "Host: example.com:8080\r\n"
+     "Accept:  \t*/*  \r\n"
+     "\r\n", 87,
+     "GET", "http://example.com:8080/a?b=c", "HTTP/1.1", "Accept", "*/*"},
+    {"pipelined request", 0,
+     "GET http://example.com/ HTTP/1.1\r\n"
+     "Host: example.com\r\n"
+     "\r\n"
+     "GET http://example.com/next HTTP/1.1\r\n"
+     "Host: example.com\r\n"
+     "\r\n", 55,
+     "GET", "http://example.com/", "HTTP/1.1", "Host", "example.com"},
+    {"empty lines first", 0,
+     "\r\n\r\n"
+     "OPTIONS * HTTP/1.1\r\n"
+     "Host: example.com\r\n"
+     "\r\n", 45,
+     "OPTIONS", "*", "HTTP/1.1", "host", "example.com"},
+    {"response", 1,
+     "HTTP/1.1 200 OK\r\n"
+     "Content-Length: 5\r\n"
+     "ETag: \"abc\"\r\n"
+     "\r\n"
+     "hello", 51,
+     "HTTP/1.1", "200", "OK", "etag", "\"abc\""},
+    {"response with LF lines", 1,
+     "HTTP/1.1 404 Not Found\n"
+     "Content-Length: 0\n"
+     "Server: test\n"
+     "\n", 55,
+     "HTTP/1.1", "404", "Not Found", "Server", "test"},
+    {"response with CR lines", 1,
+     "HTTP/1.0 304 Not Modified\r"
+     "Date: Sat, 27 Apr 2019 20:14:07 GMT\r"
+     "\r", 63,
+     "HTTP/1.0", "304", "Not Modified", "Date", "Sat, 27 Apr 2019 20:14:07 GMT"},
+    {"response without description", 1,
+     "HTTP/1.1 204\r\n"
+     "\r\n", 16,
+     "HTTP/1.1", "204", "", NULL, NULL},
+    {"folded header", 0,
+     "GET http://example.com/ HTTP/1.1\r\n"
+     "Host: example.com\r\n"
+     " continued\r\n"
+     "\r\n", 0, NULL, NULL, NULL, NULL, NULL},
+    {"space in a name", 0,
+     "GET http://example.com/ HTTP/1.1\r\n"
+     "Ho st: example.com\r\n"
+     "\r\n", 0, NULL, NULL, NULL, NULL, NULL},
+    {"no version", 0,
+     "GET http://example.com/\r\n"
+     "\r\n", 0, NULL, NULL, NULL, NULL, NULL},
+    {"bad status", 1,
+     "HTTP/1.1 2xx OK\r\n"
+     "\r\n", 0, NULL, NULL, NULL, NULL, NULL},
+    {"signed Content-Length", 1,
+     "HTTP/1.1 200 OK\r\n"
+     "Content-Length: -5\r\n"
+     "\r\n", 0, NULL, NULL, NULL, NULL, NULL},
+    {"overflowing Content-Length", 1,
+     "HTTP/1.1 200 OK\r\n"
+     "Content-Length: 99999999999999999999\r\n"
+     "\r\n", 0, NULL, NULL, NULL, NULL, NULL},
+    {"repeated Content-Length", 1,
+     "HTTP/1.1 200 OK\r\n"
+     "Content-Length: 5\r\n"
+     "Content-Length: 5\r\n"
+     "\r\n"
+     "hello", 57,
+     "HTTP/1.1", "200", "OK", "Content-Length", "5"},
+    {"differing Content-Lengths", 1,
+     "HTTP/1.1 200 OK\r\n"
+     "Content-Length: 5\r\n"
+     "Content-Length: 50\r\n"
+     "\r\n", 0, NULL, NULL, NULL, NULL, NULL},
+    {"Content-Length with Transfer-Encoding", 1,
+     "HTTP/1.1 200 OK\r\n"
+     "Content-Length: 5\r\n"
+     "Transfer-Encoding: chunked\r\n"
+     "\r\n", 0, NULL, NULL, NULL, NULL, NULL},
+    {"smuggled request", 0,
+     "GET http://example.com/ HTTP/1.1\r\n"
+     "Host: example.com\r\n"
+     "Transfer-Encoding: chunked\r\n"
+     "Content-Length: 4\r\n"
+     "\r\n", 0, NULL, NULL, NULL, NULL, NULL},
+};
+
+
+//
+// Forward Declarations
+//
+int check_case(ParserCase *test);
+int parse_in_steps(ParserCase *test, char *raw, int length, int step);
+int check_message(ParserCase *test, HTTPParser *parser, char *raw, int length);
+int same_string(const char *case_name, const char *what, const char *expected,
+                const char *found);
+int check_long_body();
+
+
+//
+// Implementation
+//
+int main() {
+    /* Runs every case on every kernel the CPU has. Exits non-zero if any of
+     * them failed */
+
+    const char *kernels[] = {SCAN_SCALAR, SCAN_SSE42, SCAN_AVX2};
+    int num_cases = sizeof(parser_cases) / sizeof(parser_cases[0]);
+    int failures;
+
+    for (int k = 0; k < (int) (sizeof(kernels) / sizeof(kernels[0])); k++) {
+        if (set_scan_kernel(kernels[k]) < 0) {
+            continue;
+        }
+        failures = 0;
+        for (int i = 0; i < num_cases; i++) {
+            failures += check_case(&parser_cases[i]);
+        }
+        if (failures == 0) {
+            printf("--------- PARSER on %s PASSED --------\n", kernels[k]);
+        } else {
+            printf("--------- PARSER on %s FAILED --------\n", kernels[k]);
+            return 1;
+        }
+    }
+    if (check_long_body() == 0) {
+        printf("--------- PARSER long body PASSED --------\n");
+    } else {
+        printf("--------- PARSER long body FAILED --------\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+int check_case(ParserCase *test) {
+    /* Parses the case all at once and then a byte at a time, returns 1 if
+     * either went wrong */
+
+    int length = strlen(test->raw);
+    char *raw = strdup(test->raw);
+    int failed = parse_in_steps(test, raw, length, length) ||
+                 parse_in_steps(test, raw, length, 1);
+
+    free(raw);
+    return failed;
+}
+
+
+int parse_in_steps(ParserCase *test, char *raw, int length, int step) {
+    /* Feeds the parser step more bytes at a time, like reads would. Until
+     * the header is complete it must ask for more, then give its length (or
+     * find it malformed somewhere along the way). Returns 1 if it didn't */
+
+    HTTPParser parser;
+    int read_len = 0, result = PARSE_INCOMPLETE;
+
+    init_parser(&parser, test->is_response);
+    while (result == PARSE_INCOMPLETE && read_len < length) {
+        read_len = read_len + step < length ? read_len + step : length;
+        result = parse_header(&parser, raw, read_len);
+        if (test->first != NULL && result == PARSE_INCOMPLETE &&
+                read_len >= test->header_length) {
+            break;
+        }
+    }
+
+    if (test->first == NULL) {
+        if (result != PARSE_MALFORMED) {
+            fprintf(stderr, "%s (%d at a time): parsed as %d, not malformed\n",
+                    test->name, step, result);
+            return 1;
+        }
+        return 0;
+    }
+    if (result != test->header_length) {
+        fprintf(stderr, "%s (%d at a time): parsed as %d, not %d\n",
+                test->name, step, result, test->header_length);
+        return 1;
+    }
+
+    return check_message(test, &parser, raw, read_len);
+}
+
+
+int check_message(ParserCase *test, HTTPParser *parser, char *raw, int length) {
+    /* Copies the message out of raw and checks what it holds. Returns 1 if
+     * any of it isn't what it should be */
+
+    HTTPRequest *request;
+    HTTPResponse *response;
+    int failed;
+
+    if (test->is_response) {
+        response = parsed_response(parser, raw);
+        failed = same_string(test->name, "version", test->first, response->version) ||
+                 same_string(test->name, "status", test->second, response->status) ||
+                 same_string(test->name, "description", test->third,
+                             response->status_desc) ||
+                 (test->hdr_name != NULL &&
+                  same_string(test->name, test->hdr_name, test->hdr_value,
+                              find_hdr(response->hdrs, test->hdr_name)));
+        free_response(response);
+    } else {
+        // a request is copied out with what follows its header
+        request = parsed_request(parser, raw, length);
+        failed = same_string(test->name, "url", test->second, request->url) ||
+                 same_string(test->name, "version", test->third, request->version) ||
+                 same_string(test->name, test->hdr_name, test->hdr_value,
+                             find_hdr(request->hdrs, test->hdr_name)) ||
+                 request->body_length != length - test->header_length;
+        if (strcmp(test->first, GET_RQ) == 0 && request->method != GET) {
+            failed = 1;
+        }
+        free_request(request);
+    }
+    if (failed) {
+        fprintf(stderr, "%s: wasn't copied out right\n", test->name);
+    }
+
+    return failed;
+}
+
+
+int same_string(const char *case_name, const char *what, const char *expected,
+                const char *found) {
+    /* Returns 0 if found is expected, 1 (after saying so) if it isn't */
+
+    if (found != NULL && strcmp(expected, found) == 0) {
+        return 0;
+    }
+    fprintf(stderr, "%s: %s is \"%s\", not \"%s\"\n", case_name, what,
+            found != NULL ? found : "(none)", expected);
+    return 1;
+}
+
+
+int check_long_body() {
+    /* A response doesn't take all the room its Content-Length asks for up
+     * front, the body grows into it as it comes in and ends up no bigger
+     * than it says. Returns 1 if it didn't */
+
+    HTTPParser parser;
+    HTTPResponse *response;
+    BodyDecoder decoder;
+    char *raw = strdup(LONG_HEADER), *body;
+    int status = PARSE_INCOMPLETE, failed = 0;
+
+    if ((body = (char *) malloc(LONG_BODY)) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    for (int i = 0; i < LONG_BODY; i++) {
+        body[i] = 'a' + i % 26;
+    }
+
+    init_parser(&parser, 1);
+    if (parse_header(&parser, raw, strlen(raw)) != (int) strlen(raw)) {
+        fprintf(stderr, "long body: header didn't parse\n");
+        free(raw);
+        free(body);
+        return 1;
+    }
+    response = parsed_response(&parser, raw);
+    if (response->body_room > INITIAL_BODY_ROOM) {
+        fprintf(stderr, "long body: started with room for %d\n",
+                response->body_room);
+        failed = 1;
+    }
+
+    init_decoder(&decoder, response);
+    for (int offset = 0; status == PARSE_INCOMPLETE && offset < LONG_BODY;
+         offset += 4096) {
+        status = decode_body(&decoder, response, body + offset,
+                             LONG_BODY - offset < 4096 ? LONG_BODY - offset : 4096);
+    }
+    if (status != BODY_COMPLETE || response->body_length != LONG_BODY ||
+            memcmp(response->body, body, LONG_BODY) != 0 ||
+            response->body_room != LONG_BODY + 1) {
+        fprintf(stderr, "long body: decoded %d bytes into room for %d\n",
+                response->body_length, response->body_room);
+        failed = 1;
+    }
+
+    free_response(response);
+    free(raw);
+    free(body);
+    return failed;
+}
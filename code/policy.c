@@ -0,0 +1,778 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Cache eviction policies. Besides LRU, MRU    *
+ *                               and random these include scan resistant      *
+ *                               ones (ARC, S3-FIFO and W-TinyLFU), so a      *
+ *                               crawler or a big download sweeping through   *
+ *                               doesn't flush the cache                      *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Interface
+//
+#include "policy.h"
+
+
+//
+// Globals
+//
+// NOTE: only one policy is in use at a time and every hook runs with the
+//       cache locked, so they all share the state below. Sizes are in bytes
+//       rather than objects since that is how the cache is budgeted
+CacheObject *queues[NUM_QUEUES] = {NULL};  // least recently queued first
+size_t queue_bytes[NUM_QUEUES] = {0};
+size_t queue_items[NUM_QUEUES] = {0};
+Ghost *ghosts = NULL;                      /* IMPORTANT: initialize this to NULL
+                                            *            - UTHash requirement */
+Ghost *ghost_queues[2] = {NULL};           // oldest first
+size_t ghost_bytes[2] = {0};
+size_t capacity = 0;
+int admit_frequent = 0;  // the incoming object was a ghost, skip the probation
+
+// ARC
+size_t arc_target = 0;   // bytes T1 aims for ("p" in the paper)
+
+// S3-FIFO
+size_t small_bytes = 0;
+
+// W-TinyLFU
+size_t window_bytes = 0, main_bytes = 0, protected_bytes = 0;
+size_t incoming_bytes = 0;  // of the object that will land in the window
+uint8_t *sketch = NULL;  // SKETCH_DEPTH rows of sketch_width counters
+size_t sketch_width = 0, sketch_additions = 0;
+
+// GDSF
+CacheObject **heap = NULL;  // min-heap on priority
+size_t heap_size = 0, heap_capacity = 0;
+double gdsf_clock = 0;      // priority of the last victim ("L" in the paper)
+int gdsf_mode = GDSF_OBJECTS;
+
+
+//
+// Forward Declarations
+//
+void enqueue(CacheObject *item, int queue);
+void dequeue(CacheObject *item);
+void requeue(CacheObject *item, int queue);
+void add_ghost(CacheObject *item, int queue);
+Ghost *take_ghost(char *url);
+void free_ghost(Ghost *ghost);
+void trim_ghosts(int queue, size_t limit);
+void queue_added(CacheObject *item);
+void queue_removed(CacheObject *item);
+CacheObject *queue_walk(CacheObject *item);
+void lru_used(CacheObject *item);
+CacheObject *lru_victim();
+CacheObject *mru_victim();
+void random_init(size_t cache_capacity);
+CacheObject *random_victim();
+void arc_init(size_t cache_capacity);
+void arc_incoming(char *url, size_t size);
+void arc_added(CacheObject *item);
+void arc_used(CacheObject *item);
+CacheObject *arc_victim();
+void s3fifo_init(size_t cache_capacity);
+void s3fifo_incoming(char *url, size_t size);
+void s3fifo_added(CacheObject *item);
+void s3fifo_used(CacheObject *item);
+CacheObject *s3fifo_victim();
+void wtinylfu_init(size_t cache_capacity);
+void wtinylfu_incoming(char *url, size_t size);
+void wtinylfu_used(CacheObject *item);
+CacheObject *wtinylfu_victim();
+void gdsf_init(size_t cache_capacity);
+void gdsf_added(CacheObject *item);
+void gdsf_used(CacheObject *item);
+void gdsf_removed(CacheObject *item);
+CacheObject *gdsf_victim();
+CacheObject *gdsf_walk(CacheObject *item);
+double gdsf_priority(CacheObject *item);
+void heap_swap(size_t i, size_t j);
+void heap_up(size_t i);
+void heap_down(size_t i);
+uint64_t hash_url(char *url);
+void sketch_increment(char *url);
+int sketch_estimate(char *url);
+
+
+// the policies that can be picked on the command line
+EvictionPolicy policies[] = {
+    /* name, init, lookup, incoming, added, used, removed, victim, walk */
+    {"lru", NULL, NULL, NULL, queue_added, lru_used, queue_removed, lru_victim,
+     queue_walk},
+    {"mru", NULL, NULL, NULL, queue_added, lru_used, queue_removed, mru_victim,
+     queue_walk},
+    {"random", random_init, NULL, NULL, queue_added, NULL, queue_removed,
+     random_victim, queue_walk},
+    {"arc", arc_init, NULL, arc_incoming, arc_added, arc_used, queue_removed,
+     arc_victim, queue_walk},
+    {"s3fifo", s3fifo_init, NULL, s3fifo_incoming, s3fifo_added, s3fifo_used,
+     queue_removed, s3fifo_victim, queue_walk},
+    {"wtinylfu", wtinylfu_init, sketch_increment, wtinylfu_incoming,
+     queue_added, wtinylfu_used, queue_removed, wtinylfu_victim, queue_walk},
+    {"gdsf", gdsf_init, NULL, NULL, gdsf_added, gdsf_used, gdsf_removed,
+     gdsf_victim, gdsf_walk},
+    {NULL}
+};
+
+
+//
+// Implementation
+//
+EvictionPolicy *find_policy(char *name) {
+    /* Returns the policy called name, LRU if name is NULL and NULL if there
+     * is no such policy */
+
+    if (name == NULL) {
+        return &policies[0];
+    }
+    for (EvictionPolicy *policy = policies; policy->name; policy++) {
+        if (strcmp(policy->name, name) == 0) {
+            return policy;
+        }
+    }
+
+    return NULL;
+}
+
+
+int set_gdsf_mode(char *mode) {
+    /* Picks what GDSF optimises for, returns -1 for an unknown mode */
+
+    if (strcmp(mode, "objects") == 0) {
+        gdsf_mode = GDSF_OBJECTS;
+    } else if (strcmp(mode, "bytes") == 0) {
+        gdsf_mode = GDSF_BYTES;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+//
+// Queues
+//
+void enqueue(CacheObject *item, int queue) {
+    /* Puts the item at the back of the queue */
+
+    item->queue = queue;
+    DL_APPEND(queues[queue], item);
+    queue_bytes[queue] += item->size;
+    queue_items[queue]++;
+}
+
+
+void dequeue(CacheObject *item) {
+    /* Takes the item off whichever queue it is on */
+
+    DL_DELETE(queues[item->queue], item);
+    queue_bytes[item->queue] -= item->size;
+    queue_items[item->queue]--;
+}
+
+
+void requeue(CacheObject *item, int queue) {
+    /* Moves the item to the back of the queue */
+
+    dequeue(item);
+    enqueue(item, queue);
+}
+
+
+void add_ghost(CacheObject *item, int queue) {
+    /* Remembers an item that is being evicted */
+
+    Ghost *ghost;
+
+    if ((ghost = (Ghost *) malloc(sizeof(Ghost))) == NULL ||
+            (ghost->url = strdup(item->url)) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    ghost->size = item->size;
+    ghost->queue = queue;
+    HASH_ADD_KEYPTR(hh, ghosts, ghost->url, strlen(ghost->url), ghost);
+    DL_APPEND(ghost_queues[queue], ghost);
+    ghost_bytes[queue] += ghost->size;
+}
+
+
+Ghost *take_ghost(char *url) {
+    /* Returns the ghost of url off its queue (the caller frees it), or NULL
+     * if url wasn't evicted recently */
+
+    Ghost *ghost;
+
+    HASH_FIND_STR(ghosts, url, ghost);
+    if (ghost != NULL) {
+        HASH_DEL(ghosts, ghost);
+        DL_DELETE(ghost_queues[ghost->queue], ghost);
+        ghost_bytes[ghost->queue] -= ghost->size;
+    }
+
+    return ghost;
+}
+
+
+void free_ghost(Ghost *ghost) {
+    /* Frees the Ghost structure */
+
+    if (ghost) {
+        free(ghost->url);
+        free(ghost);
+    }
+}
+
+
+void trim_ghosts(int queue, size_t limit) {
+    /* Forgets the oldest ghosts on the queue until it is within limit */
+
+    while (ghost_bytes[queue] > limit && ghost_queues[queue] != NULL) {
+        free_ghost(take_ghost(ghost_queues[queue]->url));
+    }
+}
+
+
+void queue_added(CacheObject *item) {
+    /* New items start at the back of the first queue */
+
+    enqueue(item, QUEUE_RECENT);
+}
+
+
+void queue_removed(CacheObject *item) {
+    /* The item is leaving the cache */
+
+    dequeue(item);
+}
+
+
+CacheObject *queue_walk(CacheObject *item) {
+    /* Each queue front to back, the first queue (the one items start on)
+     * first: least recently queued first, frequently used items last */
+
+    int queue = item != NULL ? item->queue + 1 : 0;
+
+    if (item != NULL && item->next != NULL) {
+        return item->next;
+    }
+    while (queue < NUM_QUEUES && queues[queue] == NULL) {
+        queue++;
+    }
+
+    return queue < NUM_QUEUES ? queues[queue] : NULL;
+}
+
+
+//
+// LRU, MRU and random
+//
+void lru_used(CacheObject *item) {
+    /* Most recently used goes to the back */
+
+    requeue(item, QUEUE_RECENT);
+}
+
+
+CacheObject *lru_victim() {
+    /* The least recently used item is at the front */
+
+    return queues[QUEUE_RECENT];
+}
+
+
+CacheObject *mru_victim() {
+    /* ...and the most recently used one at the back (the head's prev) */
+
+    return queues[QUEUE_RECENT] != NULL ? queues[QUEUE_RECENT]->prev : NULL;
+}
+
+
+void random_init(size_t cache_capacity) {
+    /* Seeds the random generator once, not on every eviction */
+
+    (void) cache_capacity;
+    srand(time(NULL));
+}
+
+
+CacheObject *random_victim() {
+    /* Any item, picked at random */
+
+    CacheObject *item = queues[QUEUE_RECENT];
+
+    if (item != NULL) {
+        for (size_t n = rand() % queue_items[QUEUE_RECENT]; n > 0; n--) {
+            item = item->next;
+        }
+    }
+
+    return item;
+}
+
+
+//
+// ARC (Megiddo and Modha) with byte sizes: T1 holds what was seen once, T2
+// what was seen again, and their ghosts B1 and B2 steer how many bytes T1
+// gets. A scan only ever passes through T1
+//
+void arc_init(size_t cache_capacity) {
+    /* The cache starts out giving T1 nothing in particular */
+
+    capacity = cache_capacity;
+    arc_target = 0;
+}
+
+
+void arc_incoming(char *url, size_t size) {
+    /* A miss on something we evicted recently says which list evicted too
+     * soon, move the target towards it */
+
+    Ghost *ghost = take_ghost(url);
+    size_t recent = ghost_bytes[QUEUE_RECENT], frequent = ghost_bytes[QUEUE_FREQUENT];
+    size_t delta;
+
+    admit_frequent = ghost != NULL;
+    if (ghost == NULL) {
+        return;
+    }
+    if (ghost->queue == QUEUE_RECENT) {
+
+        // in B1: T1 should have been bigger
+        recent += ghost->size;
+        delta = frequent > recent ? size * (frequent / recent) : size;
+        arc_target = arc_target + delta < capacity ? arc_target + delta : capacity;
+    } else {
+
+        // in B2: T2 should have been bigger
+        frequent += ghost->size;
+        delta = recent > frequent ? size * (recent / frequent) : size;
+        arc_target = arc_target > delta ? arc_target - delta : 0;
+    }
+    free_ghost(ghost);
+}
+
+
+void arc_added(CacheObject *item) {
+    /* New items go to T1, returning ghosts straight to T2 */
+
+    enqueue(item, admit_frequent ? QUEUE_FREQUENT : QUEUE_RECENT);
+    admit_frequent = 0;
+
+    // T1 + B1 stays within the cache, everything within twice the cache
+    if (queue_bytes[QUEUE_RECENT] < capacity) {
+        trim_ghosts(QUEUE_RECENT, capacity - queue_bytes[QUEUE_RECENT]);
+    } else {
+        trim_ghosts(QUEUE_RECENT, 0);
+    }
+    size_t live = queue_bytes[QUEUE_RECENT] + queue_bytes[QUEUE_FREQUENT] +
+                  ghost_bytes[QUEUE_RECENT];
+    trim_ghosts(QUEUE_FREQUENT, live < 2 * capacity ? 2 * capacity - live : 0);
+}
+
+
+void arc_used(CacheObject *item) {
+    /* Seen again, so it belongs to T2 */
+
+    requeue(item, QUEUE_FREQUENT);
+}
+
+
+CacheObject *arc_victim() {
+    /* Evicts from T1 while it is over its target, from T2 otherwise */
+
+    CacheObject *item;
+
+    if (queues[QUEUE_RECENT] != NULL &&
+            (queue_bytes[QUEUE_RECENT] > arc_target ||
+             queues[QUEUE_FREQUENT] == NULL)) {
+        item = queues[QUEUE_RECENT];
+    } else {
+        item = queues[QUEUE_FREQUENT];
+    }
+    if (item != NULL) {
+        add_ghost(item, item->queue);
+    }
+
+    return item;
+}
+
+
+//
+// S3-FIFO (Yang et al.): new objects go through a small FIFO, only those
+// used again while in it make it to the main FIFO. One hit wonders leave
+// quickly and a ghost FIFO lets the ones that come back skip the small FIFO
+//
+void s3fifo_init(size_t cache_capacity) {
+    /* Splits the cache into the small and main FIFOs */
+
+    capacity = cache_capacity;
+    small_bytes = capacity * S3FIFO_SMALL_PERCENT / 100;
+}
+
+
+void s3fifo_incoming(char *url, size_t size) {
+    /* Something evicted from the small FIFO came back, it goes to main */
+
+    Ghost *ghost = take_ghost(url);
+
+    (void) size;
+    admit_frequent = ghost != NULL;
+    free_ghost(ghost);
+}
+
+
+void s3fifo_added(CacheObject *item) {
+    /* Starts the item off on the FIFO its history says it belongs in */
+
+    item->freq = 0;
+    enqueue(item, admit_frequent ? QUEUE_FREQUENT : QUEUE_RECENT);
+    admit_frequent = 0;
+}
+
+
+void s3fifo_used(CacheObject *item) {
+    /* Hits only bump a small counter, the FIFOs are never reordered on a hit
+     * so there is no list to lock and touch */
+
+    if (item->freq < 3) {
+        item->freq++;
+    }
+}
+
+
+CacheObject *s3fifo_victim() {
+    /* Evicts from the small FIFO while it is over its share (moving what was
+     * used on to main), from main otherwise (giving what was used another
+     * round) */
+
+    CacheObject *item;
+
+    while (queues[QUEUE_RECENT] != NULL || queues[QUEUE_FREQUENT] != NULL) {
+        if (queues[QUEUE_RECENT] != NULL &&
+                (queue_bytes[QUEUE_RECENT] > small_bytes ||
+                 queues[QUEUE_FREQUENT] == NULL)) {
+            item = queues[QUEUE_RECENT];
+            if (item->freq > 0) {
+                item->freq = 0;
+                requeue(item, QUEUE_FREQUENT);
+                continue;
+            }
+
+            // the ghost FIFO remembers as much as main holds
+            add_ghost(item, QUEUE_RECENT);
+            trim_ghosts(QUEUE_RECENT, capacity - small_bytes);
+            return item;
+        }
+
+        item = queues[QUEUE_FREQUENT];
+        if (item->freq > 0) {
+            item->freq--;
+            requeue(item, QUEUE_FREQUENT);
+            continue;
+        }
+        return item;
+    }
+
+    return NULL;
+}
+
+
+//
+// W-TinyLFU (Einziger et al.): new objects land in a small LRU window. To
+// leave it for the main segmented LRU an object must have been asked for
+// more often than what it would push out, as estimated by a count-min sketch
+// that sees every lookup, hits and misses alike
+//
+void wtinylfu_init(size_t cache_capacity) {
+    /* Sizes the window, the main segments and the sketch */
+
+    capacity = cache_capacity;
+    window_bytes = capacity * WTINYLFU_WINDOW_PERCENT / 100;
+    main_bytes = capacity - window_bytes;
+    protected_bytes = main_bytes * WTINYLFU_PROTECTED_PERCENT / 100;
+
+    // about one counter per object the cache can hold, a power of two so
+    // the hash can be masked
+    sketch_width = SKETCH_MIN_WIDTH;
+    while (sketch_width < SKETCH_MAX_WIDTH &&
+           sketch_width < capacity / SKETCH_AVERAGE_OBJECT) {
+        sketch_width <<= 1;
+    }
+    if ((sketch = (uint8_t *) calloc(SKETCH_DEPTH * sketch_width, 1)) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+}
+
+
+void wtinylfu_incoming(char *url, size_t size) {
+    /* Notes how much the window is about to take in, see wtinylfu_victim */
+
+    (void) url;
+    incoming_bytes = size;
+}
+
+
+void wtinylfu_used(CacheObject *item) {
+    /* Hits move items along: within the window, from probation to
+     * protected, within protected. Protected overflows back to probation */
+
+    if (item->queue == QUEUE_RECENT) {
+        requeue(item, QUEUE_RECENT);
+        return;
+    }
+    requeue(item, QUEUE_PROTECTED);
+    while (queue_bytes[QUEUE_PROTECTED] > protected_bytes &&
+           queues[QUEUE_PROTECTED] != item) {
+        requeue(queues[QUEUE_PROTECTED], QUEUE_FREQUENT);
+    }
+}
+
+
+CacheObject *wtinylfu_victim() {
+    /* Moves the window's overflow into main while there is room. Once there
+     * isn't, the window's oldest item and probation's oldest are compared
+     * and the one asked for less often goes. The incoming object counts as
+     * in the window already, and however far past the window's share it is
+     * on its own (a window smaller than an object always is) main doesn't
+     * have room for, or every new object would get into main unchallenged */
+
+    CacheObject *candidate, *item;
+    size_t main_room;
+
+    while (1) {
+        candidate = queues[QUEUE_RECENT];
+
+        // the window is within its share, main gives up its coldest
+        if (candidate == NULL ||
+                queue_bytes[QUEUE_RECENT] + incoming_bytes <= window_bytes) {
+            if (queues[QUEUE_FREQUENT] != NULL) {
+                return queues[QUEUE_FREQUENT];
+            }
+            return queues[QUEUE_PROTECTED] != NULL ? queues[QUEUE_PROTECTED]
+                                                   : candidate;
+        }
+
+        main_room = main_bytes;
+        if (incoming_bytes > window_bytes) {
+            main_room -= incoming_bytes - window_bytes < main_bytes ?
+                         incoming_bytes - window_bytes : main_bytes;
+        }
+        if (queue_bytes[QUEUE_FREQUENT] + queue_bytes[QUEUE_PROTECTED] +
+                candidate->size <= main_room) {
+            requeue(candidate, QUEUE_FREQUENT);
+            continue;
+        }
+
+        item = queues[QUEUE_FREQUENT] != NULL ? queues[QUEUE_FREQUENT]
+                                              : queues[QUEUE_PROTECTED];
+        if (item == NULL ||
+                sketch_estimate(candidate->url) <= sketch_estimate(item->url)) {
+            return candidate;
+        }
+        return item;
+    }
+}
+
+
+//
+// GreedyDual-Size-Frequency (Cherkasova): every object is worth
+// L + frequency * cost / size, where the cost is how long the server took to
+// send it and L is the worth of the last object evicted. Raising L as objects
+// go ages out what was popular once. Objects are kept in a min-heap on their
+// worth. Leaving out the size favours byte hit ratio over object hit ratio
+//
+void gdsf_init(size_t cache_capacity) {
+    /* Sets up the heap */
+
+    (void) cache_capacity;
+    heap_capacity = GDSF_INITIAL_HEAP;
+    if ((heap = (CacheObject **) malloc(heap_capacity * sizeof(CacheObject *)))
+            == NULL) {
+        error_out("Couldn't malloc!");
+    }
+}
+
+
+double gdsf_priority(CacheObject *item) {
+    /* What the item is worth keeping */
+
+    // even a server that answers instantly costs a round trip
+    double cost = item->response->fetch_latency > 1000 ?
+                  item->response->fetch_latency / 1000.0 : 1.0;
+
+    if (gdsf_mode == GDSF_BYTES) {
+        return gdsf_clock + item->freq * cost;
+    }
+
+    return gdsf_clock + item->freq * cost / item->size;
+}
+
+
+void gdsf_added(CacheObject *item) {
+    /* Puts the item in the heap */
+
+    if (heap_size == heap_capacity) {
+        heap_capacity *= 2;
+        if ((heap = (CacheObject **) realloc(heap, heap_capacity *
+                                             sizeof(CacheObject *))) == NULL) {
+            error_out("Couldn't realloc!");
+        }
+    }
+    item->freq = 1;
+    item->priority = gdsf_priority(item);
+    item->heap_index = heap_size;
+    heap[heap_size++] = item;
+    heap_up(item->heap_index);
+}
+
+
+void gdsf_used(CacheObject *item) {
+    /* Another hit makes the item worth more (never less, so it can only
+     * sink in the heap) */
+
+    item->freq++;
+    item->priority = gdsf_priority(item);
+    heap_down(item->heap_index);
+}
+
+
+void gdsf_removed(CacheObject *item) {
+    /* Takes the item out of the heap, its place is taken by the last one */
+
+    size_t i = item->heap_index;
+
+    heap_size--;
+    if (i != heap_size) {
+        heap_swap(i, heap_size);
+        heap_up(i);
+        heap_down(i);
+    }
+}
+
+
+CacheObject *gdsf_victim() {
+    /* The least valuable item is at the top, what it was worth becomes the
+     * baseline for everything that is added or hit from now on */
+
+    if (heap_size == 0) {
+        return NULL;
+    }
+    gdsf_clock = heap[0]->priority;
+
+    return heap[0];
+}
+
+
+CacheObject *gdsf_walk(CacheObject *item) {
+    /* The heap as it is laid out, every item after the one above it: the
+     * least valuable first, if only roughly after that */
+
+    size_t i = item != NULL ? item->heap_index + 1 : 0;
+
+    return i < heap_size ? heap[i] : NULL;
+}
+
+
+void heap_swap(size_t i, size_t j) {
+    /* Swaps two heap slots and keeps their items' indices right */
+
+    CacheObject *item = heap[i];
+
+    heap[i] = heap[j];
+    heap[j] = item;
+    heap[i]->heap_index = i;
+    heap[j]->heap_index = j;
+}
+
+
+void heap_up(size_t i) {
+    /* Moves the item in slot i up until its parent is worth less */
+
+    while (i > 0 && heap[(i - 1) / 2]->priority > heap[i]->priority) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+
+void heap_down(size_t i) {
+    /* Moves the item in slot i down until its children are worth more */
+
+    size_t smallest, left, right;
+
+    while (1) {
+        smallest = i;
+        left = 2 * i + 1;
+        right = 2 * i + 2;
+        if (left < heap_size && heap[left]->priority < heap[smallest]->priority) {
+            smallest = left;
+        }
+        if (right < heap_size && heap[right]->priority < heap[smallest]->priority) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+
+uint64_t hash_url(char *url) {
+    /* FNV-1a */
+
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (; *url; url++) {
+        hash ^= (unsigned char) *url;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+void sketch_increment(char *url) {
+    /* Counts a lookup of url. Every so often all counts are halved so the
+     * sketch follows what is popular now rather than ever */
+
+    uint64_t hash = hash_url(url), step = (hash >> 32) | 1;
+    uint8_t *counter;
+
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        counter = &sketch[i * sketch_width + ((hash + i * step) & (sketch_width - 1))];
+        if (*counter < SKETCH_MAX_COUNT) {
+            (*counter)++;
+        }
+    }
+
+    if (++sketch_additions >= 10 * sketch_width) {
+        for (size_t i = 0; i < SKETCH_DEPTH * sketch_width; i++) {
+            sketch[i] >>= 1;
+        }
+        sketch_additions /= 2;
+    }
+}
+
+
+int sketch_estimate(char *url) {
+    /* Returns how often url was looked up (an overestimate at worst) */
+
+    uint64_t hash = hash_url(url), step = (hash >> 32) | 1;
+    int estimate = SKETCH_MAX_COUNT, count;
+
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        count = sketch[i * sketch_width + ((hash + i * step) & (sketch_width - 1))];
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+
+    return estimate;
+}
@@ -0,0 +1,77 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Header for the cache eviction policies       *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+
+#ifndef POLICY_H
+#define POLICY_H
+
+
+#include <stdint.h>
+#include "cache.h"
+
+// queues an object (or a ghost of one) can be on
+#define QUEUE_RECENT 0     // ARC T1, S3-FIFO small, W-TinyLFU window
+#define QUEUE_FREQUENT 1   // ARC T2, S3-FIFO main, W-TinyLFU probation
+#define QUEUE_PROTECTED 2  // W-TinyLFU protected
+#define NUM_QUEUES 3
+
+#define S3FIFO_SMALL_PERCENT 10      // of the cache, the rest is main
+#define WTINYLFU_WINDOW_PERCENT 1    // of the cache, the rest is main
+#define WTINYLFU_PROTECTED_PERCENT 80  // of main, the rest is probation
+#define SKETCH_DEPTH 4
+#define SKETCH_MIN_WIDTH 1024
+#define SKETCH_MAX_WIDTH (1 << 24)
+#define SKETCH_AVERAGE_OBJECT 4096   // sizes the sketch from the capacity
+#define SKETCH_MAX_COUNT 15          // 4-bit counters, as in TinyLFU
+#define GDSF_OBJECTS 0     // favour many small objects (object hit ratio)
+#define GDSF_BYTES 1       // don't penalise size (byte hit ratio)
+#define GDSF_INITIAL_HEAP 1024
+
+
+//
+// Data Structures
+//
+typedef struct EvictionPolicy {
+    /* What the cache calls into to decide what stays. Every hook runs with
+     * the cache locked */
+    char *name;
+    void (*init)(size_t capacity);
+    void (*lookup)(char *url);             // any lookup, hit or miss
+    void (*incoming)(char *url, size_t size);  // about to be added
+    void (*added)(CacheObject *item);
+    void (*used)(CacheObject *item);       // served from the cache
+    void (*removed)(CacheObject *item);    // leaving, for whatever reason
+    CacheObject *(*victim)();              // next to evict, never NULL
+                                           // while anything is cached
+    CacheObject *(*walk)(CacheObject *item);  // what comes after item in
+                                           // the policy's order, oldest
+                                           // first (the first for NULL)
+} EvictionPolicy;
+
+typedef struct Ghost {
+    /* An evicted object that is remembered by its key alone, so a quick
+     * return can be told apart from a first visit */
+    char *url; // key
+    size_t size;
+    int queue;
+    struct Ghost *prev, *next;
+    UT_hash_handle hh;
+} Ghost;
+
+
+//
+// Forward Declarations
+//
+EvictionPolicy *find_policy(char *name);
+int set_gdsf_mode(char *mode);
+
+
+#endif /* POLICY_H */
@@ -0,0 +1,397 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Unit test for the eviction policies: each    *
+ *                               one has to evict what it says it does        *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+#include <sys/wait.h>
+
+#include "policy.h"
+
+#define BODY_BYTES 1000
+#define URL_FORMAT "http://example.com/%c%05d"  // every url is as long
+#define SCAN_SLOTS 20
+#define HOT_OBJECTS 5       // asked for again and again...
+#define SCAN_OBJECTS 40     // ...between this many asked for once
+#define SCAN_ROUNDS 30
+#define SCAN_RESISTANT 75   // percent of hot requests that hit, at least
+#define GDSF_SLOTS 6
+#define LARGE_BYTES (4 * BODY_BYTES)  // charged three times a small one
+#define RESPONSE_HEADER "HTTP/1.1 200 OK" CRLF "Content-Length: %d" CRLF \
+                        "Cache-Control: max-age=600" CRLF CRLF
+
+
+//
+// Data Structures
+//
+typedef struct PolicyCase {
+    /* A check run against a cache of slots objects of BODY_BYTES, in a
+     * process of its own since the policies keep their state in globals */
+    const char *name;
+    char *policy;
+    int slots;
+    int (*check)();   // how many checks failed
+} PolicyCase;
+
+
+//
+// Forward Declarations
+//
+int check_lru();
+int check_mru();
+int check_random();
+int check_lru_scan();
+int check_scan_resistant();
+int scan_hits();
+int check_gdsf_objects();
+int check_gdsf_bytes();
+int gdsf_fill();
+int run_case(PolicyCase *test, char *dir);
+int request(char kind, int n, int body_bytes);
+int is_cached(char kind, int n);
+int cached_in_order(char kind, int *ns, int count);
+HTTPResponse *make_response(int body_bytes);
+int expect(int condition, const char *what);
+
+
+//
+// Globals
+//
+extern CacheObject *cache;  // looked in without the policy seeing
+
+PolicyCase policy_cases[] = {
+    {"lru eviction order", "lru", 3, check_lru},
+    {"mru eviction order", "mru", 3, check_mru},
+    {"random eviction", "random", 3, check_random},
+    {"lru under a scan", "lru", SCAN_SLOTS, check_lru_scan},
+    {"arc under a scan", "arc", SCAN_SLOTS, check_scan_resistant},
+    {"s3fifo under a scan", "s3fifo", SCAN_SLOTS, check_scan_resistant},
+    {"wtinylfu under a scan", "wtinylfu", SCAN_SLOTS, check_scan_resistant},
+    {"gdsf for objects", "gdsf", GDSF_SLOTS, check_gdsf_objects},
+    {"gdsf for bytes", "gdsf", GDSF_SLOTS, check_gdsf_bytes},
+};
+
+
+//
+// Implementation
+//
+int main() {
+    /* Runs every case in a directory of its own, the cache logs to its
+     * working directory. Exits non-zero if any of them failed */
+
+    char dir[] = "/tmp/policy_test.XXXXXX";
+    int num_cases = sizeof(policy_cases) / sizeof(policy_cases[0]);
+    int failures = 0;
+
+    if (mkdtemp(dir) == NULL) {
+        error_out("Couldn't make a directory to test in!");
+    }
+    for (int i = 0; i < num_cases; i++) {
+        if (run_case(&policy_cases[i], dir) == 0) {
+            printf("--------- POLICY %s PASSED --------\n", policy_cases[i].name);
+        } else {
+            printf("--------- POLICY %s FAILED --------\n", policy_cases[i].name);
+            failures++;
+        }
+    }
+    rmdir(dir);
+
+    return failures != 0;
+}
+
+
+int run_case(PolicyCase *test, char *dir) {
+    /* Runs the case in a child with a cache of its own. Returns how many of
+     * its checks failed */
+
+    HTTPResponse *response;
+    size_t slot;
+    int status;
+    pid_t child;
+
+    // or the child would print what we have buffered again
+    fflush(stdout);
+    if ((child = fork()) < 0) {
+        error_out("Couldn't fork!");
+    }
+    if (child == 0) {
+        if (chdir(dir) < 0) {
+            error_out("Couldn't go to the test directory!");
+        }
+
+        // every object is charged the same, the cache has room for slots
+        response = make_response(BODY_BYTES);
+        slot = object_size("http://example.com/a00000", response);
+        free_response(response);
+        init_cache(test->policy, test->slots * slot + slot / 2,
+                   DEFAULT_MAX_OBJECT_BYTES);
+
+        status = test->check();
+        unlink("cache.log");
+        exit(status);
+    }
+
+    if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status)) {
+        return 1;
+    }
+    return WEXITSTATUS(status);
+}
+
+
+int check_lru() {
+    /* Using the oldest object saves it, the next oldest goes instead */
+
+    int failures = 0, order[] = {2, 0, 3};
+
+    request('a', 0, BODY_BYTES);
+    request('a', 1, BODY_BYTES);
+    request('a', 2, BODY_BYTES);
+    failures += expect(request('a', 0, BODY_BYTES), "lru: hit the first");
+    request('a', 3, BODY_BYTES);
+
+    failures += expect(is_cached('a', 0), "lru: the one just used stays");
+    failures += expect(!is_cached('a', 1), "lru: the least recently used goes");
+    failures += expect(is_cached('a', 2) && is_cached('a', 3), "lru: the rest stay");
+    failures += expect(cached_in_order('a', order, 3),
+                       "lru: listed least recently used first");
+
+    return failures;
+}
+
+
+int check_mru() {
+    /* The object used last goes first */
+
+    int failures = 0;
+
+    request('a', 0, BODY_BYTES);
+    request('a', 1, BODY_BYTES);
+    request('a', 2, BODY_BYTES);
+    failures += expect(request('a', 0, BODY_BYTES), "mru: hit the first");
+    request('a', 3, BODY_BYTES);
+
+    failures += expect(!is_cached('a', 0), "mru: the most recently used goes");
+    failures += expect(is_cached('a', 1) && is_cached('a', 2) && is_cached('a', 3),
+                       "mru: the rest stay");
+
+    return failures;
+}
+
+
+int check_random() {
+    /* Whatever goes, the cache stays as full as its budget lets it be, and
+     * what was just added stays */
+
+    int failures = 0;
+
+    for (int n = 0; n < 20; n++) {
+        request('a', n, BODY_BYTES);
+        failures += expect(is_cached('a', n), "random: the newest stays");
+    }
+
+    cache_lock();
+    failures += expect(HASH_COUNT(cache) == 3, "random: the cache stays full");
+    cache_unlock();
+
+    return failures;
+}
+
+
+int check_lru_scan() {
+    /* Each scan is longer than the cache, so recency alone loses every hot
+     * object to it. Shows the scan is one the others have to resist */
+
+    return expect(scan_hits() < 100 - SCAN_RESISTANT,
+                  "lru: the scan pushed the hot objects out");
+}
+
+
+int check_scan_resistant() {
+    /* Objects asked for once can't push out the ones asked for again */
+
+    return expect(scan_hits() >= SCAN_RESISTANT,
+                  "scan resistant: the hot objects stayed through the scans");
+}
+
+
+int scan_hits() {
+    /* Asks for the hot objects, then scans through as many objects again as
+     * the cache holds, round after round. Returns the percentage of hot
+     * requests that hit once the first rounds have warmed the cache up */
+
+    int hits = 0, requests = 0, hit;
+
+    for (int round = 0; round < SCAN_ROUNDS; round++) {
+        for (int n = 0; n < HOT_OBJECTS; n++) {
+            hit = request('h', n, BODY_BYTES);
+            request('h', n, BODY_BYTES);
+            if (round >= 2) {
+                hits += hit;
+                requests++;
+            }
+        }
+        for (int n = 0; n < SCAN_OBJECTS; n++) {
+            request('s', round * SCAN_OBJECTS + n, BODY_BYTES);
+        }
+    }
+
+    return 100 * hits / requests;
+}
+
+
+int check_gdsf_objects() {
+    /* Asked for twice but three times the size of the small objects, the
+     * large one is worth less per byte and goes first, though it was used
+     * after the oldest of them */
+
+    int failures = 0, smalls;
+
+    set_gdsf_mode("objects");
+    smalls = gdsf_fill();
+    failures += expect(!is_cached('b', 0), "gdsf objects: the large one goes");
+    for (int n = 0; n < smalls; n++) {
+        failures += expect(is_cached('a', n), "gdsf objects: the small ones stay");
+    }
+
+    return failures;
+}
+
+
+int check_gdsf_bytes() {
+    /* Size left out, the large one asked for twice outlasts the small ones
+     * asked for once */
+
+    int failures = 0, smalls, cached = 0;
+
+    set_gdsf_mode("bytes");
+    smalls = gdsf_fill();
+    failures += expect(is_cached('b', 0), "gdsf bytes: the large one stays");
+    for (int n = 0; n < smalls; n++) {
+        cached += is_cached('a', n);
+    }
+    failures += expect(cached == smalls - 1, "gdsf bytes: a small one goes");
+
+    return failures;
+}
+
+
+int gdsf_fill() {
+    /* Caches a small object, then a large one that is asked for again, then
+     * small objects until the first eviction. Returns how many small objects
+     * were asked for */
+
+    int n = 0, evicted = 0;
+
+    request('a', n++, BODY_BYTES);
+    request('b', 0, LARGE_BYTES);
+    request('b', 0, LARGE_BYTES);
+    while (!evicted && n < 2 * GDSF_SLOTS) {
+        request('a', n++, BODY_BYTES);
+        evicted = !is_cached('b', 0);
+        for (int i = 0; i < n && !evicted; i++) {
+            evicted = !is_cached('a', i);
+        }
+    }
+
+    return n;
+}
+
+
+int request(char kind, int n, int body_bytes) {
+    /* Asks the cache for object n of the kind, caching a response of
+     * body_bytes for it on a miss like the proxy would. Returns 1 for a
+     * hit */
+
+    HTTPResponse *response;
+    char url[32];
+    int hit;
+
+    snprintf(url, sizeof(url), URL_FORMAT, kind, n);
+    cache_lock();
+    if (!(hit = get_data_from_cache(url) != NULL)) {
+        response = make_response(body_bytes);
+        if (add_data_to_cache(url, response) == NULL) {
+            free_response(response);
+        }
+    }
+    cache_unlock();
+
+    return hit;
+}
+
+
+int is_cached(char kind, int n) {
+    /* Returns 1 if object n of the kind is cached, without the policy
+     * seeing us look */
+
+    CacheObject *item;
+    char url[32];
+
+    snprintf(url, sizeof(url), URL_FORMAT, kind, n);
+    cache_lock();
+    HASH_FIND_STR(cache, url, item);
+    cache_unlock();
+
+    return item != NULL;
+}
+
+
+int cached_in_order(char kind, int *ns, int count) {
+    /* Returns 1 if the cache holds just objects ns of the kind, and lists
+     * them in that order (see cached_objects) */
+
+    CacheObject **objects;
+    char url[32];
+    size_t cached;
+    int same;
+
+    cache_lock();
+    objects = cached_objects(&cached);
+    same = (int) cached == count;
+    for (int i = 0; same && i < count; i++) {
+        snprintf(url, sizeof(url), URL_FORMAT, kind, ns[i]);
+        same = strcmp(objects[i]->url, url) == 0;
+    }
+    cache_unlock();
+    free(objects);
+
+    return same;
+}
+
+
+HTTPResponse *make_response(int body_bytes) {
+    /* Returns a fresh response with a body of body_bytes */
+
+    char *raw;
+    int header_length = snprintf(NULL, 0, RESPONSE_HEADER, body_bytes);
+    HTTPResponse *response;
+
+    if ((raw = (char *) malloc(header_length + body_bytes + 1)) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    snprintf(raw, header_length + 1, RESPONSE_HEADER, body_bytes);
+    memset(raw + header_length, 'x', body_bytes);
+    if ((response = parse_response(header_length + body_bytes, raw)) == NULL) {
+        error_out("A test response didn't parse!");
+    }
+    free(raw);
+
+    return response;
+}
+
+
+int expect(int condition, const char *what) {
+    /* Returns 0 if the condition holds, 1 (after saying what didn't) if it
+     * doesn't */
+
+    if (!condition) {
+        fprintf(stderr, "%s: failed\n", what);
+    }
+    return !condition;
+}
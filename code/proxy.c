@@ -10,42 +10,117 @@
 // Includes and Definitions
 //
 #include "search_engine.h"
-
-#define NUM_QUEUED_CONNECTIONS 5
+#include "resolver.h"
+#include "upstream.h"
+#include "inflight.h"
+#include "policy.h"
+#include "disk.h"
+#include "snapshot.h"
+
+#define NUM_QUEUED_CONNECTIONS SOMAXCONN
+#define MAX_EVENTS 1024
+#define DEFAULT_IDLE_TIMEOUT 60        // seconds, see timeout_for
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_CONNECT_TIMEOUT 10
+#define DEFAULT_FIRST_BYTE_TIMEOUT 30
+#define USAGE "Usage: ./proxy [--workers N] [--resolvers N] [--dns-ttl SECONDS] " \
+              "[--pool-idle N] [--pool-timeout SECONDS] " \
+              "[--idle-timeout SECONDS] [--header-timeout SECONDS] " \
+              "[--connect-timeout SECONDS] [--first-byte-timeout SECONDS] " \
+              "[--cache-bytes BYTES] [--max-object-bytes BYTES] " \
+              "[--gdsf-mode objects|bytes] [--disk-dir DIR] [--disk-bytes BYTES] " \
+              "[--snapshot FILE] [--snapshot-interval SECONDS] " \
+              "<host name> <port number> <OPTIONAL: eviction policy>"
 
 
 //
 // Data Structures
 //
 char *Proxy_URL = NULL;
+__thread int Epoll_FD = -1;  // every worker runs its own event loop
+__thread ResolverQueue *Resolver_Queue = NULL;  // ...and collects its lookups
+__thread UpstreamPool *Upstream_Pool = NULL;     // ...and keeps its idle servers
+__thread Fetch *Fetches = NULL;                  // ...and the misses in flight,
+                                                 // only coalesced within a worker
+__thread TimerWheel *Timers = NULL;              // ...and its connections' deadlines
+int Timeout_Seconds[TIMEOUT_KINDS] = {           // by TimeoutKind, 0 for none
+    0, DEFAULT_IDLE_TIMEOUT, DEFAULT_HEADER_TIMEOUT, DEFAULT_CONNECT_TIMEOUT,
+    DEFAULT_FIRST_BYTE_TIMEOUT, 0
+};
 
 
 //
 // Forward Declarations
 //
 int setup_server(int port_num);
-int handle_client(int client, int proxy, char *buffer, Connection **connection_list,
-                  int *max_fd, fd_set *master);
-int handle_get_request(int sockfd, int proxy, int last_read, Connection *connection,
-                       Connection **connection_list, int *max_fd, fd_set *master);
-int handle_connect_request(int sockfd, int proxy, int last_read, Connection *connection,
-                           Connection **connection_list, int *max_fd, fd_set *master);
-int handle_options_request(int sockfd, int proxy, int last_read, Connection *connection,
-                           Connection **connection_list, int *max_fd, fd_set *master);
-int handle_cache_request(int sockfd, int proxy, int last_read, Connection *connection,
-                         Connection **connection_list, int *max_fd, fd_set *master);
-int handle_cache_query(int sockfd, int proxy, int last_read, Connection *connection,
-                       Connection **connection_list, int *max_fd, fd_set *master);
-int handle_cache_get(int sockfd, int proxy, int last_read, Connection *connection,
-                     Connection **connection_list, int *max_fd, fd_set *master);
-int handle_get_response(int last_read, Connection *connection);
-int handle_connect_response(int last_read, Connection *connection);
+void *run_worker(void *arg);
+void run_snapshots(char *path, int interval, sigset_t *signals);
+int handle_client(int client, ConnectionTable *connection_list);
+int process_requests(Connection *connection, ConnectionTable *connection_list);
+int finish_request(Connection *connection);
+int handle_get_request(int sockfd, int last_read, Connection *connection,
+                       ConnectionTable *connection_list);
+int handle_connect_request(int sockfd, int last_read, Connection *connection,
+                           ConnectionTable *connection_list);
+int handle_options_request(int sockfd, int last_read, Connection *connection,
+                           ConnectionTable *connection_list);
+int handle_cache_request(int sockfd, int last_read, Connection *connection,
+                         ConnectionTable *connection_list);
+int handle_cache_query(int sockfd, int last_read, Connection *connection,
+                       ConnectionTable *connection_list);
+int handle_cache_get(int sockfd, int last_read, Connection *connection,
+                     ConnectionTable *connection_list);
+int handle_get_response(int last_read, Connection *connection,
+                        ConnectionTable *connection_list);
+int finish_response(Connection *connection, ConnectionTable *connection_list);
+int handle_not_modified(Connection *connection, ConnectionTable *connection_list);
+int send_cached(Connection *client, HTTPResponse *response,
+                DiskObject *disk_object);
+int send_rest(Connection *client, ConnectionTable *connection_list);
+int relay_to(Connection *client, char *data, int length);
+int send_and_close(Connection *client, char *data, int length);
+int fetch_backlog(Connection *server, ConnectionTable *connection_list);
+Connection *relaying_server(Connection *client, ConnectionTable *connection_list);
+int resume_server(Connection *server, ConnectionTable *connection_list);
+int answer_from_cache(Connection *client, int stale);
+void answer_waiters(Fetch *fetch, int stale, ConnectionTable *connection_list);
+int serve_stale_on_error(Connection *client, Connection *server,
+                         ConnectionTable *connection_list);
+void background_fetch(char *pending, int pending_len, int revalidating,
+                      ConnectionTable *connection_list);
+int release_server(Connection *connection, int persistent,
+                   ConnectionTable *connection_list);
+int join_fetch(Fetch *fetch, Connection *connection);
+Fetch *leader_fetch(Connection *client);
+Fetch *server_fetch(Connection *server, ConnectionTable *connection_list);
+void relay_fetch(Connection *server, char *data, int length,
+                 ConnectionTable *connection_list);
+void finish_fetch(Fetch *fetch, ConnectionTable *connection_list);
+Connection *hand_over_fetch(Connection *leader, ConnectionTable *connection_list);
+void drop_connection(int sockfd, ConnectionTable *connection_list);
+int handle_writable(int sockfd, ConnectionTable *connection_list);
+int server_connected(Connection *server, Connection *client);
+void handle_timeout();
+TimeoutKind timeout_for(Connection *connection);
+void set_timeout(Connection *connection, int active);
+void handle_expired(ConnectionTable *connection_list);
+void close_connection(int sockfd, ConnectionTable *connection_list);
+int begin_server(Connection *connection, ConnectionTable *connection_list);
+int open_server(Connection *connection, ConnectionTable *connection_list);
+int retry_server(Connection *server, ConnectionTable *connection_list);
+int start_server(Connection *connection, struct in_addr *addr,
+                 ConnectionTable *connection_list);
+int send_connect_established(Connection *connection);
+void handle_resolutions(ConnectionTable *connection_list);
+int relay_tunnel(Connection *connection, ConnectionTable *connection_list);
+int tunnel_writable(Connection *connection, ConnectionTable *connection_list);
 int serialize_results(URLResults *results, char **raw_ptr);
-void add_select(int sockfd, int *max_fd, fd_set *master);
+void add_epoll(int sockfd);
+void watch_writable(int sockfd, int on);
 void setup_get_server(int server, Connection *client_connection,
-                      Connection **connection_list);
-void handle_activity(fd_set *master, fd_set *readfds, int *max_fd, int proxy,
-                     char *buffer, Connection **connection_list);
+                      ConnectionTable *connection_list);
+void handle_activity(struct epoll_event *events, int n, int proxy,
+                     ConnectionTable *connection_list);
 
 
 //
@@ -54,85 +129,265 @@ void handle_activity(fd_set *master, fd_set *readfds, int *max_fd, int proxy,
 int main(int argc, char **argv) {
     /* Runs the full program */
 
+    // important variables
+    // NOTE: the variable 'proxy' (defined in run_worker) refers to the proxy
+    //       server we use to serve client requests. the variable 'server'
+    //       defined later refers to the connections we make to the servers as
+    //       requested by clients.
+    int port_num, workers = 1, resolvers = DEFAULT_RESOLVER_THREADS,
+        dns_ttl = DEFAULT_DNS_TTL, pool_idle = DEFAULT_POOL_IDLE,
+        pool_timeout = DEFAULT_POOL_TIMEOUT,
+        snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL, opt;
+    size_t cache_bytes = DEFAULT_CACHE_BYTES,
+           max_object_bytes = DEFAULT_MAX_OBJECT_BYTES,
+           disk_bytes = DEFAULT_DISK_BYTES;
+    char *hostname, *port, *eviction = NULL, *disk_dir = NULL, *snapshot = NULL;
+    pthread_t *threads;
+    sigset_t signals;
+    static struct option long_options[] = {
+        {"workers", required_argument, NULL, 'w'},
+        {"resolvers", required_argument, NULL, 'r'},
+        {"dns-ttl", required_argument, NULL, 'd'},
+        {"pool-idle", required_argument, NULL, 'i'},
+        {"pool-timeout", required_argument, NULL, 't'},
+        {"idle-timeout", required_argument, NULL, 'I'},
+        {"header-timeout", required_argument, NULL, 'H'},
+        {"connect-timeout", required_argument, NULL, 'C'},
+        {"first-byte-timeout", required_argument, NULL, 'F'},
+        {"cache-bytes", required_argument, NULL, 'c'},
+        {"max-object-bytes", required_argument, NULL, 'm'},
+        {"gdsf-mode", required_argument, NULL, 'g'},
+        {"disk-dir", required_argument, NULL, 'D'},
+        {"disk-bytes", required_argument, NULL, 'B'},
+        {"snapshot", required_argument, NULL, 's'},
+        {"snapshot-interval", required_argument, NULL, 'S'},
+        {0, 0, 0, 0}
+    };
+
+    // parse options, whatever is left over is positional
+    while ((opt = getopt_long(argc, argv, "w:r:d:i:t:I:H:C:F:c:m:g:D:B:s:S:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'w':
+                if ((workers = atoi(optarg)) < 1) {
+                    error_out("Need at least one worker!\n" USAGE);
+                }
+                break;
+            case 'r':
+                if ((resolvers = atoi(optarg)) < 1) {
+                    error_out("Need at least one resolver!\n" USAGE);
+                }
+                break;
+            case 'd':
+                dns_ttl = atoi(optarg);
+                break;
+            case 'i':
+                pool_idle = atoi(optarg);
+                break;
+            case 't':
+                pool_timeout = atoi(optarg);
+                break;
+            case 'I':
+                Timeout_Seconds[IDLE_TIMEOUT] = atoi(optarg);
+                break;
+            case 'H':
+                Timeout_Seconds[HEADER_TIMEOUT] = atoi(optarg);
+                break;
+            case 'C':
+                Timeout_Seconds[CONNECT_TIMEOUT] = atoi(optarg);
+                break;
+            case 'F':
+                Timeout_Seconds[FIRST_BYTE_TIMEOUT] = atoi(optarg);
+                break;
+            case 'c':
+                cache_bytes = strtoull(optarg, NULL, 10);
+                break;
+            case 'm':
+                max_object_bytes = strtoull(optarg, NULL, 10);
+                break;
+            case 'g':
+                if (set_gdsf_mode(optarg) < 0) {
+                    error_out("Unknown GDSF mode!\n" USAGE);
+                }
+                break;
+            case 'D':
+                disk_dir = optarg;
+                break;
+            case 'B':
+                disk_bytes = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                snapshot = optarg;
+                break;
+            case 'S':
+                snapshot_interval = atoi(optarg);
+                break;
+            default:
+                error_out("Unknown option!\n" USAGE);
+        }
+    }
+
+    // a client sharing a fetch outlasts every deadline the fetch itself is
+    // held to, so it only gives up on one that was lost along the way
+    if (Timeout_Seconds[CONNECT_TIMEOUT] > 0 &&
+            Timeout_Seconds[FIRST_BYTE_TIMEOUT] > 0 &&
+            Timeout_Seconds[IDLE_TIMEOUT] > 0) {
+        Timeout_Seconds[WAIT_TIMEOUT] = Timeout_Seconds[CONNECT_TIMEOUT] +
+            (Timeout_Seconds[FIRST_BYTE_TIMEOUT] > Timeout_Seconds[IDLE_TIMEOUT] ?
+             Timeout_Seconds[FIRST_BYTE_TIMEOUT] : Timeout_Seconds[IDLE_TIMEOUT]);
+    }
+
     // we require a port to listen on
-    if (argc < 3) {
-        error_out("Incorrect number of arguments!\n"
-                  "Usage: ./proxy <host name> <port number> <OPTIONAL: eviction policy>");
+    if (argc - optind < 2) {
+        error_out("Incorrect number of arguments!\n" USAGE);
+    }
+    hostname = argv[optind];
+    port = argv[optind + 1];
+    if (argc - optind > 2) {
+        eviction = argv[optind + 2];
     }
 
-    // important variables
-    // NOTE: the variable 'proxy' (defined below) refers to the proxy server we
-    //       use to serve client requests. the variable 'server' defined later
-    //       refers to the connections we make to the servers as requested by
-    //       clients.
-    int port_num, proxy, max_fd, n;
-    char buffer[BUFFER_SIZE];
-    fd_set master, readfds;
-    struct timeval tv;
-
-    Connection *connection_list = NULL;  /* IMPORTANT: initialize this to NULL
-                                          *            - UTHash requirement */
-    if (argc == 3) {
-        init_cache(NULL);
-    } else {
-        init_cache(argv[3]);
+    // curl's global state isn't thread safe, set it up before the workers
+    curl_global_init(CURL_GLOBAL_ALL);
+    signal(SIGPIPE, SIG_IGN);  // a client hanging up mid-write is just an error
+    init_scan();
+    init_cache(eviction, cache_bytes, max_object_bytes);
+    if (disk_dir != NULL) {
+        init_disk(disk_dir, disk_bytes);
+    }
+    init_resolver(resolvers, dns_ttl);
+    init_upstream_pool(pool_idle, pool_timeout);
+    if (snapshot != NULL) {
+        cache_lock();
+        if (load_snapshot(snapshot) >= 0) {
+            printf("Loaded the cache from %s\n", snapshot);
+        }
+        cache_unlock();
+
+        // the workers inherit this, so SIGTERM and SIGINT are left to the
+        // main thread, which saves the cache before exiting on them
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
     }
 
     // setup server
-    if ((Proxy_URL = (char *) malloc(strlen(argv[1]) + 1 + strlen(argv[2]) + 1))
+    if ((Proxy_URL = (char *) malloc(strlen(hostname) + 1 + strlen(port) + 1))
             == NULL) {
         // in case of malloc failing, we set the Proxy_URL to EMPTY because
         // that will never match the host of a GET
         Proxy_URL = EMPTY;
     } else {
-        bzero(Proxy_URL, strlen(argv[1] + 1 + strlen(argv[2]) + 1));
-        Proxy_URL[strlen(argv[1]) + 1 + strlen(argv[2])] = '\0';
-        memcpy(Proxy_URL, argv[1], strlen(argv[1]));
-        memcpy(Proxy_URL + strlen(argv[1]), COLON, 1);
-        memcpy(Proxy_URL + strlen(argv[1]) + 1, argv[2], strlen(argv[2]));
-    }
-    port_num = atoi(argv[2]);
-    proxy = setup_server(port_num);
-    printf("Listening on port %d...\n", port_num);
-
-    // setup select
-    FD_ZERO(&master);
-    FD_SET(proxy, &master);
-    max_fd = proxy;
-    tv.tv_sec = TIMEOUT_INTERVAL;
-    tv.tv_usec = TIMEOUT_INTERVAL;
-
-    // start waiting for clients to connect
-    while (1) {
-        FD_ZERO(&readfds);
-        memcpy(&readfds, &master, sizeof(master));
-        if ((n = select(max_fd + 1, &readfds, NULL, NULL, NULL)) == -1) {
-            error_out("Select errored out!");
-        } else if (n == 0) {
-            error_declare("TODO: Handle Timeout!");
-            tv.tv_sec = TIMEOUT_INTERVAL;
-            tv.tv_usec = TIMEOUT_INTERVAL;
-        } else {
-            handle_activity(&master, &readfds, &max_fd, proxy, buffer, &connection_list);
+        bzero(Proxy_URL, strlen(hostname) + 1 + strlen(port) + 1);
+        memcpy(Proxy_URL, hostname, strlen(hostname));
+        memcpy(Proxy_URL + strlen(hostname), COLON, 1);
+        memcpy(Proxy_URL + strlen(hostname) + 1, port, strlen(port));
+    }
+    port_num = atoi(port);
+
+    // every worker binds its own listening socket (SO_REUSEPORT) and the
+    // kernel spreads incoming connections across them
+    if ((threads = (pthread_t *) malloc(workers * sizeof(pthread_t))) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, run_worker, &port_num) != 0) {
+            error_out("Couldn't start worker!");
         }
     }
+    printf("Listening on port %d with %d worker(s)...\n", port_num, workers);
+    fflush(stdout);
+    if (snapshot != NULL) {
+        run_snapshots(snapshot, snapshot_interval, &signals);
+    }
 
     // cleanup and exit
-    for (int i = 3; i < max_fd; i++) {
-        FD_CLR(i, &master);
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
     }
-    FD_ZERO(&readfds);
-    FD_ZERO(&master);
+    free(threads);
     destroy_cache();
-    close(proxy);
+    curl_global_cleanup();
     exit(EXIT_SUCCESS);
 }
 
 
+void run_snapshots(char *path, int interval, sigset_t *signals) {
+    /* Saves the cache to path every interval seconds (only on exit if it
+     * isn't positive), and once more on SIGTERM or SIGINT before exiting.
+     * Never returns */
+
+    struct timespec timeout = {interval, 0};
+    int signal_number;
+
+    while (1) {
+        signal_number = sigtimedwait(signals, NULL, interval > 0 ? &timeout : NULL);
+        if (signal_number < 0 && errno != EAGAIN) {
+            continue;
+        }
+
+        // the workers carry on while it is written, see save_snapshot
+        save_snapshot(path);
+        if (signal_number > 0) {
+            cache_lock();
+            destroy_cache();
+            exit(EXIT_SUCCESS);
+        }
+    }
+}
+
+
+void *run_worker(void *arg) {
+    /* Runs one event loop: a listening socket, an epoll instance and a
+     * connection list that belong to this thread alone. Only the cache is
+     * shared between workers */
+
+    int proxy, n;
+    struct epoll_event events[MAX_EVENTS];
+
+    ConnectionTable *connection_list = create_connection_table();
+
+    proxy = setup_server(*(int *) arg);
+
+    // setup epoll, the listening socket is edge-triggered like everyone else
+    if ((Epoll_FD = epoll_create1(0)) < 0) {
+        error_out("Couldn't create epoll instance!");
+    }
+    add_epoll(proxy);
+    Resolver_Queue = create_resolver_queue();
+    add_epoll(Resolver_Queue->eventfd);
+    if ((Timers = create_timer_wheel()) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+
+    // start waiting for clients to connect, waking up in time for the next
+    // deadline
+    while (1) {
+        if ((n = epoll_wait(Epoll_FD, events, MAX_EVENTS,
+                            timer_wait_ms(Timers, TIMEOUT_INTERVAL * 1000))) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_out("Epoll errored out!");
+        } else {
+            handle_activity(events, n, proxy, connection_list);
+        }
+        handle_expired(connection_list);
+        handle_timeout();
+    }
+
+    // cleanup
+    close(Epoll_FD);
+    close(proxy);
+
+    return NULL;
+}
+
+
 int setup_server(int port_num) {
     /* Setup the server and return its connection information */
 
-    int sockfd;
+    int sockfd, on = 1;
     struct sockaddr_in address;
 
     // setup server info
@@ -145,6 +400,18 @@ int setup_server(int port_num) {
         error_out("Server socket could not be created!");
     }
 
+    // new clients are accepted in a loop until the queue is drained, so the
+    // listening socket must never block
+    if (set_nonblocking(sockfd) < 0) {
+        error_out("Server socket could not be made non-blocking!");
+    }
+
+    // several workers listen on the same port, each with its own socket
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        error_out("Server socket options could not be set!");
+    }
+
     // bind socket to any port available and our specified ip address
     if (bind(sockfd, (struct sockaddr *) &address, sizeof(address)) < 0) {
         error_out("Server socket could not be bound!");
@@ -159,45 +426,75 @@ int setup_server(int port_num) {
 }
 
 
-void handle_activity(fd_set *master, fd_set *readfds, int *max_fd, int proxy,
-                     char *buffer, Connection **connection_list) {
+void handle_activity(struct epoll_event *events, int n, int proxy,
+                     ConnectionTable *connection_list) {
     /* Handles client requests */
 
-    int n = 0;
-
-    // if there are multiple such proxies being used in the user's environment,
-    // there are no guarantees as to which file descriptor a new connection
-    // will receive. therefore, we check all possible file descriptors since a
-    // new connection will have a file descriptor larger than our 'max_fd', but
-    // we cannot say with certainty which one.
-    for (int i = 0; i < *max_fd + 1; i++) {
-        if (FD_ISSET(i, readfds)) {
-            if (i == proxy) {
-                if ((n = add_client(proxy, connection_list)) > 0) {
-
-                    // Client knows if they weren't able to contact us so no
-                    // one is left waiting. We do need to handle it if we
-                    // cannot accept clients so we log it in accept_client.
-                    add_select(n, max_fd, master);
-                } else {
-                    error_declare("Client wasn't accepted??\n");
-                }
-            } else {
-                if ((n = handle_client(i, proxy, buffer, connection_list,
-                                       max_fd, master)) <= 0) {
+    int sockfd = 0;
 
-                    // We either errored out or finished our conversation.
-                    // This is cleanup.
-                    remove_connection(i, master, connection_list);
-                }
+    // epoll only hands us the sockets that are ready, so we never have to
+    // scan the descriptors that are idle
+    for (int i = 0; i < n; i++) {
+        sockfd = events[i].data.fd;
+        if (sockfd == proxy) {
+
+            // edge-triggered: accept everyone that is queued up right now,
+            // we won't be told about them again
+            while ((sockfd = add_client(proxy, connection_list)) > 0) {
+                add_epoll(sockfd);
+                set_timeout(search_connection(sockfd, connection_list), 1);
             }
+        } else if (sockfd == Resolver_Queue->eventfd) {
+            handle_resolutions(connection_list);
+        } else if (((events[i].events & EPOLLOUT) &&
+                    handle_writable(sockfd, connection_list) <= 0) ||
+                   ((events[i].events & ~EPOLLOUT) &&
+                    handle_client(sockfd, connection_list) <= 0)) {
+            close_connection(sockfd, connection_list);
+        } else {
+
+            // whatever happened may have moved it on to another deadline
+            set_timeout(search_connection(sockfd, connection_list), 1);
+        }
+    }
+}
+
+
+void close_connection(int sockfd, ConnectionTable *connection_list) {
+    /* We either errored out or finished our conversation. A server that
+     * failed before we passed anything on may have left a stale copy to
+     * serve instead. This is cleanup */
+
+    Connection *server = search_connection(sockfd, connection_list), *client;
+    int held, retried;
+
+    // a connection from the pool may have been closed under us, the client
+    // gets another go on a fresh one then
+    client = server != NULL ? search_connection(server->target_sockfd,
+                                                connection_list) : NULL;
+    if (server != NULL && (retried = retry_server(server, connection_list)) != 0) {
+        if (retried < 0 && !serve_stale_on_error(client, NULL, connection_list)) {
+            drop_connection(client->requesting_sockfd, connection_list);
         }
+        return;
+    }
+
+    if (server == NULL || !server->is_server || server->response != NULL ||
+            !serve_stale_on_error(search_connection(server->target_sockfd,
+                                                    connection_list),
+                                  server, connection_list)) {
+        // a waiter that leaves may have been holding its server back
+        held = server != NULL && server->state == WAITING &&
+               (server = relaying_server(server, connection_list)) != NULL ?
+               server->requesting_sockfd : -1;
+        drop_connection(sockfd, connection_list);
+        resume_server(search_connection(held, connection_list),
+                      connection_list);
     }
 }
 
 
-int handle_client(int sockfd, int proxy, char *buffer, Connection **connection_list,
-                  int *max_fd, fd_set *master) {
+int handle_client(int sockfd, ConnectionTable *connection_list) {
     /* Handles client */
     // TODO: Adapt this to handle POST at some point (requires more thought)
     //       for now we are assuming that all requests we handle will be
@@ -206,62 +503,123 @@ int handle_client(int sockfd, int proxy, char *buffer, Connection **connection_l
     int last_read = -1;
     Connection *connection = search_connection(sockfd, connection_list);
 
-    // read from the sockfd
-    last_read = read_sockfd(sockfd, buffer, connection);
-
-    // parse read from the sockfd
-    if (last_read > 0) {
-        if (connection->target_sockfd < 0) {
-
-            // communication hasn't started between client and server
-            if (!header_not_completed(connection->raw, connection->read_len)) {
-
-                connection->request = parse_request(connection->read_len, connection->raw);
-                // display_request(connection->request);
-
-                if (connection->request->method == GET) {
-
-                    // if we are the host then it is a query for the cache
-                    if (strcmp(get_hdr_value(connection->request->hdrs, "Host"),
-                            Proxy_URL) == 0) {
-                        last_read = handle_cache_request(sockfd, proxy, last_read,
-                                                         connection, connection_list,
-                                                         max_fd, master);
-                    } else {
-                        last_read = handle_get_request(sockfd, proxy, last_read,
-                                                       connection, connection_list,
-                                                       max_fd, master);
-                    }
-                } else if (connection->request->method == CONNECT) {
-                    last_read = handle_connect_request(sockfd, proxy, last_read,
-                                                       connection, connection_list,
-                                                       max_fd, master);
-                } else if (connection->request->method == OPTIONS) {
-                    last_read = handle_options_request(sockfd, proxy, last_read,
-                                                       connection, connection_list,
-                                                       max_fd, master);
-                } else {
-                    error_declare("Unsupported request!");
-                    last_read = -1;
-                }
+    // the connection may have been torn down by an earlier event in this batch
+    if (connection == NULL) {
+        return -1;
+    }
 
-                // clear out buffer
-                free(connection->raw);
-                connection->raw = NULL;
-                connection->read_len = 0;
-            }
-        } else {
+    // a tunnel's bytes are never looked at, they don't go through raw
+    if (connection->state == CONNECTED && connection->request->method == CONNECT) {
+        return relay_tunnel(connection, connection_list);
+    }
+
+    // edge-triggered: keep reading until the socket would block. we look the
+    // connection up again every time around, finishing a response may have
+    // handed a server connection back to the pool
+    while (connection != NULL && !connection->paused &&
+           (last_read = read_sockfd(sockfd, connection)) > 0) {
+        if (connection->is_server) {
 
-            // communication is underway (target_fd being set means that a
-            // valid request was received, and communication can now start)
+            // a server is answering one of our clients
             if (connection->request->method == GET) {
-                last_read = handle_get_response(last_read, connection);
-            } else if (connection->request->method == CONNECT) {
-                last_read = handle_connect_response(last_read, connection);
+                last_read = handle_get_response(last_read, connection,
+                                                connection_list);
             } else {
                 error_declare("Unsupported response!");
                 last_read = -1;
             }
+        } else if (connection->state == IDLE) {
+            last_read = process_requests(connection, connection_list);
+        }
+
+        // otherwise the client is waiting on a server, anything it sends is
+        // held on to until then (pipelined requests or early tunnel data)
+
+        if (last_read <= 0) {
+            break;
+        }
+        connection = search_connection(sockfd, connection_list);
+    }
+
+    // a server waiting on its clients is read from again once they catch up
+    if (connection != NULL && connection->paused) {
+        return 1;
+    }
+
+    // a client that is done sending may still be taking its response
+    if (last_read == 0 && connection != NULL && !connection->is_server &&
+            has_unsent(connection)) {
+        connection->keep_alive = 0;
+        return 1;
+    }
+
+    // a body that ends with the connection is all in once the server closes
+    // it, any other is cut short
+    if (last_read == 0 && connection != NULL && connection->is_server &&
+            connection->response != NULL &&
+            end_body(&(connection->decoder), connection->response) == BODY_COMPLETE) {
+        return finish_response(connection, connection_list);
+    }
+
+    // nothing left to read for now, the connection stays open
+    if (connection == NULL || last_read == WOULD_BLOCK) {
+        last_read = 1;
+    }
+
+    return last_read;
+}
+
+
+int process_requests(Connection *connection, ConnectionTable *connection_list) {
+    /* Handles the complete requests in the client's buffer in order. Stops
+     * once one of them has to wait on a server, the rest stay buffered until
+     * its response has been sent (see release_server) */
+
+    int last_read = 1, length = 0, sockfd = connection->requesting_sockfd;
+    char *host = NULL;
+
+    while (last_read > 0 && connection->state == IDLE &&
+           (length = parse_header(connection->parser, connection->raw,
+                                  connection->read_len)) != PARSE_INCOMPLETE) {
+
+        // there is no telling where the next request would start either
+        if (length == PARSE_MALFORMED) {
+            return send_and_close(connection, BAD_REQUEST, strlen(BAD_REQUEST));
+        }
+        connection->request = parsed_request(connection->parser,
+                                             connection->raw, length);
+        init_parser(connection->parser, 0);
+        connection->keep_alive = is_persistent(connection->request->version,
+                                               connection->request->hdrs);
+        // display_request(connection->request);
+
+        // whatever follows the header is the next pipelined request
+        connection->read_len -= length;
+        memmove(connection->raw, connection->raw + length, connection->read_len);
+        if (connection->read_len == 0) {
+            release_buffer(connection);
+        }
+
+        if (connection->request->method == GET) {
+
+            // if we are the host then it is a query for the cache
+            host = find_hdr(connection->request->hdrs, HOST);
+            if (host != NULL && strcmp(host, Proxy_URL) == 0) {
+                last_read = handle_cache_request(sockfd, last_read,
+                                                 connection, connection_list);
+            } else {
+                last_read = handle_get_request(sockfd, last_read,
+                                               connection, connection_list);
+            }
+        } else if (connection->request->method == CONNECT) {
+            last_read = handle_connect_request(sockfd, last_read,
+                                               connection, connection_list);
+        } else if (connection->request->method == OPTIONS) {
+            last_read = handle_options_request(sockfd, last_read,
+                                               connection, connection_list);
+        } else {
+            error_declare("Unsupported request!");
+            last_read = -1;
         }
     }
 
@@ -269,29 +627,109 @@ int handle_client(int sockfd, int proxy, char *buffer, Connection **connection_l
 }
 
 
-int handle_get_request(int sockfd, int proxy, int last_read, Connection *connection,
-                       Connection **connection_list, int *max_fd, fd_set *master) {
+int finish_request(Connection *connection) {
+    /* The client has its full response. Returns 1 if the connection stays
+     * open for the client's next request, 0 if we are done with it */
+
+    // or will have once what is queued for it is sent, see send_rest
+    if (has_unsent(connection)) {
+        connection->state = SENDING;
+        set_timeout(connection, 1);
+        return 1;
+    }
+    if (!connection->keep_alive) {
+        return 0;
+    }
+
+    free_request(connection->request);
+    connection->request = NULL;
+    connection->response = NULL;  // handling response is the cache's business
+    connection->target_sockfd = -1;
+    connection->revalidating = 0;
+    connection->state = IDLE;
+    set_timeout(connection, 1);
+
+    return 1;
+}
+
+
+int handle_get_request(int sockfd, int last_read, Connection *connection,
+                       ConnectionTable *connection_list) {
     /* Handles the GET request */
 
+    Fetch *fetch;
+    HTTPResponse *stale;
+    DiskObject *disk_object;
+    char *pending = NULL;
+    int conditional = 0, pending_len = 0, revalidating = 0;
+
+    for (HTTPHeader *hdr = connection->request->hdrs; hdr; hdr = hdr->next) {
+        conditional |= is_conditional(hdr->name);
+    }
+
+    cache_lock();
     if ((connection->response = get_data_from_cache(connection->request->url)) != NULL) {
                     
         // Data was found in the cache
-        char *raw_data;
-        int raw_data_len = 0;
-        raw_data_len = construct_response(connection->response, &raw_data);
-        write_to_socket(sockfd, raw_data, raw_data_len);
-        last_read = 0;
+        if ((last_read = send_cached(connection, connection->response, NULL)) > 0) {
+            last_read = finish_request(connection);
+        }
+    } else if ((disk_object = get_data_from_disk(connection->request->url)) != NULL) {
+
+        // Data was found on disk, only the header is in memory and the body
+        // goes straight from its segment to the client (from memory still,
+        // if it hasn't been written yet)
+        if ((last_read = send_cached(connection, disk_object->response,
+                                     disk_object->writing ? NULL :
+                                     disk_object)) > 0) {
+            last_read = finish_request(connection);
+        }
+    } else if ((stale = get_stale_from_cache(connection->request->url,
+                                             STALE_WHILE_REVALIDATE)) != NULL) {
+
+        // Data is stale but the server lets us serve it as it is while we
+        // refresh it in the background, unless someone is fetching it already.
+        // The refresh is started once the cache is unlocked, with what it
+        // needs of the stale copy built into its request now
+        if (find_fetch(&Fetches, connection->request->url) == NULL) {
+            pending_len = construct_request(connection->request, stale, &pending);
+            revalidating = can_revalidate(stale);
+        }
+        if ((last_read = send_cached(connection, stale, NULL)) > 0) {
+            last_read = finish_request(connection);
+        }
+        if (pending != NULL) {
+            background_fetch(pending, pending_len, revalidating, connection_list);
+        }
+    } else if ((fetch = find_fetch(&Fetches, connection->request->url)) != NULL &&
+               !fetch->closed) {
+        cache_unlock();
+
+        // Someone is already fetching it, share their response rather than
+        // going to the server again
+        last_read = join_fetch(fetch, connection);
     } else {
 
-        // Data wasn't found in the cache
-        int server = add_server(proxy, sockfd, connection->request, connection_list);
-        if (server > 0) {
-            add_select(server, max_fd, master);
-            last_read = write_to_socket(server, connection->raw, connection->read_len);
-        } else {
+        // Data wasn't found in the cache, hold on to the request until we
+        // have a connection to the server to forward it on. A stale copy may
+        // only need the server's word that it is still good
+        stale = get_stale_from_cache(connection->request->url,
+                                     STALE_TO_REVALIDATE);
+        connection->revalidating = stale != NULL;
+        connection->pending_len = construct_request(connection->request, stale,
+                                                    &(connection->pending));
+        cache_unlock();
+
+        // anyone else who asks for it meanwhile waits on this fetch, unless
+        // the answer is only good for this client's own copy (or someone's
+        // fetch of a response that won't be cached is still going)
+        if (fetch == NULL && (!conditional || stale != NULL)) {
+            start_fetch(&Fetches, connection->request->url, sockfd,
+                        connection->serial);
+        }
+        if ((last_read = begin_server(connection, connection_list)) <= 0) {
             // removes client in case of error
             error_declare("Couldn't add server??\n");
-            last_read = -1;
         }
     }
 
@@ -299,100 +737,347 @@ int handle_get_request(int sockfd, int proxy, int last_read, Connection *connect
 }
 
 
-int handle_connect_request(int sockfd, int proxy, int last_read, Connection *connection,
-                           Connection **connection_list, int *max_fd, fd_set *master) {
-    /* Handle the CONNECT request */
+int handle_connect_request(int sockfd, int last_read, Connection *connection,
+                           ConnectionTable *connection_list) {
+    /* Handle the CONNECT request, the client hears back once the tunnel to
+     * the destination server is up (see handle_writable) */
 
-    int server = add_server(proxy, sockfd, connection->request, connection_list);
-    if (server > 0) {
-        add_select(server, max_fd, master);
-
-        // send 200 to client indicating we have successfully opened a tunnel to
-        // the destination server
-        char *resp = NULL;;
-        int resp_len = strlen(connection->request->version) + strlen(OK) + strlen(CRLF2);
-        if ((resp = (char *) malloc(resp_len)) == NULL) {
-            error_out("Couldn't malloc!");
-        }
-        bzero(resp, resp_len);
-        memcpy(resp, connection->request->version, strlen(connection->request->version));
-        memcpy(resp + strlen(connection->request->version), OK, strlen(OK));
-        memcpy(resp + strlen(connection->request->version) + strlen(OK), CRLF2, strlen(CRLF2));
-        last_read = write_to_socket(sockfd, resp, resp_len);
-        free(resp);
-        resp = NULL;
-    } else {
+    (void) sockfd;
+    if ((last_read = begin_server(connection, connection_list)) <= 0) {
         // removes client in case of error
         error_declare("Couldn't add server??\n");
-        last_read = -1;
     }
 
     return last_read;
 }
 
-int handle_options_request(int sockfd, int proxy, int last_read, Connection *connection,
-                           Connection **connection_list, int *max_fd, fd_set *master) {
-    /* Handle the OPTIONS request */
 
-    int server = add_server(proxy, sockfd, connection->request, connection_list);
-    if (server > 0) {
-        add_select(server, max_fd, master);
+int send_connect_established(Connection *connection) {
+    /* Send 200 to client indicating we have successfully opened a tunnel to
+     * the destination server. What its socket won't take now is queued */
 
-        // respond to the preflight request with an Access-Control-Allow-Methods response header
-        char *response = NULL;
-        int response_length = 0;
-        if ((connection->response = (HTTPResponse *) malloc(sizeof(HTTPResponse)))
-                == NULL) {
-            error_out("Couldn't malloc!");
+    int last_read = 0;
+    char *resp = NULL;
+    int resp_len = strlen(connection->request->version) + strlen(OK) + strlen(CRLF2);
+    if ((resp = (char *) malloc(resp_len)) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    bzero(resp, resp_len);
+    memcpy(resp, connection->request->version, strlen(connection->request->version));
+    memcpy(resp + strlen(connection->request->version), OK, strlen(OK));
+    memcpy(resp + strlen(connection->request->version) + strlen(OK), CRLF2, strlen(CRLF2));
+    last_read = relay_to(connection, resp, resp_len) < 0 ? -1 : 1;
+    free(resp);
+    resp = NULL;
+
+    return last_read;
+}
+
+
+int handle_options_request(int sockfd, int last_read, Connection *connection,
+                           ConnectionTable *connection_list) {
+    /* Handle the OPTIONS request, we answer the preflight ourselves so there
+     * is no need to connect to the server */
+
+    // respond to the preflight request with an Access-Control-Allow-Methods response header
+    char *response = NULL;
+    int response_length = 0;
+
+    (void) sockfd;
+    (void) connection_list;
+    if ((connection->response = (HTTPResponse *) malloc(sizeof(HTTPResponse)))
+            == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    if ((connection->response->version =
+            (char *) malloc(strlen(connection->request->version) + 1)) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+
+    // setup response
+    memcpy(connection->response->version, connection->request->version,
+           strlen(connection->request->version) + 1);
+    connection->response->status_desc = "No Content";
+    connection->response->status = "204";
+    connection->response->hdrs = NULL;
+    connection->response->header_block = NULL;
+    connection->response->body_fd = -1;
+
+    add_hdr(&(connection->response->hdrs), strdup("Access-Control-Allow-Origin"),
+            strdup("*"));
+    add_hdr(&(connection->response->hdrs), strdup("Access-Control-Allow-Methods"),
+            strdup("GET, CONNECT, OPTIONS"));
+    add_hdr(&(connection->response->hdrs), strdup("Access-Control-Allow-Headers"),
+            strdup("*"));
+    add_hdr(&(connection->response->hdrs), strdup("Access-Control-Max-Age"),
+            strdup("86400"));
+
+    connection->response->body_length = 0;
+    connection->response->time_fetched = time(NULL);
+    connection->response->initial_age = 0;
+    response_length = construct_response(connection->response,
+                                         connection->keep_alive, &response);
+    // display_response(connection->response);
+
+    // the response was made up for this client alone, nobody else has it
+    free_hdr(connection->response->hdrs);
+    free(connection->response->version);
+    free(connection->response);
+    connection->response = NULL;
+
+    last_read = relay_to(connection, response, response_length) < 0 ? -1 :
+                finish_request(connection);
+    free(response);
+
+    return last_read;
+}
+
+
+int begin_server(Connection *connection, ConnectionTable *connection_list) {
+    /* Starts connecting to the server the client's request is for. Returns
+     * <= 0 if that is already known to be impossible */
+
+    Connection *pooled;
+    int server, last_read, retried;
+
+    // a GET can reuse an idle keep-alive connection to the same origin
+    if (connection->request->method == GET &&
+            (server = checkout_server(&Upstream_Pool, connection->request->host,
+                                      connection->request->port)) >= 0) {
+        if (add_server_connection(server, connection->requesting_sockfd,
+                                  connection->request, connection_list) < 0) {
+            close(server);
+            return -1;
         }
-        if ((connection->response->version =
-                (char *) malloc(strlen(connection->request->version))) == NULL) {
-            error_out("Couldn't malloc!");
+        add_epoll(server);
+        pooled = search_connection(server, connection_list);
+        pooled->reused = 1;
+        if ((last_read = server_connected(pooled, connection)) > 0 ||
+                (retried = retry_server(pooled, connection_list)) == 0) {
+            return last_read;
         }
+        return retried;
+    }
+
+    return open_server(connection, connection_list);
+}
 
-        // setup response
-        memcpy(connection->response->version, connection->request->version,
-               strlen(connection->request->version));
-        connection->response->status_desc = "No Content";
-        connection->response->status = "204";
-        connection->response->hdrs = NULL;
 
-        add_hdr(&(connection->response->hdrs), "Connection", "Keep-Alive");
-        add_hdr(&(connection->response->hdrs), "Access-Control-Allow-Origin", "*");
-        add_hdr(&(connection->response->hdrs), "Access-Control-Allow-Methods", "GET, CONNECT, OPTIONS");
-        add_hdr(&(connection->response->hdrs), "Access-Control-Allow-Headers", "*");
-        add_hdr(&(connection->response->hdrs), "Access-Control-Max-Age", "86400");
+int open_server(Connection *connection, ConnectionTable *connection_list) {
+    /* Connects to the server the client's request is for on a connection of
+     * its own. Returns <= 0 if that is already known to be impossible */
 
-        connection->response->body_length = 0;
-        connection->response->time_fetched = time(NULL);
-        response_length = construct_response(connection->response, &response);
-        last_read = write_to_socket(sockfd, response, response_length);
-        // display_response(connection->response);
+    struct in_addr addr;
+
+    // repeat origins skip the lookup entirely
+    if (resolve_cached(connection->request->host, &addr)) {
+        return start_server(connection, &addr, connection_list);
     }
 
-    free_request(connection->request);
+    // otherwise a resolver thread looks it up, see handle_resolutions
+    connection->state = RESOLVING;
+    set_timeout(connection, 0);
+    resolve_async(connection->request->host, connection->requesting_sockfd,
+                  connection->serial, Resolver_Queue);
+
+    return 1;
+}
+
+
+int retry_server(Connection *server, ConnectionTable *connection_list) {
+    /* A connection from the pool can pass for alive when it is checked out
+     * and still turn out to have been closed by the server, which we only
+     * find out once the request is on it. A GET the server hasn't answered
+     * a byte of is safe to send again, so the client's request goes to the
+     * server once more on a fresh connection (never from the pool). Returns
+     * 1 if it is on its way, -1 if that failed too (the client is left to
+     * the caller), and 0 if the failure stands as it is */
+
+    Connection *client = search_connection(server->target_sockfd,
+                                           connection_list);
+
+    if (!server->reused || server->pending == NULL ||
+            server->response != NULL || server->read_len > 0 ||
+            client == NULL || client->request->method != GET) {
+        return 0;
+    }
+
+    // the client takes its request back, the old connection goes without
+    client->pending = server->pending;
+    client->pending_len = server->pending_len;
+    client->target_sockfd = -1;
+    server->pending = NULL;
+    server->target_sockfd = -1;
+    server->request = NULL;
+    remove_connection(server->requesting_sockfd, connection_list);
+
+    return open_server(client, connection_list) > 0 ? 1 : -1;
+}
+
+
+int start_server(Connection *connection, struct in_addr *addr,
+                 ConnectionTable *connection_list) {
+    /* Issues the non-blocking connect to the resolved server */
+
+    int server = add_server(connection->requesting_sockfd, addr,
+                            connection->request, connection_list);
+    if (server < 0) {
+        return -1;
+    }
+
+    // the connect is complete once the socket is writable
+    add_epoll(server);
+    watch_writable(server, 1);
+    set_timeout(connection, 0);
+    set_timeout(search_connection(server, connection_list), 0);
+
+    return 1;
+}
+
+
+void handle_resolutions(ConnectionTable *connection_list) {
+    /* Picks up the lookups the resolver threads finished for this worker */
+
+    Resolution *resolution, *next;
+    Connection *connection;
+
+    for (resolution = collect_resolutions(Resolver_Queue); resolution;
+            resolution = next) {
+        next = resolution->next;
+
+        // the client may have left (and its sockfd been reused) meanwhile
+        connection = search_connection(resolution->sockfd, connection_list);
+        if (connection != NULL && connection->serial == resolution->serial &&
+                connection->state == RESOLVING) {
+            if (!resolution->found) {
+                error_declare("Couldn't get host!");
+            } else if (start_server(connection, &(resolution->addr),
+                                    connection_list) <= 0) {
+                error_declare("Couldn't add server??\n");
+            } else {
+                connection = NULL;
+            }
+
+            // the server is out of reach, a stale copy may do instead
+            if (connection != NULL &&
+                    !serve_stale_on_error(connection, NULL, connection_list)) {
+                drop_connection(resolution->sockfd, connection_list);
+            }
+        }
+        free_resolution(resolution);
+    }
+}
+
+
+int handle_writable(int sockfd, ConnectionTable *connection_list) {
+    /* Handles a socket becoming writable: a connect to a server has finished
+     * or a client, a server or either end of a tunnel can take more of what
+     * is queued for it */
+
+    int error = 0, sent;
+    socklen_t error_len = sizeof(error);
+    Connection *connection = search_connection(sockfd, connection_list), *client;
+
+    if (connection == NULL) {
+        return -1;
+    }
+    if (connection->state == CONNECTED && connection->request->method == CONNECT) {
+        return tunnel_writable(connection, connection_list);
+    }
+    if (connection->state == SENDING ||
+            (!connection->is_server && has_unsent(connection))) {
+        return send_rest(connection, connection_list);
+    }
+
+    // the rest of a request the server didn't take all of straight away
+    if (connection->is_server && connection->state == CONNECTED) {
+        if ((sent = send_unsent(connection)) > 0) {
+            watch_writable(sockfd, 0);
+        }
+        return sent < 0 ? -1 : 1;
+    }
+    if (connection->state != CONNECTING) {
+        return 1;
+    }
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 ||
+            error != 0) {
+        error_declare("Couldn't connect to the server!");
+        return -1;
+    }
+    // a server fetching for nobody has no client (see background_fetch)
+    if ((client = search_connection(connection->target_sockfd, connection_list)) == NULL &&
+            connection->target_sockfd >= 0) {
+        return -1;
+    }
+    watch_writable(sockfd, 0);
+
+    return server_connected(connection, client);
+}
+
+
+int server_connected(Connection *server, Connection *client) {
+    /* The server connection is ready, start the conversation the client (if
+     * it has one) asked for */
+
+    Connection *holder = client != NULL ? client : server;
+    int last_read = 1;
+
+    server->state = CONNECTED;
+    if (client != NULL) {
+        client->state = CONNECTED;
+    }
+    if (client != NULL && client->request->method == CONNECT) {
+
+        // tell the client the tunnel is up, then pass on anything it sent
+        // while we were connecting. the rest is spliced (see relay_tunnel)
+        if (open_tunnel(client) < 0 || open_tunnel(server) < 0 ||
+                send_connect_established(client) < 0 ||
+                (client->read_len > 0 &&
+                 relay_to(server, client->raw, client->read_len) < 0)) {
+            return -1;
+        }
+        release_buffer(client);
+    } else {
+
+        // forward the request we held on to (a server fetching for nobody
+        // holds it itself), how long the server takes to answer it is part
+        // of what the response is worth keeping for
+        server->sent_at = monotonic_usec();
+        last_read = relay_to(server, holder->pending, holder->pending_len) < 0 ?
+                    -1 : 1;
+
+        // a connection from the pool may turn out to have been closed, the
+        // request is kept until the server answers so it can be sent again
+        if (server->reused && holder != server) {
+            server->pending = holder->pending;
+            server->pending_len = holder->pending_len;
+        } else {
+            free(holder->pending);
+        }
+        holder->pending = NULL;
+        holder->pending_len = 0;
+    }
+    set_timeout(server, 1);
+    set_timeout(client, 1);
 
     return last_read;
 }
 
 
-int handle_cache_request(int sockfd, int proxy, int last_read, Connection *connection,
-                         Connection **connection_list, int *max_fd, fd_set *master) {
+int handle_cache_request(int sockfd, int last_read, Connection *connection,
+                         ConnectionTable *connection_list) {
     /* Handles the different types of cache requests */
 
     int is_query = strstr(connection->request->url, QUERY) != NULL;
     int is_get = strstr(connection->request->url, GET_CACHE) != NULL;
-    int processed = 0;
 
     if (is_query) {
         // cache_query
-        last_read = handle_cache_query(sockfd, proxy, last_read, connection,
-                                       connection_list, max_fd, master);
+        last_read = handle_cache_query(sockfd, last_read, connection, connection_list);
     }
     if (is_get) {
         // cache get
-        last_read = handle_cache_get(sockfd, proxy, last_read, connection,
-                                     connection_list, max_fd, master);
+        last_read = handle_cache_get(sockfd, last_read, connection, connection_list);
     }
     if (!(is_query || is_get)) {
         // unsupported argument - drop requester
@@ -403,14 +1088,17 @@ int handle_cache_request(int sockfd, int proxy, int last_read, Connection *conne
 }
 
 
-int handle_cache_query(int sockfd, int proxy, int last_read, Connection *connection,
-                       Connection **connection_list, int *max_fd, fd_set *master) {
+int handle_cache_query(int sockfd, int last_read, Connection *connection,
+                       ConnectionTable *connection_list) {
     /* Handle query to the cache */
 
     CURL *curl = curl_easy_init();
     char *response = NULL, *query = NULL, *tmp_query_start = NULL,
          *tmp_query_end = NULL;
     int response_length = 0, query_length = 0, tmp_query_length = 0;
+
+    (void) sockfd;
+    (void) connection_list;
     if ((connection->response = (HTTPResponse *) malloc(sizeof(HTTPResponse)))
             == NULL) {
         error_out("Couldn't malloc!");
@@ -427,7 +1115,10 @@ int handle_cache_query(int sockfd, int proxy, int last_read, Connection *connect
     connection->response->status_desc = "OK";
     connection->response->status = "200";
     connection->response->time_fetched = time(NULL);
+    connection->response->initial_age = 0;
     connection->response->hdrs = NULL;
+    connection->response->header_block = NULL;
+    connection->response->body_fd = -1;
 
     // extract query
     if ((tmp_query_start = strstr(connection->request->url, QUERY))
@@ -459,7 +1150,9 @@ int handle_cache_query(int sockfd, int proxy, int last_read, Connection *connect
     
     // TODO:
     URLResults *results = NULL;
+    cache_lock();
     results = find_relevant_urls(query);
+    cache_unlock();
 
     if (results != NULL) {
 
@@ -476,23 +1169,29 @@ int handle_cache_query(int sockfd, int proxy, int last_read, Connection *connect
     add_hdr(&(connection->response->hdrs), "Access-Control-Allow-Origin", "*");
 
     // create and send response
-    response_length = construct_response(connection->response, &response);
+    response_length = construct_response(connection->response,
+                                         connection->keep_alive, &response);
     // display_response(connection->response);
-    last_read = write_to_socket(sockfd, response, response_length);
+    last_read = relay_to(connection, response, response_length) < 0 ? -1 :
+                finish_request(connection);
+    free(response);
 
     return last_read;
 }
 
 
-int handle_cache_get(int sockfd, int proxy, int last_read, Connection *connection,
-                     Connection **connection_list, int *max_fd, fd_set *master) {
+int handle_cache_get(int sockfd, int last_read, Connection *connection,
+                     ConnectionTable *connection_list) {
     /* Handle get to the cache from the search engine */
 
     CURL *curl = curl_easy_init();
-    char *response = NULL, *get = NULL, *tmp_get_start = NULL,
+    char *response = NULL, *get = NULL, *query = NULL, *tmp_get_start = NULL,
          *tmp_get_end = NULL;
     int response_length = 0, get_length = 0, tmp_get_length = 0;
 
+    (void) sockfd;
+    (void) connection_list;
+
     // extract query
     if ((tmp_get_start = strstr(connection->request->url, GET_CACHE))
             == NULL) {
@@ -516,90 +1215,999 @@ int handle_cache_get(int sockfd, int proxy, int last_read, Connection *connectio
     }
 
     // clean the query
-    get = curl_easy_unescape(curl, get, tmp_get_length, &get_length);
+    query = curl_easy_unescape(curl, get, tmp_get_length, &get_length);
     curl_easy_cleanup(curl);
-    get += strlen(GET_CACHE);  // remove leading "get_cache="
+    if (get != tmp_get_start) {
+        free(get);
+    }
+    get = query + strlen(GET_CACHE);  // remove leading "get_cache="
     
+    cache_lock();
     connection->response = get_data_from_cache(get);
+    curl_free(query);
+    if (connection->response == NULL) {
+        // evicted since the search results were served
+        cache_unlock();
+        return 0;
+    }
 
     // set appropriate headers
-    if (get_hdr_value(connection->response->hdrs, "Access-Control-Allow-Origin") == NULL) {
-        add_hdr(&(connection->response->hdrs), "Access-Control-Allow-Origin", "*");
+    if (find_hdr(connection->response->hdrs, "Access-Control-Allow-Origin") == NULL) {
+        // the response belongs to the cache, it frees whatever we add
+        add_hdr(&(connection->response->hdrs), strdup("Access-Control-Allow-Origin"),
+                strdup("*"));
+        drop_header_block(connection->response);
     }
 
     // create and send response
-    response_length = construct_response(connection->response, &response);
+    response_length = construct_response(connection->response,
+                                         connection->keep_alive, &response);
+    cache_unlock();
     // display_response(connection->response);
-    last_read = write_to_socket(sockfd, response, response_length);
+    last_read = relay_to(connection, response, response_length) < 0 ? -1 :
+                finish_request(connection);
+    free(response);
 
     return last_read;
 }
 
 
-int handle_get_response(int last_read, Connection *connection) {
+int handle_get_response(int last_read, Connection *connection,
+                        ConnectionTable *connection_list) {
     /* Handle the GET response */
 
-    write_to_socket(connection->target_sockfd,
-                    connection->raw, last_read);
+    Connection *client = search_connection(connection->target_sockfd,
+                                           connection_list);
+    int length, body_state;
+
     if (!connection->response) {
-        if (!header_not_completed(connection->raw, connection->read_len)) {
-            connection->response = parse_response(connection->read_len,
-                                                  connection->raw);
-            free(connection->raw);
-            connection->raw = NULL;
-            connection->read_len = 0;
+        if ((length = parse_header(connection->parser, connection->raw,
+                                   connection->read_len)) == PARSE_INCOMPLETE) {
+            return last_read;
+        }
+        if (length == PARSE_MALFORMED) {
+            error_declare("Malformed response!");
+            return -1;
+        }
+
+        // the server has answered, the request won't be sent again
+        free(connection->pending);
+        connection->pending = NULL;
+        connection->pending_len = 0;
+        connection->response = parsed_response(connection->parser,
+                                               connection->raw);
+        init_decoder(&(connection->decoder), connection->response);
+
+        // our stale copy is still good, the client never asked for a 304
+        if ((client != NULL ? client : connection)->revalidating &&
+                strcmp(connection->response->status, "304") == 0) {
+            return handle_not_modified(connection, connection_list);
+        }
+
+        // the server is in trouble, a stale copy may do instead
+        if (is_server_error(connection->response->status) &&
+                serve_stale_on_error(client, connection, connection_list)) {
+            return 1;
+        }
+
+        // too big to ever be cached, or not allowed to be: relay it without
+        // holding on to it
+        if ((connection->response->total_body_length >= 0 &&
+                    !fits_in_cache(connection->response->total_body_length)) ||
+                freshness_lifetime(connection->response) < 0) {
+            free_body(connection->response);
+        }
+
+        // relay the header and whatever of the body came with it, held back
+        // until now in case it was a 304 or an error
+        relay_to(client, connection->raw, connection->read_len);
+        relay_fetch(connection, connection->raw, connection->read_len,
+                    connection_list);
+
+        // the client has no other way to tell where such a body ends either
+        if (connection->decoder.framing == BY_CLOSE && client != NULL) {
+            client->keep_alive = 0;
         }
+        body_state = decode_body(&(connection->decoder), connection->response,
+                                 connection->raw + length,
+                                 connection->read_len - length);
+        connection->read_len = 0;  // the buffer is kept for the rest
     } else {
-        memcpy(connection->response->body + connection->response->body_length,
-                connection->raw, last_read);
-        connection->response->body_length += last_read;
-        free(connection->raw);
-        connection->raw = NULL;
+        relay_to(client, connection->raw, last_read);
+        relay_fetch(connection, connection->raw, last_read, connection_list);
+        body_state = decode_body(&(connection->decoder), connection->response,
+                                 connection->raw, last_read);
         connection->read_len = 0;
     }
 
-    if (connection->response->body_length == connection->response->total_body_length) {
-        // display_response(connection->response);
-        HTTPResponse *evicted_response = check_cache_capacity();
-        if (evicted_response != NULL) {
-            // An item was evicted - keywords need to be cleared out too
-            remove_keywords_from_keywords_table(evicted_response);
-        }
+    // one whose length we didn't know may turn out too big as it comes in
+    if (connection->response->body != NULL &&
+            !fits_in_cache(connection->response->body_length)) {
+        free_body(connection->response);
+    }
+
+    if (body_state == PARSE_MALFORMED) {
+        error_declare("Malformed chunked body!");
+        return -1;
+    }
+    if (body_state == BODY_COMPLETE) {
+        return finish_response(connection, connection_list);
+    }
 
-        CacheObject *cache_entry = add_data_to_cache(connection->request->url, connection->response);
-        // set the keywords
-        extract_keywords(&(connection->response), cache_entry);
+    // the server waits while a client can't keep up, see send_rest
+    if (fetch_backlog(connection, connection_list) > HIGH_WATERMARK) {
+        connection->paused = 1;
     }
 
     return last_read;
 }
 
 
-int handle_connect_response(int last_read, Connection *connection) {
-    /* Handle the CONNECT response */
+int finish_response(Connection *connection, ConnectionTable *connection_list) {
+    /* The server's response is all in. It is cached (if it may be) and the
+     * client, and whoever waits on the fetch, moves on */
 
-    last_read = write_to_socket(connection->target_sockfd, connection->raw,
-                                connection->read_len);
-    
-    if (last_read != connection->read_len) {
-        error_out("Last read did not match connection read len!");
-    }
+    // once cached the response is the cache's, so look at it first
+    HTTPResponse *response = connection->response;
+    Connection *waiter;
+    CacheObject *cache_entry = NULL;
+    KeywordList keywords;
+    Fetch *fetch = server_fetch(connection, connection_list);
+    int persistent = connection->decoder.framing != BY_CLOSE &&
+                     is_persistent(response->version, response->hdrs);
+    int last_read;
 
-    // clear out buffer
-    free(connection->raw);
-    connection->raw = NULL;
-    connection->read_len = 0;
+    // display_response(connection->response);
+    response->fetch_latency = monotonic_usec() - connection->sent_at;
+
+    // the keywords are picked before the lock is taken, as every worker
+    // waits on it, and only listed under it
+    keywords.count = 0;
+    if (response->body != NULL) {
+        extract_keywords(response->body, response->body_length, &keywords);
+    }
+    cache_lock();
+    if (response->body != NULL &&
+            (cache_entry = add_data_to_cache(connection->request->url,
+                                             response)) != NULL) {
+        // set the keywords (eviction made room, keywords included)
+        attach_keywords(cache_entry, &keywords);
+    }
+    cache_unlock();
+    clear_keywords(&keywords);
+    connection->response = NULL;
+
+    // those who shared a body that ended with the connection can't tell
+    // where it ended but by theirs closing too
+    if (connection->decoder.framing == BY_CLOSE && fetch != NULL) {
+        for (Waiter *w = fetch->waiters; w; w = w->next) {
+            waiter = search_connection(w->sockfd, connection_list);
+            if (waiter != NULL && waiter->serial == w->serial) {
+                waiter->keep_alive = 0;
+            }
+        }
+    }
+
+    // the conversation is over, the server may be good for another one
+    finish_fetch(fetch, connection_list);
+    last_read = release_server(connection, persistent, connection_list);
+    if (cache_entry == NULL) {
+        free_response(response);  // bypassed the cache, nobody else has it
+    }
 
     return last_read;
 }
 
 
-void add_select(int sockfd, int *max_fd, fd_set *master) {
-    /* Adds socket to the select functionality */
+int handle_not_modified(Connection *connection, ConnectionTable *connection_list) {
+    /* The server says our stale copy is still good. It is freshened in the
+     * cache and the client (and whoever waits on its fetch) is answered from
+     * there, the body never comes from the server again */
+
+    HTTPResponse *not_modified = connection->response, *response;
+    Connection *client = search_connection(connection->target_sockfd,
+                                           connection_list);
+    Fetch *fetch = server_fetch(connection, connection_list);
+    int persistent = is_persistent(not_modified->version, not_modified->hdrs);
+
+    release_buffer(connection);
+    connection->response = NULL;
+
+    cache_lock();
+    response = refresh_cache(connection->request->url, not_modified);
+    if (response != NULL && client != NULL) {
+        send_cached(client, response, NULL);
+    } else {
+        cache_unlock();
+    }
+    free_response(not_modified);
+    if (response == NULL) {
+        // evicted while we asked, a 304 is no answer for clients that
+        // didn't ask for one so they have to try again
+        return -1;
+    }
+
+    // the waiters are hits too, and may have asked for a 304 themselves
+    answer_waiters(fetch, STALE_NEVER, connection_list);
+
+    finish_fetch(fetch, connection_list);
+    return release_server(connection, persistent, connection_list);
+}
+
+
+int send_cached(Connection *client, HTTPResponse *response,
+                DiskObject *disk_object) {
+    /* Sends the client the cached response, just a 304 if it has the same
+     * copy already. The header block and a body in memory go out as they
+     * are in the cache with writev, a body in a file (a large one, or
+     * disk_object's) with sendfile. What the socket won't take right away
+     * is queued for when it is writable again (see send_rest), only the
+     * part in memory is copied so the cache can be let go of. The cache
+     * must be locked, it is unlocked here. Returns 1 if the response is
+     * sent or on its way, -1 if the client failed */
+
+    struct iovec iov[3];
+    char tail[RESPONSE_TAIL_SIZE], *raw = NULL;
+    int sockfd = client->requesting_sockfd, count, sent = 0, raw_len = 0;
+    int body_fd = -1, total = 0;
+    off_t body_offset = 0;
+    size_t body_left = 0;
+
+    if (not_modified_since(client->request->hdrs, response)) {
+        raw_len = construct_not_modified(response, client->keep_alive, &raw);
+        cache_unlock();
+        sent = relay_to(client, raw, raw_len);
+        free(raw);
+        return sent < 0 ? -1 : 1;
+    }
+
+    // a descriptor of our own, eviction may close the cache's
+    if (disk_object != NULL || response->body_fd >= 0) {
+        body_fd = disk_object != NULL ? open_disk_body(disk_object) :
+                                        dup(response->body_fd);
+        body_offset = disk_object != NULL ? disk_object->offset : 0;
+        body_left = disk_object != NULL ? disk_object->length :
+                                          (size_t) response->body_length;
+        if (body_fd < 0) {
+            cache_unlock();
+            error_declare("Couldn't open the body!");
+            return -1;
+        }
+    }
+
+    count = response_iovecs(response, client->keep_alive, tail, iov);
+    for (int i = 0; i < count; i++) {
+        total += iov[i].iov_len;
+    }
+    if (!has_unsent(client)) {
+        sent = writev_available(sockfd, iov, count);
+    }
+    if (sent >= 0 && sent < total) {
+        queue_unsent(client, iov, count, sent);
+    }
+    cache_unlock();
+    client->body_fd = body_fd;
+    client->body_offset = body_offset;
+    client->body_left = body_left;
+    if (sent < 0) {
+        return -1;
+    }
+
+    // the rest goes as the client takes it, its next request waits for that
+    if ((sent = send_unsent(client)) == 0) {
+        watch_writable(sockfd, 1);
+        set_timeout(client, 1);
+    }
+
+    return sent < 0 ? -1 : 1;
+}
+
+
+int relay_to(Connection *client, char *data, int length) {
+    /* Passes data on to the client behind whatever it has queued, queueing
+     * what its socket won't take now. Returns how much it has queued then,
+     * -1 if its socket failed. A fetch nobody waits on has no client, there
+     * is nothing to pass on then */
+
+    struct iovec iov;
+    int sent = 0;
+
+    if (client == NULL) {
+        return 0;
+    }
+
+    iov.iov_base = data;
+    iov.iov_len = length;
+    if (!has_unsent(client) &&
+            (sent = writev_available(client->requesting_sockfd, &iov, 1)) < 0) {
+        return -1;
+    }
+    if (sent < length) {
+        if (!has_unsent(client)) {
+            watch_writable(client->requesting_sockfd, 1);
+        }
+        queue_unsent(client, &iov, 1, sent);
+        set_timeout(client, 0);
+    }
+
+    return queued_bytes(client);
+}
+
+
+int send_and_close(Connection *client, char *data, int length) {
+    /* Sends the client a last response, its connection is closed once the
+     * response is all sent. Returns 0 if that is straight away */
+
+    client->keep_alive = 0;
+    if (relay_to(client, data, length) < 0) {
+        return -1;
+    }
+
+    return finish_request(client);
+}
+
+
+int fetch_backlog(Connection *server, ConnectionTable *connection_list) {
+    /* Returns the most that any of the clients the server's response goes
+     * to (its own and the fetch's waiters) has queued. The server is read
+     * from no faster than the slowest of them can take it */
+
+    Connection *client = search_connection(server->target_sockfd,
+                                           connection_list), *waiter;
+    Fetch *fetch = server_fetch(server, connection_list);
+    int backlog = client != NULL ? queued_bytes(client) : 0;
+
+    if (fetch != NULL) {
+        for (Waiter *w = fetch->waiters; w; w = w->next) {
+            waiter = search_connection(w->sockfd, connection_list);
+            if (waiter != NULL && waiter->serial == w->serial &&
+                    waiter->state == WAITING && queued_bytes(waiter) > backlog) {
+                backlog = queued_bytes(waiter);
+            }
+        }
+    }
+
+    return backlog;
+}
+
+
+int resume_server(Connection *server, ConnectionTable *connection_list) {
+    /* Reads on from a server that was held back for its clients, once none
+     * of them has more than LOW_WATERMARK queued. Returns 1 if it did */
+
+    if (server == NULL || !server->paused ||
+            fetch_backlog(server, connection_list) >= LOW_WATERMARK) {
+        return 0;
+    }
+    server->paused = 0;
+    if (handle_client(server->requesting_sockfd, connection_list) <= 0) {
+        drop_connection(server->requesting_sockfd, connection_list);
+    } else {
+        set_timeout(search_connection(server->requesting_sockfd, connection_list), 1);
+    }
+
+    return 1;
+}
+
+
+Connection *relaying_server(Connection *client, ConnectionTable *connection_list) {
+    /* Returns the server whose response is being relayed to the client, its
+     * own or that of the fetch it waits on, if there is one */
+
+    Connection *leader = client, *server;
+    Fetch *fetch;
+
+    if (client->state == WAITING) {
+        fetch = find_fetch(&Fetches, client->request->url);
+        leader = fetch != NULL ? search_connection(fetch->sockfd, connection_list) :
+                                 NULL;
+    }
+    if (leader != NULL && leader->is_server) {
+        return leader;  // it fetches for nobody but the waiters
+    }
+    if (leader == NULL || leader->state != CONNECTED || leader->target_sockfd < 0) {
+        return NULL;
+    }
+    server = search_connection(leader->target_sockfd, connection_list);
+
+    return server != NULL && server->is_server ? server : NULL;
+}
+
+
+int send_rest(Connection *client, ConnectionTable *connection_list) {
+    /* The client can take more of what is queued for it. A server held back
+     * for it goes on once it has caught up, and once it has all of its
+     * response it moves on to its next request (if it has one) */
+
+    int sockfd = client->requesting_sockfd;
+    unsigned long serial = client->serial;
+    Connection *server;
+
+    if (send_unsent(client) < 0) {
+        return -1;
+    }
+
+    // reading from the server may finish the response, or fail and take the
+    // client with it
+    if (queued_bytes(client) < LOW_WATERMARK &&
+            (server = relaying_server(client, connection_list)) != NULL &&
+            resume_server(server, connection_list) &&
+            ((client = search_connection(sockfd, connection_list)) == NULL ||
+             client->serial != serial)) {
+        return 1;
+    }
+
+    if (has_unsent(client)) {
+        return 1;
+    }
+    watch_writable(sockfd, 0);
+    if (client->state != SENDING) {
+        return 1;
+    }
+    client->state = IDLE;
+    if (finish_request(client) <= 0) {
+        return 0;
+    }
+
+    return process_requests(client, connection_list);
+}
+
+
+int answer_from_cache(Connection *client, int stale) {
+    /* Answers the client from the cache: its fresh copy, or a stale one that
+     * may be served for the given reason (see get_stale_from_cache). Returns
+     * 0 if there was nothing to answer with */
+
+    HTTPResponse *response;
+
+    cache_lock();
+    if ((response = get_data_from_cache(client->request->url)) == NULL) {
+        response = get_stale_from_cache(client->request->url, stale);
+    }
+    if (response == NULL) {
+        cache_unlock();
+        return 0;
+    }
+
+    return send_cached(client, response, NULL);
+}
+
+
+void answer_waiters(Fetch *fetch, int stale, ConnectionTable *connection_list) {
+    /* Answers everyone waiting on the fetch from the cache rather than with
+     * what the server sends, those there is nothing for are dropped */
+
+    Connection *waiter;
+
+    if (fetch == NULL) {
+        return;
+    }
+    for (Waiter *w = fetch->waiters; w; w = w->next) {
+        waiter = search_connection(w->sockfd, connection_list);
+        if (waiter != NULL && waiter->serial == w->serial &&
+                waiter->state == WAITING && answer_from_cache(waiter, stale) == 0) {
+            drop_connection(w->sockfd, connection_list);
+        }
+    }
+}
+
+
+int serve_stale_on_error(Connection *client, Connection *server,
+                         ConnectionTable *connection_list) {
+    /* The client's server couldn't be reached, or failed us before anything
+     * was passed on. If the server allows it (stale-if-error) the client and
+     * whoever waits on its fetch get the stale copy instead. Returns 1 if so,
+     * the connections are taken care of then */
+
+    if (client == NULL || client->is_server || client->request == NULL ||
+            client->request->method != GET ||
+            answer_from_cache(client, STALE_IF_ERROR) == 0) {
+        return 0;
+    }
+    answer_waiters(leader_fetch(client), STALE_IF_ERROR, connection_list);
+    finish_fetch(leader_fetch(client), connection_list);
+    free(client->pending);
+    client->pending = NULL;
+    client->pending_len = 0;
+
+    // whatever the server had to say doesn't matter any more
+    if (server != NULL) {
+        if (server->response != NULL) {
+            free_response(server->response);
+            server->response = NULL;
+        }
+        return release_server(server, 0, connection_list);
+    }
+    if (finish_request(client) <= 0 ||
+            process_requests(client, connection_list) <= 0) {
+        drop_connection(client->requesting_sockfd, connection_list);
+    }
+
+    return 1;
+}
+
+
+void background_fetch(char *pending, int pending_len, int revalidating,
+                      ConnectionTable *connection_list) {
+    /* Starts a fetch to refresh a stale copy of a response that is served in
+     * the meantime (stale-while-revalidate). pending is the request for it,
+     * built (conditional if it can be) while the cache was locked, and is
+     * the fetch's from now on. No client asked for it, so its server has
+     * none: the server holds the request itself, and its response is only
+     * cached (and passed on to whoever waits on the fetch). A host that
+     * would have to be looked up first is only looked up, whoever asks for
+     * it next has it refreshed. The cache mustn't be locked, connecting to
+     * the server is no reason for every worker to wait */
+
+    HTTPRequest *own = parse_request(pending_len, pending);
+    Connection *server;
+    struct in_addr addr;
+    int sockfd, connected = 0;
+
+    if ((sockfd = checkout_server(&Upstream_Pool, own->host, own->port)) >= 0) {
+        connected = 1;
+    } else if (!resolve_cached(own->host, &addr)) {
+        resolve_async(own->host, -1, 0, Resolver_Queue);
+        free(pending);
+        free_request(own);
+        return;
+    }
+
+    if (!connected) {
+        sockfd = add_server(-1, &addr, own, connection_list);
+    } else if (add_server_connection(sockfd, -1, own, connection_list) < 0) {
+        close(sockfd);
+        sockfd = -1;
+    }
+    if (sockfd < 0) {
+        free(pending);
+        free_request(own);
+        return;
+    }
+    server = search_connection(sockfd, connection_list);
+    server->pending = pending;
+    server->pending_len = pending_len;
+    server->revalidating = revalidating;
+    start_fetch(&Fetches, own->url, sockfd, server->serial);
+
+    add_epoll(sockfd);
+    if (!connected) {
+        // the connect is complete once the socket is writable
+        watch_writable(sockfd, 1);
+        set_timeout(server, 0);
+    } else if (server_connected(server, NULL) <= 0) {
+        drop_connection(sockfd, connection_list);
+    }
+}
+
+
+int release_server(Connection *connection, int persistent,
+                   ConnectionTable *connection_list) {
+    /* The server's response is complete. If the server keeps the connection
+     * open it goes back to the pool for the next miss to the same origin,
+     * and the client moves on to its next request (if it has one) */
+
+    int server = connection->requesting_sockfd;
+    HTTPRequest *request = connection->request;
+    Connection *client = search_connection(connection->target_sockfd,
+                                           connection_list);
+
+    // the two go their separate ways (the client owns the request)
+    connection->target_sockfd = -1;
+    connection->request = NULL;
+    if (client != NULL) {
+        client->target_sockfd = -1;
+    }
+
+    if (persistent) {
+
+        // idle servers are off epoll and out of our connection list until
+        // they are checked out again
+        epoll_ctl(Epoll_FD, EPOLL_CTL_DEL, server, NULL);
+        detach_connection(server, connection_list);
+        checkin_server(&Upstream_Pool, request->host, request->port, server);
+    } else {
+        drop_connection(server, connection_list);
+    }
+
+    // a server fetching for nobody owned its request
+    if (client == NULL) {
+        free_request(request);
+        return 1;
+    }
+    if (finish_request(client) <= 0 ||
+            process_requests(client, connection_list) <= 0) {
+        drop_connection(client->requesting_sockfd, connection_list);
+    }
+
+    return 1;
+}
+
+
+int join_fetch(Fetch *fetch, Connection *connection) {
+    /* Attaches the client to a fetch in flight and catches it up on what has
+     * been relayed so far, the rest is streamed to it (see relay_fetch) */
+
+    connection->state = WAITING;
+    add_waiter(fetch, connection->requesting_sockfd, connection->serial);
+    if (fetch->relayed_len > 0 &&
+            relay_to(connection, fetch->relayed, fetch->relayed_len) < 0) {
+        return -1;
+    }
+
+    return 1;
+}
+
+
+Fetch *leader_fetch(Connection *client) {
+    /* Returns the fetch the client started, if it is still in flight */
+
+    Fetch *fetch;
+
+    if (client == NULL || client->request == NULL || client->is_server ||
+            (fetch = find_fetch(&Fetches, client->request->url)) == NULL ||
+            fetch->sockfd != client->requesting_sockfd ||
+            fetch->serial != client->serial) {
+        return NULL;
+    }
+
+    return fetch;
+}
+
+
+Fetch *server_fetch(Connection *server, ConnectionTable *connection_list) {
+    /* Returns the fetch the server's response is for: its client's, or its
+     * own if it fetches for nobody (see background_fetch) */
+
+    Connection *client = search_connection(server->target_sockfd,
+                                           connection_list);
+    Fetch *fetch;
+
+    if (client != NULL) {
+        return leader_fetch(client);
+    }
+    if (server->target_sockfd >= 0 || server->request == NULL ||
+            (fetch = find_fetch(&Fetches, server->request->url)) == NULL ||
+            fetch->sockfd != server->requesting_sockfd ||
+            fetch->serial != server->serial) {
+        return NULL;
+    }
+
+    return fetch;
+}
+
+
+void relay_fetch(Connection *server, char *data, int length,
+                 ConnectionTable *connection_list) {
+    /* Passes bytes from the server on to the clients waiting on the fetch */
+
+    Fetch *fetch = server_fetch(server, connection_list);
+    Connection *waiter;
+
+    if (fetch == NULL) {
+        return;
+    }
+
+    // a response that won't be cached isn't kept for latecomers either
+    if (server->response->body == NULL) {
+        close_fetch(fetch);
+    } else {
+        record_fetch(fetch, data, length);
+    }
+    for (Waiter *w = fetch->waiters; w; w = w->next) {
+
+        // waiters that left (and their sockfd been reused) are skipped
+        waiter = search_connection(w->sockfd, connection_list);
+        if (waiter != NULL && waiter->serial == w->serial &&
+                waiter->state == WAITING) {
+            relay_to(waiter, data, length);
+            set_timeout(waiter, 1);
+        }
+    }
+}
+
+
+void finish_fetch(Fetch *fetch, ConnectionTable *connection_list) {
+    /* The fetch is complete, so is every waiter's response. They move on to
+     * their next request (if they have one) */
+
+    Waiter *waiters, *next;
+    Connection *waiter;
+
+    if (fetch == NULL) {
+        return;
+    }
+
+    // out of the table first, a waiter's next request may be the same URL
+    waiters = end_fetch(&Fetches, fetch);
+    for (; waiters; waiters = next) {
+        next = waiters->next;
+        waiter = search_connection(waiters->sockfd, connection_list);
+        if (waiter != NULL && waiter->serial == waiters->serial &&
+                waiter->state == WAITING &&
+                (finish_request(waiter) <= 0 ||
+                 process_requests(waiter, connection_list) <= 0)) {
+            drop_connection(waiters->sockfd, connection_list);
+        }
+        free(waiters);
+    }
+}
+
+
+Connection *hand_over_fetch(Connection *leader, ConnectionTable *connection_list) {
+    /* The client that started a fetch is leaving before it is done. The
+     * longest waiting client still around takes its place, it has been sent
+     * the same so far, and the fetch goes on for it with the same server.
+     * Returns that client, or NULL if nobody is left waiting (or there is no
+     * server yet, one that couldn't be reached fails them all) */
+
+    Fetch *fetch = leader_fetch(leader);
+    Connection *heir = NULL;
+    Connection *server = search_connection(leader->target_sockfd, connection_list);
+    Waiter *waiter;
+
+    if (fetch == NULL || server == NULL || !server->is_server) {
+        return NULL;
+    }
+    while (heir == NULL && (waiter = take_waiter(fetch)) != NULL) {
+        heir = search_connection(waiter->sockfd, connection_list);
+        if (heir != NULL && (heir->serial != waiter->serial ||
+                             heir->state != WAITING)) {
+            heir = NULL;
+        }
+        free(waiter);
+    }
+    if (heir == NULL) {
+        return NULL;
+    }
+
+    // the heir is where the leader was, with its server and request
+    fetch->sockfd = heir->requesting_sockfd;
+    fetch->serial = heir->serial;
+    heir->state = leader->state;
+    heir->revalidating = leader->revalidating;
+    heir->target_sockfd = leader->target_sockfd;
+    heir->pending = leader->pending;
+    heir->pending_len = leader->pending_len;
+    leader->target_sockfd = -1;
+    leader->pending = NULL;
+    leader->pending_len = 0;
+    server->target_sockfd = heir->requesting_sockfd;
+    server->request = heir->request;
+    if (server->response != NULL && server->decoder.framing == BY_CLOSE) {
+        heir->keep_alive = 0;
+    }
+    set_timeout(heir, 0);
+
+    return heir;
+}
+
+
+void drop_connection(int sockfd, ConnectionTable *connection_list) {
+    /* Removes the connection (and its target). A client that was fetching a
+     * URL for others hands the fetch over to one of them. If its server
+     * fails they will never get the rest of it, so they are removed too */
+
+    Connection *connection = search_connection(sockfd, connection_list);
+    Connection *waiter, *heir;
+    Fetch *fetch = NULL;
+    Waiter *waiters, *next;
+
+    if (connection != NULL && !connection->is_server &&
+            (heir = hand_over_fetch(connection, connection_list)) != NULL) {
+        remove_connection(sockfd, connection_list);
+
+        // the server may have been held back for the client that left
+        resume_server(search_connection(heir->target_sockfd, connection_list),
+                      connection_list);
+        return;
+    }
+    if (connection != NULL) {
+        fetch = connection->is_server ? server_fetch(connection, connection_list) :
+                                        leader_fetch(connection);
+    }
+    if (fetch != NULL) {
+        for (waiters = end_fetch(&Fetches, fetch); waiters; waiters = next) {
+            next = waiters->next;
+            waiter = search_connection(waiters->sockfd, connection_list);
+            if (waiter != NULL && waiter->serial == waiters->serial &&
+                    waiter->state == WAITING) {
+                remove_connection(waiters->sockfd, connection_list);
+            }
+            free(waiters);
+        }
+    }
+
+    remove_connection(sockfd, connection_list);
+}
+
+
+int relay_tunnel(Connection *connection, ConnectionTable *connection_list) {
+    /* Passes on what the connection's end of a tunnel has sent to the other
+     * end. Either end may be done sending before the other, the tunnel is
+     * closed once both are. Returns 0 then */
+
+    Connection *target = search_connection(connection->target_sockfd,
+                                           connection_list);
+    int moved;
+
+    if (target == NULL) {
+        return -1;
+    }
+
+    // the other end takes what is queued for it first (our 200, or whatever
+    // the client sent while we were connecting), see tunnel_writable
+    if (has_unsent(target)) {
+        return 1;
+    }
+
+    // bytes going either way keep both ends alive
+    moved = splice_tunnel(connection, target->requesting_sockfd);
+    set_timeout(connection, 1);
+    set_timeout(target, 1);
+    if (moved == WOULD_BLOCK) {
+        watch_writable(target->requesting_sockfd, 1);
+        return 1;
+    }
+    if (moved != 0) {
+        return moved;
+    }
+
+    // pass the half-close on, the other end may still have more to say
+    if (!connection->read_closed) {
+        connection->read_closed = 1;
+        shutdown(target->requesting_sockfd, SHUT_WR);
+    }
+
+    return target->read_closed ? 0 : 1;
+}
+
+
+int tunnel_writable(Connection *connection, ConnectionTable *connection_list) {
+    /* The connection's end of a tunnel can take more, of what was queued for
+     * it and then of what the other end has sent */
+
+    Connection *source;
+
+    if (send_unsent(connection) < 0) {
+        return -1;
+    }
+    if (has_unsent(connection)) {
+        return 1;
+    }
+    watch_writable(connection->requesting_sockfd, 0);
+    if ((source = search_connection(connection->target_sockfd,
+                                    connection_list)) == NULL) {
+        return -1;
+    }
+
+    return relay_tunnel(source, connection_list);
+}
+
+
+void add_epoll(int sockfd) {
+    /* Adds socket to the epoll interest list (edge-triggered reads) */
+
+    struct epoll_event event;
+
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    event.data.fd = sockfd;
+    if (epoll_ctl(Epoll_FD, EPOLL_CTL_ADD, sockfd, &event) < 0) {
+        error_declare("Couldn't add socket to epoll!");
+    }
+}
+
+
+void handle_timeout() {
+    /* Periodic housekeeping, runs at most once every TIMEOUT_INTERVAL */
+
+    static __thread time_t last_run = 0;
+    time_t now = time(NULL);
+
+    if (now - last_run < TIMEOUT_INTERVAL) {
+        return;
+    }
+    last_run = now;
+
+    sweep_idle_servers(&Upstream_Pool);
+    cache_lock();
+    sweep_expired_cache();
+    cache_unlock();
+}
+
+
+TimeoutKind timeout_for(Connection *connection) {
+    /* Returns the deadline the connection is held to where it is now. Where
+     * it waits on another connection the other one's deadline holds instead:
+     * a client waiting on its server, a server held back for its clients */
+
+    if (connection->state == CONNECTED && connection->request != NULL &&
+            connection->request->method == CONNECT) {
+        return IDLE_TIMEOUT;
+    }
+    if (connection->is_server) {
+        if (connection->state == CONNECTING) {
+            return CONNECT_TIMEOUT;
+        }
+        if (connection->paused) {
+            return NO_TIMEOUT;
+        }
+        return connection->response == NULL && connection->read_len == 0 ?
+               FIRST_BYTE_TIMEOUT : IDLE_TIMEOUT;
+    }
+
+    // a client has to take what is queued for it in time
+    if (has_unsent(connection)) {
+        return IDLE_TIMEOUT;
+    }
+    if (connection->state == IDLE) {
+        return connection->read_len > 0 ? HEADER_TIMEOUT : IDLE_TIMEOUT;
+    }
+
+    // one sharing a fetch only waits for as long as the fetch moves
+    if (connection->state == WAITING) {
+        return WAIT_TIMEOUT;
+    }
+
+    return connection->state == RESOLVING ? CONNECT_TIMEOUT : NO_TIMEOUT;
+}
+
+
+void set_timeout(Connection *connection, int active) {
+    /* Holds the connection to the deadline for where it is now. If that is
+     * the one it was held to already, the deadline stands, unless it is for
+     * being idle (or waiting on a fetch) and something just happened on the
+     * connection (active) */
+
+    TimeoutKind kind;
+
+    if (connection == NULL) {
+        return;
+    }
+    kind = timeout_for(connection);
+    if (kind == connection->timeout && timer_armed(&(connection->timer)) &&
+            !(active && (kind == IDLE_TIMEOUT || kind == WAIT_TIMEOUT))) {
+        return;
+    }
+    connection->timeout = kind;
+    if (Timeout_Seconds[kind] <= 0) {
+        cancel_timer(&(connection->timer));
+    } else {
+        arm_timer(Timers, &(connection->timer), Timeout_Seconds[kind] * 1000L);
+    }
+}
+
+
+void handle_expired(ConnectionTable *connection_list) {
+    /* Closes the connections whose deadline has passed. A client that was
+     * too slow with its request is told so first, a server that was too
+     * slow to connect or answer fails like any other */
+
+    Timer *timer;
+    Connection *connection;
+
+    advance_timers(Timers);
+    while ((timer = next_expired(Timers)) != NULL) {
+        connection = (Connection *) ((char *) timer - offsetof(Connection, timer));
+        connection->reused = 0;  // a server that is only slow isn't retried
+        if (connection->timeout != HEADER_TIMEOUT ||
+                send_and_close(connection, REQUEST_TIMEOUT,
+                               strlen(REQUEST_TIMEOUT)) <= 0) {
+            close_connection(connection->requesting_sockfd, connection_list);
+        }
+    }
+}
+
+
+void watch_writable(int sockfd, int on) {
+    /* Turns edge-triggered writability notifications for sockfd on or off */
+
+    struct epoll_event event;
 
-    FD_SET(sockfd, master);
-    if (*max_fd < sockfd) {
-        *max_fd = sockfd;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (on ? EPOLLOUT : 0);
+    event.data.fd = sockfd;
+    if (epoll_ctl(Epoll_FD, EPOLL_CTL_MOD, sockfd, &event) < 0) {
+        error_declare("Couldn't modify socket in epoll!");
     }
 }
 
@@ -0,0 +1,226 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Asynchronous hostname resolution so that     *
+ *                               a slow DNS lookup never stalls an event      *
+ *                               loop, plus a TTL-bounded DNS cache           *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Interface
+//
+#include "resolver.h"
+
+
+//
+// Globals
+//
+DNSEntry *dns_cache = NULL;    /* IMPORTANT: initialize this to NULL
+                                *            - UTHash requirement */
+pthread_mutex_t dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+int dns_ttl = DEFAULT_DNS_TTL;
+
+// lookups waiting for a resolver thread (FIFO)
+Resolution *jobs_head = NULL, *jobs_tail = NULL;
+pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+
+//
+// Forward Declarations
+//
+void *run_resolver(void *arg);
+void cache_resolution(char *host, struct in_addr *addr);
+
+
+//
+// Implementation
+//
+void init_resolver(int threads, int ttl) {
+    /* Starts the resolver threads. Lookups go through getaddrinfo(), so they
+     * honour /etc/hosts and whatever resolver nsswitch points at */
+
+    pthread_t thread;
+
+    dns_ttl = ttl;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&thread, NULL, run_resolver, NULL) != 0) {
+            error_out("Couldn't start resolver!");
+        }
+        pthread_detach(thread);
+    }
+}
+
+
+ResolverQueue *create_resolver_queue() {
+    /* Creates the queue a worker collects its finished lookups from */
+
+    ResolverQueue *queue;
+
+    if ((queue = (ResolverQueue *) malloc(sizeof(ResolverQueue))) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    if ((queue->eventfd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        error_out("Couldn't create resolver eventfd!");
+    }
+    pthread_mutex_init(&(queue->lock), NULL);
+    queue->done = NULL;
+
+    return queue;
+}
+
+
+int resolve_cached(char *host, struct in_addr *addr) {
+    /* Returns 1 and fills in addr if the host can be resolved without a
+     * lookup (dotted quad or fresh cache entry), 0 otherwise */
+
+    DNSEntry *entry;
+    int found = 0;
+
+    if (inet_aton(host, addr)) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&dns_mutex);
+    HASH_FIND_STR(dns_cache, host, entry);
+    if (entry != NULL) {
+        if (entry->expires > time(NULL)) {
+            *addr = entry->addr;
+            found = 1;
+        } else {
+            HASH_DEL(dns_cache, entry);
+            free(entry->host);
+            free(entry);
+        }
+    }
+    pthread_mutex_unlock(&dns_mutex);
+
+    return found;
+}
+
+
+void resolve_async(char *host, int sockfd, unsigned long serial,
+                   ResolverQueue *queue) {
+    /* Hands the lookup to a resolver thread, the answer shows up on queue */
+
+    Resolution *job;
+
+    if ((job = (Resolution *) malloc(sizeof(Resolution))) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    if ((job->host = strdup(host)) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    job->sockfd = sockfd;
+    job->serial = serial;
+    job->found = 0;
+    job->queue = queue;
+    job->next = NULL;
+
+    pthread_mutex_lock(&jobs_mutex);
+    if (jobs_tail != NULL) {
+        jobs_tail->next = job;
+    } else {
+        jobs_head = job;
+    }
+    jobs_tail = job;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_mutex);
+}
+
+
+Resolution *collect_resolutions(ResolverQueue *queue) {
+    /* Takes every finished lookup off the queue */
+
+    Resolution *done;
+    uint64_t count;
+
+    // reset the eventfd so edge-triggered epoll tells us about the next one
+    while (read(queue->eventfd, &count, sizeof(count)) > 0);
+
+    pthread_mutex_lock(&(queue->lock));
+    done = queue->done;
+    queue->done = NULL;
+    pthread_mutex_unlock(&(queue->lock));
+
+    return done;
+}
+
+
+void free_resolution(Resolution *resolution) {
+    /* Frees the Resolution structure */
+
+    if (resolution) {
+        free(resolution->host);
+        free(resolution);
+    }
+}
+
+
+void *run_resolver(void *arg) {
+    /* Resolver thread: blocks in getaddrinfo() so the event loops don't */
+
+    Resolution *job;
+    struct addrinfo hints, *result;
+    uint64_t one = 1;
+
+    (void) arg;
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    while (1) {
+        pthread_mutex_lock(&jobs_mutex);
+        while (jobs_head == NULL) {
+            pthread_cond_wait(&jobs_cond, &jobs_mutex);
+        }
+        job = jobs_head;
+        if ((jobs_head = job->next) == NULL) {
+            jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&jobs_mutex);
+
+        // someone else may have resolved it while this job was queued
+        if (!(job->found = resolve_cached(job->host, &(job->addr)))) {
+            if (getaddrinfo(job->host, NULL, &hints, &result) == 0) {
+                job->addr = ((struct sockaddr_in *) result->ai_addr)->sin_addr;
+                job->found = 1;
+                freeaddrinfo(result);
+                cache_resolution(job->host, &(job->addr));
+            }
+        }
+
+        // deliver to the worker that asked
+        pthread_mutex_lock(&(job->queue->lock));
+        job->next = job->queue->done;
+        job->queue->done = job;
+        pthread_mutex_unlock(&(job->queue->lock));
+        if (write(job->queue->eventfd, &one, sizeof(one)) < 0) {
+            error_declare("Couldn't signal resolver eventfd!");
+        }
+    }
+
+    return NULL;
+}
+
+
+void cache_resolution(char *host, struct in_addr *addr) {
+    /* Adds or refreshes the cached answer for host */
+
+    DNSEntry *entry;
+
+    pthread_mutex_lock(&dns_mutex);
+    HASH_FIND_STR(dns_cache, host, entry);
+    if (entry == NULL) {
+        if ((entry = (DNSEntry *) malloc(sizeof(DNSEntry))) == NULL ||
+                (entry->host = strdup(host)) == NULL) {
+            error_out("Couldn't malloc!");
+        }
+        HASH_ADD_KEYPTR(hh, dns_cache, entry->host, strlen(entry->host), entry);
+    }
+    entry->addr = *addr;
+    entry->expires = time(NULL) + dns_ttl;
+    pthread_mutex_unlock(&dns_mutex);
+}
@@ -0,0 +1,69 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Header for the asynchronous hostname         *
+ *                               resolver and its DNS cache                   *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include "ap_utilities.h"
+
+#define DEFAULT_RESOLVER_THREADS 4
+#define DEFAULT_DNS_TTL 60
+
+
+//
+// Data Structures
+//
+typedef struct DNSEntry {
+    /* A cached answer, keyed by hostname */
+    char *host; // key
+    struct in_addr addr;
+    time_t expires;
+    UT_hash_handle hh;
+} DNSEntry;
+
+typedef struct Resolution {
+    /* A lookup on its way to a resolver thread and back to its worker */
+    char *host;
+    int sockfd;                    // the client that asked for it
+    unsigned long serial;          // ...and which client on that sockfd it was
+    int found;
+    struct in_addr addr;
+    struct ResolverQueue *queue;   // where the answer is delivered
+    struct Resolution *next;
+} Resolution;
+
+typedef struct ResolverQueue {
+    /* Finished lookups waiting for their worker, the eventfd is polled by the
+     * worker's event loop */
+    int eventfd;
+    pthread_mutex_t lock;
+    Resolution *done;
+} ResolverQueue;
+
+
+//
+// Forward Declarations
+//
+void init_resolver(int threads, int ttl);
+ResolverQueue *create_resolver_queue();
+int resolve_cached(char *host, struct in_addr *addr);
+void resolve_async(char *host, int sockfd, unsigned long serial,
+                   ResolverQueue *queue);
+Resolution *collect_resolutions(ResolverQueue *queue);
+void free_resolution(Resolution *resolution);
+
+
+#endif /* RESOLVER_H */
@@ -0,0 +1,160 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Finds delimiters (line ends, colons) in      *
+ *                               headers 16 or 32 bytes at a time where the   *
+ *                               CPU can, one at a time where it can't        *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Interface
+//
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+
+//
+// Forward Declarations
+//
+char *scan_scalar(char *raw, size_t length, char first, char second);
+#ifdef SCAN_X86
+char *scan_sse42(char *raw, size_t length, char first, char second);
+char *scan_avx2(char *raw, size_t length, char first, char second);
+#endif
+
+
+//
+// Globals
+//
+ScanKernel scan_for = scan_scalar;
+const char *scan_kernel = SCAN_SCALAR;
+
+
+//
+// Implementation
+//
+void init_scan() {
+    /* Picks the widest kernel the CPU supports. Until this is called (the
+     * client never does) scanning is scalar */
+
+    if (set_scan_kernel(SCAN_AVX2) < 0) {
+        set_scan_kernel(SCAN_SSE42);
+    }
+}
+
+
+int set_scan_kernel(const char *name) {
+    /* Makes scan_for use the kernel with the name. Returns -1 if there is no
+     * such kernel or the CPU doesn't support it */
+
+    if (strcmp(name, SCAN_SCALAR) == 0) {
+        scan_for = scan_scalar;
+        scan_kernel = SCAN_SCALAR;
+        return 0;
+    }
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (strcmp(name, SCAN_SSE42) == 0 && __builtin_cpu_supports("sse4.2")) {
+        scan_for = scan_sse42;
+        scan_kernel = SCAN_SSE42;
+        return 0;
+    }
+    if (strcmp(name, SCAN_AVX2) == 0 && __builtin_cpu_supports("avx2")) {
+        scan_for = scan_avx2;
+        scan_kernel = SCAN_AVX2;
+        return 0;
+    }
+#endif
+
+    return -1;
+}
+
+
+const char *scan_kernel_name() {
+    /* Returns the name of the kernel scan_for uses */
+
+    return scan_kernel;
+}
+
+
+char *scan_scalar(char *raw, size_t length, char first, char second) {
+    /* One byte at a time, for CPUs without the wider kernels and for the
+     * tails they leave */
+
+    for (char *end = raw + length; raw < end; raw++) {
+        if (*raw == first || *raw == second) {
+            return raw;
+        }
+    }
+
+    return NULL;
+}
+
+
+#ifdef SCAN_X86
+__attribute__((target("sse4.2")))
+char *scan_sse42(char *raw, size_t length, char first, char second) {
+    /* 16 bytes at a time: PCMPESTRI compares each of them against both
+     * bytes we are looking for and gives us where the first match is */
+
+    __m128i wanted = _mm_setr_epi8(first, second, 0, 0, 0, 0, 0, 0,
+                                   0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i block;
+    size_t i = 0;
+    int index;
+
+    for (; i + 16 <= length; i += 16) {
+        block = _mm_loadu_si128((const __m128i *) (raw + i));
+        index = _mm_cmpestri(wanted, 2, block, 16, _SIDD_UBYTE_OPS |
+                             _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (index < 16) {
+            return raw + i + index;
+        }
+    }
+
+    return scan_scalar(raw + i, length - i, first, second);
+}
+
+
+__attribute__((target("avx2")))
+char *scan_avx2(char *raw, size_t length, char first, char second) {
+    /* 32 bytes at a time: compare against each byte we are looking for,
+     * and the lowest bit set in the mask of matches is the first one */
+
+    __m256i wanted_first = _mm256_set1_epi8(first);
+    __m256i wanted_second = _mm256_set1_epi8(second);
+    __m256i block;
+    size_t i = 0;
+    unsigned int matches;
+
+    for (; i + 32 <= length; i += 32) {
+        block = _mm256_loadu_si256((const __m256i *) (raw + i));
+        matches = _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, wanted_first),
+                            _mm256_cmpeq_epi8(block, wanted_second)));
+        if (matches != 0) {
+            return raw + i + __builtin_ctz(matches);
+        }
+    }
+
+    // lines are short, so there is often a half block left over
+    if (i + 16 <= length) {
+        __m128i half = _mm_loadu_si128((const __m128i *) (raw + i));
+        matches = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(half, _mm256_castsi256_si128(wanted_first)),
+                         _mm_cmpeq_epi8(half, _mm256_castsi256_si128(wanted_second))));
+        if (matches != 0) {
+            return raw + i + __builtin_ctz(matches);
+        }
+        i += 16;
+    }
+
+    return scan_scalar(raw + i, length - i, first, second);
+}
+#endif
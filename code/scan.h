@@ -0,0 +1,44 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Header for the byte scanning kernels the     *
+ *                               HTTP parser is built on                      *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+
+#ifndef SCAN_H
+#define SCAN_H
+
+
+#include <stddef.h>
+#include <string.h>
+
+#define SCAN_SCALAR "scalar"
+#define SCAN_SSE42 "sse4.2"   // 16 bytes at a time
+#define SCAN_AVX2 "avx2"      // 32 bytes at a time
+
+
+//
+// Data Structures
+//
+typedef char *(*ScanKernel)(char *raw, size_t length, char first, char second);
+
+
+//
+// Forward Declarations
+//
+// scan_for returns the first byte in raw that is either first or second,
+// NULL if there is none. It starts out scalar, init_scan picks the widest
+// kernel the CPU has
+extern ScanKernel scan_for;
+void init_scan();
+int set_scan_kernel(const char *name);
+const char *scan_kernel_name();
+
+
+#endif /* SCAN_H */
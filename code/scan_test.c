@@ -0,0 +1,114 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Unit test for the scanning kernels: every    *
+ *                               kernel the CPU has must find what the scalar *
+ *                               one finds                                    *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scan.h"
+
+#define MAX_LENGTH 200   // a few blocks of the widest kernel and a tail
+#define MAX_SHIFT 32     // so the blocks start at every alignment
+#define SEED 160
+
+
+//
+// Forward Declarations
+//
+int check_kernel(const char *name);
+int check_buffer(char *raw, size_t length, char first, char second);
+
+
+//
+// Implementation
+//
+int main() {
+    /* Checks each kernel against the scalar one. Kernels the CPU doesn't
+     * have are skipped. Exits non-zero if any of them disagreed */
+
+    const char *kernels[] = {SCAN_SSE42, SCAN_AVX2};
+    int failures = 0;
+
+    for (int k = 0; k < (int) (sizeof(kernels) / sizeof(kernels[0])); k++) {
+        if (set_scan_kernel(kernels[k]) < 0) {
+            printf("--------- SCAN %s SKIPPED (not supported) --------\n",
+                   kernels[k]);
+            continue;
+        }
+        if (check_kernel(kernels[k]) == 0) {
+            printf("--------- SCAN %s PASSED --------\n", kernels[k]);
+        } else {
+            printf("--------- SCAN %s FAILED --------\n", kernels[k]);
+            failures++;
+        }
+    }
+
+    return failures != 0;
+}
+
+
+int check_kernel(const char *name) {
+    /* Scans buffers of every length up to MAX_LENGTH at every alignment,
+     * with the bytes looked for at every position or nowhere, each followed
+     * by a match just past the end that must not be found. Returns how many
+     * scans disagreed with the scalar kernel */
+
+    char buffer[MAX_SHIFT + MAX_LENGTH + 1], *raw;
+    char pairs[][2] = {{'\r', '\n'}, {':', ':'}, {(char) 0xe9, ' '}};
+    int failures = 0;
+
+    srand(SEED);
+    for (int p = 0; p < (int) (sizeof(pairs) / sizeof(pairs[0])); p++) {
+        for (int shift = 0; shift < MAX_SHIFT; shift++) {
+            raw = buffer + shift;
+            for (size_t length = 0; length <= MAX_LENGTH; length++) {
+
+                // filler that is neither byte, high bit set or not
+                for (size_t i = 0; i < length; i++) {
+                    do {
+                        raw[i] = (char) (rand() & 0xff);
+                    } while (raw[i] == pairs[p][0] || raw[i] == pairs[p][1]);
+                }
+                raw[length] = pairs[p][0];
+
+                failures += check_buffer(raw, length, pairs[p][0], pairs[p][1]);
+                for (size_t at = 0; at < length; at++) {
+                    raw[at] = pairs[p][at % 2];
+                    failures += check_buffer(raw, length, pairs[p][0],
+                                             pairs[p][1]);
+                    raw[at] = (char) 'a';
+                }
+            }
+        }
+    }
+    if (failures != 0) {
+        fprintf(stderr, "%s: %d scans disagreed\n", name, failures);
+    }
+
+    return failures;
+}
+
+
+int check_buffer(char *raw, size_t length, char first, char second) {
+    /* Returns 1 if the kernel in use and the scalar one find different
+     * bytes in raw */
+
+    const char *kernel = scan_kernel_name();
+    char *expected, *found;
+
+    found = scan_for(raw, length, first, second);
+    set_scan_kernel(SCAN_SCALAR);
+    expected = scan_for(raw, length, first, second);
+    set_scan_kernel(kernel);
+
+    return found != expected;
+}
@@ -5,7 +5,10 @@
 
 
 
-void extract_keywords(HTTPResponse **response, CacheObject *cache_entry) {
+// Picks the body's most common words, and their term frequencies, into the
+// given list. It only looks at the body, so it needs no lock: the keywords are
+// listed once the response is in the cache, see attach_keywords
+void extract_keywords(char *data, int body_length, KeywordList *keywords) {
     char *clean_body = NULL;
     int word_len;
     unsigned int num_words;
@@ -13,16 +16,15 @@ void extract_keywords(HTTPResponse **response, CacheObject *cache_entry) {
     WordCount *curr = NULL;
     WordCount *ptr = NULL;
     WordCount *temp = NULL;
-    int keywords_added = 0;
 
-    char *body = (char *) malloc((*response)->body_length);
-    memcpy(body, (*response)->body, (*response)->body_length);
+    char *body = (char *) malloc(body_length);
+    memcpy(body, data, body_length);
 
     char *curr_word;
     StopWord *stop_words = create_stop_words_set();
 
     // Stripping out any binary characters or non-alphabetical characters
-    clean_body = strip_content(body, (*response)->body_length);
+    clean_body = strip_content(body, body_length);
     
     // Get the first word
     curr_word = strtok(clean_body, " ");
@@ -55,55 +57,95 @@ void extract_keywords(HTTPResponse **response, CacheObject *cache_entry) {
     num_words = HASH_COUNT(vocab); // Number of unique words
     // Find top most common words in vocabulary
     HASH_SORT(vocab, count_sort); // Sort by most common
-    int i;  // I < 5 the 5 should be a macro
-    for(ptr = vocab, i = 0; ptr != NULL && i < NUM_KEYWORDS; ptr = (ptr->hh.next), i++) {
-        Keyword *curr_keyword;
-        CountEntry *count_entry = malloc(sizeof(CountEntry));
+    keywords->count = 0;
+    for(ptr = vocab; ptr != NULL && keywords->count < NUM_KEYWORDS; ptr = (ptr->hh.next)) {
         // Normalize the count (term frequency) by dividing by number of unique words in the data = size of table
-        count_entry->tf = (float) ptr->count / (float) num_words;
-        count_entry->cache_entry = cache_entry;
-        count_entry->next = NULL;
-        // Find keyword in the keywords table
-        HASH_FIND_STR(keywords_table, ptr->word, curr_keyword);
-        if (curr_keyword == NULL) {
-            // New keyword, so add an entry into the keywords table
-            curr_keyword = malloc(sizeof(Keyword));
-            if ((curr_keyword->word = (char *)malloc(strlen(ptr->word) + 1)) == NULL) {
-                error_out("Couldn't malloc!");
-            }
-            memcpy(curr_keyword->word, ptr->word, strlen(ptr->word));
-            curr_keyword->word[strlen(ptr->word)] = '\0';
+        keywords->words[keywords->count] = ptr->word;
+        keywords->tfs[keywords->count] = (float) ptr->count / (float) num_words;
+        ptr->word = NULL;   // the list has it now
+        keywords->count++;
+    }
 
-            curr_keyword->count_entry_list = count_entry;
+    // Free each word, then free hashtable
+    HASH_ITER(hh, vocab, curr, temp) {
+        free(curr->word);       // Free the word
+        HASH_DEL(vocab, curr);  // Delete it (curr advances to next) 
+        free(curr);             // Free the struct 
+    }
 
-            HASH_ADD_KEYPTR(hh, keywords_table, curr_keyword->word, strlen(curr_keyword->word), curr_keyword);
-            keywords_added++;
-            if (((*response)->keywords[i] = (char *) malloc(strlen(ptr->word) + 1)) == NULL) {
-                error_out("Couldn't malloc!");
-            }
-            memcpy((*response)->keywords[i], ptr->word, strlen(ptr->word));
-            (*response)->keywords[i][strlen(ptr->word)] = '\0';
+    free(clean_body);
+    free(body);
+}
 
 
-        } else {
-            // Already used keyword, so add the cache entry into the linked list
-            add_count_entry_to_keyword(curr_keyword, count_entry);
+// Lists the cache entry under each of the keywords extract_keywords picked,
+// with the cache locked
+void attach_keywords(CacheObject *cache_entry, KeywordList *keywords) {
+    int i;
+
+    for (i = 0; i < keywords->count; i++) {
+        add_keyword(cache_entry, keywords->words[i], keywords->tfs[i], i);
+    }
+    while (i < NUM_KEYWORDS) {
+        cache_entry->response->keywords[i] = NULL;
+        i++;
+    }
+}
+
+
+// Frees the words extract_keywords picked, attached or not
+void clear_keywords(KeywordList *keywords) {
+    for (int i = 0; i < keywords->count; i++) {
+        free(keywords->words[i]);
+    }
+    keywords->count = 0;
+}
+
+
+// Lists the cache entry under the keyword with the given term frequency, and
+// remembers the keyword in the given slot of its response so that it can be
+// taken off all of them when it is evicted
+void add_keyword(CacheObject *cache_entry, char *word, float tf, int slot) {
+    Keyword *curr_keyword;
+    CountEntry *count_entry = malloc(sizeof(CountEntry));
+
+    count_entry->tf = tf;
+    count_entry->cache_entry = cache_entry;
+    count_entry->next = NULL;
+    // Find keyword in the keywords table
+    HASH_FIND_STR(keywords_table, word, curr_keyword);
+    if (curr_keyword == NULL) {
+        // New keyword, so add an entry into the keywords table
+        curr_keyword = malloc(sizeof(Keyword));
+        if ((curr_keyword->word = strdup(word)) == NULL) {
+            error_out("Couldn't malloc!");
         }
+        curr_keyword->count_entry_list = count_entry;
+        HASH_ADD_KEYPTR(hh, keywords_table, curr_keyword->word, strlen(curr_keyword->word), curr_keyword);
+    } else {
+        // Already used keyword, so add the cache entry into the linked list
+        add_count_entry_to_keyword(curr_keyword, count_entry);
     }
 
-    if (keywords_added < NUM_KEYWORDS) {
-        (*response)->keywords[keywords_added] = NULL;
-        keywords_added++;
+    if ((cache_entry->response->keywords[slot] = strdup(word)) == NULL) {
+        error_out("Couldn't malloc!");
     }
+}
 
-    // Free each word, then free hashtable
-    HASH_ITER(hh, vocab, curr, temp) {
-        free(curr->word);       // Free the word
-        HASH_DEL(vocab, curr);  // Delete it (curr advances to next) 
-        free(curr);             // Free the struct 
+// Returns the term frequency the cache entry is listed under the keyword with,
+// 0 if it isn't
+float keyword_tf(CacheObject *cache_entry, char *word) {
+    Keyword *k = NULL;
+
+    HASH_FIND_STR(keywords_table, word, k);
+    for (CountEntry *entry = k != NULL ? k->count_entry_list : NULL; entry;
+            entry = entry->next) {
+        if (entry->cache_entry == cache_entry) {
+            return entry->tf;
+        }
     }
 
-    free(clean_body);
+    return 0;
 }
 
 
@@ -136,7 +178,7 @@ char *strip_content(char *data, int body_len) {
             new_data[len] = data[i];
             len++;
         } else {
-            if (i != 0) { // Don't add in repeating spaces
+            if (len != 0) { // Don't add in repeating spaces
                 if (new_data[len - 1] != ' ') {
                     new_data[len] = ' '; 
                     len++;
@@ -232,7 +274,6 @@ URLResults *find_relevant_urls(char *keywords) {
 	char* curr_word;
     int num_keywords;
     URLTF *single_keyword_results_list;
-    URLTF *curr;
     URLTF *all_relevant;
     URLTF_Table *results = NULL;
     int idx = 0;
@@ -242,7 +283,7 @@ URLResults *find_relevant_urls(char *keywords) {
     keywords = strip_content(keywords, strlen(keywords));
 
     // Making a copy of keywords because find_num_keywords uses strtok which changes the string
-    char copy[strlen(keywords)];
+    char copy[strlen(keywords) + 1];
     strcpy(copy, keywords);
     num_keywords = find_num_keywords(copy);
 
@@ -418,9 +459,9 @@ URLTF *find_diff(URLTF *l1, URLTF *l2) {
         url_table_entry->tf = curr->tf;
 
         memcpy(url_table_entry->url, curr->url, strlen(curr->url));
-        url_table_entry->url[strlen(url_table_entry->url)] = '\0';
+        url_table_entry->url[strlen(curr->url)] = '\0';
 
-        HASH_ADD_KEYPTR(hh, url_set, url_table_entry->url, strlen(url_table_entry->url), url_table_entry);
+        HASH_ADD_KEYPTR(hh, url_set, url_table_entry->url, strlen(curr->url), url_table_entry);
         curr = curr->next;
     }
 
@@ -485,17 +526,32 @@ void sort_list_by_tf(URLTF_Table **results, URLTF *all_relevant) {
     HASH_SORT((*results), tf_sort); // Sort by most common
 }
 
-void remove_keywords_from_keywords_table(HTTPResponse *response) {
+// Takes the cache entry off the keywords it is listed under. A keyword stays
+// in the table as long as some other cache entry still has it
+void remove_keywords_from_keywords_table(CacheObject *cache_entry) {
+    HTTPResponse *response = cache_entry->response;
     Keyword *k = NULL;
+    CountEntry **link, *entry;
 
     for (int i = 0; i < NUM_KEYWORDS && response->keywords[i] != NULL; i++) {
         HASH_FIND_STR(keywords_table, response->keywords[i], k);
         if (k) {
-            HASH_DEL(keywords_table, k);
-            // Free the items within the Keyword struct
-            free_count_entry(k);
-            free(k->word);
-            free(k);
+            // Unlink this entry's count, leave everyone else's alone
+            link = &(k->count_entry_list);
+            while ((entry = *link) != NULL) {
+                if (entry->cache_entry == cache_entry) {
+                    *link = entry->next;
+                    free(entry);
+                } else {
+                    link = &(entry->next);
+                }
+            }
+
+            if (k->count_entry_list == NULL) {
+                HASH_DEL(keywords_table, k);
+                free(k->word);
+                free(k);
+            }
             k = NULL;
         }
 
@@ -33,6 +33,14 @@ typedef struct StopWord {
 } StopWord;
 
 
+typedef struct KeywordList {
+    /* A body's keywords, picked before the cache is locked */
+    char *words[NUM_KEYWORDS];
+    float tfs[NUM_KEYWORDS];   // ...and their term frequencies
+    int count;
+} KeywordList;
+
+
 typedef struct URLResults{
 	char* urls[NUM_TOP_RESULTS];
 } URLResults;
@@ -50,7 +58,11 @@ typedef struct URLTF_Table {
     UT_hash_handle hh;         /* makes this structure hashable */
 } URLTF_Table;
 
-void extract_keywords(HTTPResponse **response, CacheObject *cache_entry);
+void extract_keywords(char *data, int body_length, KeywordList *keywords);
+void attach_keywords(CacheObject *cache_entry, KeywordList *keywords);
+void clear_keywords(KeywordList *keywords);
+void add_keyword(CacheObject *cache_entry, char *word, float tf, int slot);
+float keyword_tf(CacheObject *cache_entry, char *word);
 char *strip_content(char *data, int body_len);
 StopWord *create_stop_words_set();
 int is_stop_word(StopWord *stop_words, char *word);
@@ -65,7 +77,7 @@ URLTF *find_diff(URLTF *l1, URLTF *l2);
 void merge(URLTF **inter, URLTF *not_inter);
 void sort_list_by_tf(URLTF_Table **results, URLTF *all_relevant);
 int tf_sort(URLTF_Table *t1, URLTF_Table *t2);
-void remove_keywords_from_keywords_table(HTTPResponse *response);
+void remove_keywords_from_keywords_table(CacheObject *cache_entry);
 void free_count_entry(Keyword *keyword);
 
 
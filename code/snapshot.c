@@ -0,0 +1,285 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Saves the cache and its search index to a    *
+ *                               snapshot file, so a restarted proxy comes    *
+ *                               back serving hits instead of starting cold   *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Interface
+//
+#include "snapshot.h"
+
+
+//
+// Forward Declarations
+//
+void collect_object(CacheObject *object, SnapshotObject *snapshot);
+int write_object(FILE *file, SnapshotObject *snapshot);
+void release_object(SnapshotObject *snapshot);
+CacheObject *read_object(char *data, size_t size, size_t *offset);
+
+
+//
+// Implementation
+//
+int save_snapshot(char *path) {
+    /* Writes everything in the cache to path, in the eviction policy's order
+     * (oldest first, see cached_objects). The cache is only locked while the
+     * objects are collected, large bodies are held on to by a descriptor of
+     * our own and the rest copied, so nobody waits on the file being written. The snapshot that was there is only
+     * replaced once the new one is complete. Returns how many objects were
+     * written, -1 if it couldn't be */
+
+    SnapshotHeader header;
+    SnapshotObject *snapshots;
+    CacheObject **objects;
+    FILE *file;
+    char tmp[PATH_MAX];
+    size_t count, i;
+
+    cache_lock();
+    objects = cached_objects(&count);
+    if ((snapshots = (SnapshotObject *) malloc((count + 1) * sizeof(SnapshotObject))) == NULL) {
+        error_out("Couldn't malloc!");
+    }
+    for (i = 0; i < count; i++) {
+        collect_object(objects[i], &(snapshots[i]));
+    }
+    cache_unlock();
+    free(objects);
+
+    snprintf(tmp, sizeof(tmp), "%s" SNAPSHOT_TMP, path);
+    if ((file = fopen(tmp, "w")) == NULL) {
+        error_declare("Couldn't create the snapshot!");
+    } else {
+        header.magic = SNAPSHOT_MAGIC;
+        header.version = SNAPSHOT_VERSION;
+        header.count = count;
+        header.written = time(NULL);
+        fwrite(&header, sizeof(header), 1, file);
+        for (i = 0; i < count && write_object(file, &(snapshots[i])) == 0; i++);
+    }
+    for (size_t j = 0; j < count; j++) {
+        release_object(&(snapshots[j]));
+    }
+    free(snapshots);
+    if (file == NULL) {
+        return -1;
+    }
+
+    if (ferror(file) | (fclose(file) != 0) || i < count || rename(tmp, path) < 0) {
+        error_declare("Couldn't write the snapshot!");
+        unlink(tmp);
+        return -1;
+    }
+
+    return count;
+}
+
+
+int load_snapshot(char *path) {
+    /* Adds the objects in the snapshot at path to the cache in the order they
+     * were used in, so the eviction policy sees that order again, and lists
+     * them in the search index under the keywords they had. Objects that went
+     * stale meanwhile are skipped like any other. Returns how many objects
+     * were loaded, -1 if there was no snapshot we could use */
+
+    SnapshotHeader header;
+    struct stat info;
+    char *data;
+    size_t offset = sizeof(header);
+    int fd, loaded = 0;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &info) < 0 || info.st_size < (off_t) sizeof(header) ||
+            (data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+            MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    // read straight through it once
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION) {
+        error_declare("Not a snapshot we can read!");
+        munmap(data, info.st_size);
+        return -1;
+    }
+
+    // a truncated snapshot still gives us everything before the cut
+    for (uint64_t i = 0; i < header.count && offset < (size_t) info.st_size; i++) {
+        if (read_object(data, info.st_size, &offset) != NULL) {
+            loaded++;
+        }
+        if (offset == 0) {
+            break;
+        }
+    }
+    munmap(data, info.st_size);
+
+    return loaded;
+}
+
+
+void collect_object(CacheObject *object, SnapshotObject *snapshot) {
+    /* Takes what write_object needs from the object, with the cache locked.
+     * A large body's memfd is dup'ed rather than copied (eviction may close
+     * the cache's), it is only copied if that fails */
+
+    HTTPResponse *response = object->response;
+    SnapshotRecord *record = &(snapshot->record);
+    int header_length;
+
+    snapshot->url = strdup(object->url);
+    snapshot->headers = serialize_headers(response, &header_length);
+    snapshot->body = NULL;
+    snapshot->body_fd = -1;
+    if (response->body_fd < 0 || (snapshot->body_fd = dup(response->body_fd)) < 0) {
+        if ((snapshot->body = (char *) malloc(response->body_length + 1)) != NULL) {
+            memcpy(snapshot->body, response->body, response->body_length);
+        }
+    }
+    if (snapshot->url == NULL || (snapshot->body == NULL && snapshot->body_fd < 0)) {
+        error_out("Couldn't malloc!");
+    }
+
+    record->url_length = strlen(object->url);
+    record->header_length = header_length;
+    record->body_length = response->body_length;
+    record->keyword_count = 0;
+    while (record->keyword_count < NUM_KEYWORDS &&
+           response->keywords[record->keyword_count] != NULL) {
+        snapshot->keywords[record->keyword_count] =
+            strdup(response->keywords[record->keyword_count]);
+        snapshot->tfs[record->keyword_count] =
+            keyword_tf(object, response->keywords[record->keyword_count]);
+        record->keyword_count++;
+    }
+    record->time_fetched = response->time_fetched;
+    record->last_accessed = object->last_accessed;
+    record->fetch_latency = response->fetch_latency;
+    record->initial_age = response->initial_age;
+    record->padding = 0;
+}
+
+
+int write_object(FILE *file, SnapshotObject *snapshot) {
+    /* Writes one collected object and the keywords it is listed under.
+     * Returns -1 if it couldn't be written */
+
+    SnapshotRecord *record = &(snapshot->record);
+    SnapshotKeyword keyword;
+    char *body = snapshot->body;
+
+    // a large body is read through a mapping of our descriptor of it
+    if (body == NULL && (body = mmap(NULL, record->body_length + 1, PROT_READ,
+                                     MAP_SHARED, snapshot->body_fd, 0)) == MAP_FAILED) {
+        return -1;
+    }
+
+    fwrite(record, sizeof(*record), 1, file);
+    fwrite(snapshot->url, 1, record->url_length, file);
+    fwrite(snapshot->headers, 1, record->header_length, file);
+    fwrite(body, 1, record->body_length, file);
+    if (body != snapshot->body) {
+        munmap(body, record->body_length + 1);
+    }
+    for (uint32_t i = 0; i < record->keyword_count; i++) {
+        keyword.length = strlen(snapshot->keywords[i]);
+        keyword.tf = snapshot->tfs[i];
+        fwrite(&keyword, sizeof(keyword), 1, file);
+        fwrite(snapshot->keywords[i], 1, keyword.length, file);
+    }
+
+    return ferror(file) ? -1 : 0;
+}
+
+
+void release_object(SnapshotObject *snapshot) {
+    /* Frees what collect_object took */
+
+    free(snapshot->url);
+    free(snapshot->headers);
+    free(snapshot->body);
+    if (snapshot->body_fd >= 0) {
+        close(snapshot->body_fd);
+    }
+    for (uint32_t i = 0; i < snapshot->record.keyword_count; i++) {
+        free(snapshot->keywords[i]);
+    }
+}
+
+
+CacheObject *read_object(char *data, size_t size, size_t *offset) {
+    /* Adds the object at offset to the cache and moves offset past it.
+     * Returns the object, or NULL if the cache didn't take it. offset is set
+     * to 0 if the object runs past the end of the snapshot */
+
+    SnapshotRecord record;
+    SnapshotKeyword keyword;
+    HTTPResponse *response;
+    CacheObject *object;
+    char *url, *word;
+    size_t at = *offset;
+
+    if (at + sizeof(record) > size) {
+        *offset = 0;
+        return NULL;
+    }
+    memcpy(&record, data + at, sizeof(record));
+    at += sizeof(record);
+    if (at + record.url_length + record.header_length + record.body_length > size) {
+        *offset = 0;
+        return NULL;
+    }
+
+    // the body is copied out of the mapping, the memory tier keeps its own
+    url = strndup(data + at, record.url_length);
+    at += record.url_length;
+    response = parse_response(record.header_length + record.body_length, data + at);
+    at += record.header_length + record.body_length;
+    if (response == NULL) {
+        free(url);
+        *offset = 0;
+        return NULL;
+    }
+    response->time_fetched = record.time_fetched;
+    response->initial_age = record.initial_age;
+    response->fetch_latency = record.fetch_latency;
+    if ((object = add_data_to_cache(url, response)) == NULL) {
+        free_response(response);
+    } else {
+        object->last_accessed = record.last_accessed;
+    }
+    free(url);
+
+    for (uint32_t i = 0; i < record.keyword_count; i++) {
+        if (at + sizeof(keyword) > size) {
+            *offset = 0;
+            return object;
+        }
+        memcpy(&keyword, data + at, sizeof(keyword));
+        at += sizeof(keyword);
+        if (at + keyword.length > size) {
+            *offset = 0;
+            return object;
+        }
+        if (object != NULL && i < NUM_KEYWORDS) {
+            word = strndup(data + at, keyword.length);
+            add_keyword(object, word, keyword.tf, i);
+            free(word);
+        }
+        at += keyword.length;
+    }
+    *offset = at;
+
+    return object;
+}
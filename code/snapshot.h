@@ -0,0 +1,83 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Header for saving the cache to a snapshot    *
+ *                               file and loading it back on startup          *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "search_engine.h"
+
+#define DEFAULT_SNAPSHOT_INTERVAL 300  // seconds between snapshots
+#define SNAPSHOT_MAGIC 0x70637373      // "pcss"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_TMP ".tmp"            // written next to it, then renamed
+
+
+//
+// Data Structures
+//
+typedef struct SnapshotHeader {
+    /* What a snapshot file starts with */
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;      // objects that follow, oldest first
+    int64_t written;
+} SnapshotHeader;
+
+typedef struct SnapshotRecord {
+    /* What every object starts with. The url, the status line and headers,
+     * the body and then keyword_count keywords follow it */
+    uint32_t url_length;
+    uint32_t header_length;
+    uint32_t body_length;
+    uint32_t keyword_count;
+    int64_t time_fetched;
+    int64_t last_accessed;
+    int64_t fetch_latency;
+    int32_t initial_age;
+    int32_t padding;
+} SnapshotRecord;
+
+typedef struct SnapshotKeyword {
+    /* A keyword the object is listed under in the search index, the word
+     * itself follows it */
+    uint32_t length;
+    float tf;
+} SnapshotKeyword;
+
+typedef struct SnapshotObject {
+    /* An object as it was when the cache was locked, kept so it can be
+     * written once the cache is let go of */
+    SnapshotRecord record;
+    char *url;
+    char *headers;
+    char *body;                     // a copy, NULL if body_fd has it
+    int body_fd;                    // our own descriptor of a large body
+    char *keywords[NUM_KEYWORDS];
+    float tfs[NUM_KEYWORDS];
+} SnapshotObject;
+
+
+//
+// Forward Declarations
+//
+// save_snapshot only locks the cache while it looks at it, load_snapshot is
+// called with it locked
+int save_snapshot(char *path);
+int load_snapshot(char *path);
+
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,307 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Unit test for snapshots: a saved cache must  *
+ *                               load back as it was, and a truncated         *
+ *                               snapshot must give back what came before the *
+ *                               cut                                          *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+#include "snapshot.h"
+
+#define SNAPSHOT_FILE "cache.snapshot"
+#define TRUNCATED_FILE "truncated.snapshot"
+#define NUM_OBJECTS 4
+#define LARGE_BODY (LARGE_BODY_BYTES + LARGE_BODY_BYTES / 2)  // kept in a memfd
+#define RESPONSE_HEADER "HTTP/1.1 200 OK" CRLF "Content-Length: %d" CRLF \
+                        "Cache-Control: max-age=600" CRLF "ETag: \"v%d\"" CRLF CRLF
+
+
+//
+// Data Structures
+//
+typedef struct Expected {
+    /* An object as it went into the cache */
+    char url[64];
+    char etag[16];
+    char *body;
+    int body_length;
+    KeywordList keywords;
+} Expected;
+
+
+//
+// Globals
+//
+Expected expected[NUM_OBJECTS];
+
+
+//
+// Forward Declarations
+//
+void fill_cache();
+void empty_cache();
+int check_cache(int count);
+int check_round_trip();
+int check_truncated();
+int check_unusable();
+int copy_truncated(const char *from, const char *to, off_t cut);
+int expect(int condition, const char *what);
+
+
+//
+// Implementation
+//
+int main() {
+    /* Runs every check in a directory of its own, the cache logs to its
+     * working directory. Exits non-zero if any of them failed */
+
+    char dir[] = "/tmp/snapshot_test.XXXXXX";
+    int failures;
+
+    if (mkdtemp(dir) == NULL || chdir(dir) < 0) {
+        error_out("Couldn't make a directory to test in!");
+    }
+    init_cache(NULL, DEFAULT_CACHE_BYTES, DEFAULT_MAX_OBJECT_BYTES);
+    fill_cache();
+
+    failures = check_round_trip() + check_truncated() + check_unusable();
+    if (failures == 0) {
+        printf("--------- SNAPSHOT PASSED --------\n");
+    } else {
+        printf("--------- SNAPSHOT FAILED --------\n");
+    }
+
+    empty_cache();
+    destroy_cache();
+    for (int i = 0; i < NUM_OBJECTS; i++) {
+        clear_keywords(&(expected[i].keywords));
+        free(expected[i].body);
+    }
+    unlink(SNAPSHOT_FILE);
+    unlink(TRUNCATED_FILE);
+    unlink("cache.log");
+    rmdir(dir);
+
+    return failures != 0;
+}
+
+
+void fill_cache() {
+    /* Caches NUM_OBJECTS responses with their keywords, used in the order
+     * they were added. The last one's body is big enough for a memfd */
+
+    HTTPResponse *response;
+    CacheObject *object;
+    char *raw;
+    int header_length, length;
+
+    for (int i = 0; i < NUM_OBJECTS; i++) {
+        Expected *object_expected = &expected[i];
+
+        snprintf(object_expected->url, sizeof(object_expected->url),
+                 "http://example.com/object%d", i);
+        snprintf(object_expected->etag, sizeof(object_expected->etag),
+                 "\"v%d\"", i);
+        object_expected->body_length = i == NUM_OBJECTS - 1 ? LARGE_BODY : 100 * (i + 1);
+        object_expected->body = (char *) malloc(object_expected->body_length);
+        for (int j = 0; j < object_expected->body_length; j++) {
+            object_expected->body[j] = "banana apple cherry orange "[(i + j) % 27];
+        }
+
+        // as the server sent it
+        header_length = snprintf(NULL, 0, RESPONSE_HEADER,
+                                 object_expected->body_length, i);
+        length = header_length + object_expected->body_length;
+        raw = (char *) malloc(length + 1);
+        snprintf(raw, header_length + 1, RESPONSE_HEADER,
+                 object_expected->body_length, i);
+        memcpy(raw + header_length, object_expected->body,
+               object_expected->body_length);
+        if ((response = parse_response(length, raw)) == NULL) {
+            error_out("A test response didn't parse!");
+        }
+        free(raw);
+
+        extract_keywords(response->body, response->body_length,
+                         &(object_expected->keywords));
+        cache_lock();
+        if ((object = add_data_to_cache(object_expected->url, response)) == NULL) {
+            error_out("A test response wasn't cached!");
+        }
+        attach_keywords(object, &(object_expected->keywords));
+        cache_unlock();
+    }
+}
+
+
+void empty_cache() {
+    /* Evicts everything */
+
+    CacheObject **objects;
+    size_t count;
+
+    cache_lock();
+    objects = cached_objects(&count);
+    for (size_t i = 0; i < count; i++) {
+        evict(objects[i]);
+    }
+    cache_unlock();
+    free(objects);
+}
+
+
+int check_cache(int count) {
+    /* Returns 0 if the cache holds the first count objects we put in it, in
+     * the order they were used, with the bodies, headers and keywords they
+     * went in with. Otherwise 1 */
+
+    CacheObject **objects;
+    HTTPResponse *response;
+    size_t cached;
+    int failed = 0;
+    char *etag;
+
+    cache_lock();
+    objects = cached_objects(&cached);
+    if ((int) cached != count) {
+        fprintf(stderr, "%zu objects cached, not %d\n", cached, count);
+        failed = 1;
+    }
+    for (int i = 0; !failed && i < count; i++) {
+        response = objects[i]->response;
+        etag = find_hdr(response->hdrs, ETAG);
+        failed = strcmp(objects[i]->url, expected[i].url) != 0 ||
+                 response->body_length != expected[i].body_length ||
+                 memcmp(response->body, expected[i].body, response->body_length) != 0 ||
+                 etag == NULL || strcmp(etag, expected[i].etag) != 0;
+        for (int k = 0; !failed && k < expected[i].keywords.count; k++) {
+            failed = keyword_tf(objects[i], expected[i].keywords.words[k]) !=
+                     expected[i].keywords.tfs[k];
+        }
+        if (failed) {
+            fprintf(stderr, "%s didn't come back as it went in\n", expected[i].url);
+        }
+    }
+    cache_unlock();
+    free(objects);
+
+    return failed;
+}
+
+
+int check_round_trip() {
+    /* Saves the cache, empties it and loads it back. Returns how many checks
+     * failed */
+
+    int failures = 0;
+
+    failures += expect(check_cache(NUM_OBJECTS) == 0, "round trip: the cache was filled");
+    failures += expect(save_snapshot(SNAPSHOT_FILE) == NUM_OBJECTS,
+                       "round trip: every object saved");
+    empty_cache();
+
+    cache_lock();
+    failures += expect(load_snapshot(SNAPSHOT_FILE) == NUM_OBJECTS,
+                       "round trip: every object loaded");
+    cache_unlock();
+    failures += expect(check_cache(NUM_OBJECTS) == 0,
+                       "round trip: objects came back as they were");
+
+    return failures;
+}
+
+
+int check_truncated() {
+    /* Cuts the snapshot off half way through the last object's body, which
+     * has to be left out while everything before it loads. Returns how many
+     * checks failed */
+
+    struct stat info;
+    int failures = 0;
+
+    if (stat(SNAPSHOT_FILE, &info) < 0 ||
+            copy_truncated(SNAPSHOT_FILE, TRUNCATED_FILE,
+                           info.st_size - LARGE_BODY / 2) < 0) {
+        return expect(0, "truncated: made a truncated snapshot");
+    }
+    empty_cache();
+
+    cache_lock();
+    failures += expect(load_snapshot(TRUNCATED_FILE) == NUM_OBJECTS - 1,
+                       "truncated: everything before the cut loaded");
+    cache_unlock();
+    failures += expect(check_cache(NUM_OBJECTS - 1) == 0,
+                       "truncated: objects before the cut came back as they were");
+
+    return failures;
+}
+
+
+int check_unusable() {
+    /* A missing snapshot or one that is cut off in its header, or isn't a
+     * snapshot at all, loads nothing. Returns how many checks failed */
+
+    int failures = 0, fd;
+
+    empty_cache();
+    cache_lock();
+    failures += expect(load_snapshot("missing.snapshot") == -1,
+                       "unusable: a missing snapshot");
+    if (copy_truncated(SNAPSHOT_FILE, TRUNCATED_FILE, sizeof(SnapshotHeader) - 1) == 0) {
+        failures += expect(load_snapshot(TRUNCATED_FILE) == -1,
+                           "unusable: cut off in its header");
+    }
+    if ((fd = open(TRUNCATED_FILE, O_WRONLY | O_TRUNC)) >= 0) {
+        failures += expect(write(fd, RESPONSE_HEADER, sizeof(SnapshotHeader)) ==
+                           sizeof(SnapshotHeader), "unusable: wrote a non-snapshot");
+        close(fd);
+        failures += expect(load_snapshot(TRUNCATED_FILE) == -1,
+                           "unusable: not a snapshot");
+    }
+    cache_unlock();
+    failures += expect(check_cache(0) == 0, "unusable: nothing was loaded");
+
+    return failures;
+}
+
+
+int copy_truncated(const char *from, const char *to, off_t cut) {
+    /* Copies the first cut bytes of from to to. Returns -1 if it couldn't */
+
+    char buffer[BUFFER_SIZE];
+    int in, out;
+    ssize_t n = 0;
+
+    if ((in = open(from, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if ((out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+        close(in);
+        return -1;
+    }
+    while (cut > 0 && (n = read(in, buffer, cut < BUFFER_SIZE ? cut : BUFFER_SIZE)) > 0 &&
+           write(out, buffer, n) == n) {
+        cut -= n;
+    }
+    close(in);
+    close(out);
+
+    return cut == 0 ? 0 : -1;
+}
+
+
+int expect(int condition, const char *what) {
+    /* Returns 0 if the condition holds, 1 (after saying what didn't) if it
+     * doesn't */
+
+    if (!condition) {
+        fprintf(stderr, "%s: failed\n", what);
+    }
+    return !condition;
+}
@@ -0,0 +1,227 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: A hierarchical timing wheel that keeps every *
+ *                               connection's deadline with O(1) arming and   *
+ *                               cancelling, run from the event loop          *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Interface
+//
+#include "timer.h"
+
+
+//
+// Forward Declarations
+//
+unsigned long current_tick();
+void insert_timer(TimerWheel *wheel, Timer *timer);
+void link_timer(Timer *head, Timer *timer);
+void cascade(TimerWheel *wheel, int level, int slot);
+
+
+//
+// Implementation
+//
+TimerWheel *create_timer_wheel() {
+    /* Returns an empty wheel starting at the current tick, NULL if it
+     * couldn't */
+
+    TimerWheel *wheel;
+
+    if ((wheel = (TimerWheel *) malloc(sizeof(TimerWheel))) == NULL) {
+        return NULL;
+    }
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            wheel->slots[level][slot].prev = &(wheel->slots[level][slot]);
+            wheel->slots[level][slot].next = &(wheel->slots[level][slot]);
+        }
+    }
+    wheel->expired.prev = wheel->expired.next = &(wheel->expired);
+    wheel->next_tick = current_tick();
+    wheel->armed = 0;
+
+    return wheel;
+}
+
+
+void init_timer(Timer *timer) {
+    /* Sets up a timer that isn't armed */
+
+    timer->prev = timer->next = NULL;
+    timer->wheel = NULL;
+    timer->expires = 0;
+}
+
+
+int timer_armed(Timer *timer) {
+    /* Returns 1 if the timer is in a wheel, expired ones included until they
+     * are collected */
+
+    return timer->prev != NULL;
+}
+
+
+void arm_timer(TimerWheel *wheel, Timer *timer, long ms) {
+    /* Has the timer expire ms from now, moving it if it was armed already.
+     * We are part way through the current tick, so it may expire up to a
+     * tick later than that but never earlier */
+
+    cancel_timer(timer);
+    timer->expires = current_tick() + 1 + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    timer->wheel = wheel;
+    wheel->armed++;
+    insert_timer(wheel, timer);
+}
+
+
+void cancel_timer(Timer *timer) {
+    /* Takes the timer out of its wheel, if it is in one */
+
+    if (timer->prev == NULL) {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+    timer->wheel->armed--;
+    timer->wheel = NULL;
+}
+
+
+void advance_timers(TimerWheel *wheel) {
+    /* Runs every tick up to the current one, moving the timers that expire
+     * on them to the expired list */
+
+    unsigned long now = current_tick();
+    int slot, level;
+
+    while (wheel->next_tick <= now) {
+
+        // a level 0 round is up, the next slot of the level above is spread
+        // over level 0 (and so on up, whenever that level's round is up too)
+        slot = wheel->next_tick & (WHEEL_SLOTS - 1);
+        for (level = 1; slot == 0 && level < WHEEL_LEVELS; level++) {
+            slot = (wheel->next_tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+            cascade(wheel, level, slot);
+        }
+
+        cascade(wheel, 0, wheel->next_tick & (WHEEL_SLOTS - 1));
+        wheel->next_tick++;
+    }
+}
+
+
+Timer *next_expired(TimerWheel *wheel) {
+    /* Returns the next timer that expired (taken out of the wheel), NULL
+     * once there are none left. Handling one may cancel others that expired
+     * with it, so they are handed out one at a time */
+
+    Timer *timer = wheel->expired.next;
+
+    if (timer == &(wheel->expired)) {
+        return NULL;
+    }
+    cancel_timer(timer);
+
+    return timer;
+}
+
+
+int timer_wait_ms(TimerWheel *wheel, int longest) {
+    /* Returns how long the event loop may wait before the next tick that has
+     * something to do, at most longest */
+
+    unsigned long now_ms, tick, until;
+    struct timespec now;
+
+    if (wheel->armed == 0) {
+        return longest;
+    }
+
+    // the first timer on level 0, or the next round of it, whichever comes
+    // first (timers from the levels above only land on it then)
+    tick = wheel->next_tick;
+    while ((tick & (WHEEL_SLOTS - 1)) != 0 &&
+           wheel->slots[0][tick & (WHEEL_SLOTS - 1)].next ==
+           &(wheel->slots[0][tick & (WHEEL_SLOTS - 1)])) {
+        tick++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_ms = now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+    if (tick * TIMER_TICK_MS <= now_ms) {
+        return 0;
+    }
+    until = tick * TIMER_TICK_MS - now_ms;
+
+    return until < (unsigned long) longest ? (int) until : longest;
+}
+
+
+unsigned long current_tick() {
+    /* Returns the tick we are in */
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec * 1000UL + now.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+
+void insert_timer(TimerWheel *wheel, Timer *timer) {
+    /* Puts the timer on the lowest level that reaches its tick. One that is
+     * due already expires on the next tick run */
+
+    unsigned long expires = timer->expires, delta;
+    int level = 0;
+
+    if (expires < wheel->next_tick) {
+        expires = wheel->next_tick;
+    }
+    delta = expires - wheel->next_tick;
+    if (delta >= WHEEL_SPAN) {
+        delta = WHEEL_SPAN - 1;
+        expires = wheel->next_tick + delta;
+    }
+    while (delta >= (1UL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    timer->expires = expires;
+    link_timer(&(wheel->slots[level][(expires >> (WHEEL_BITS * level)) &
+                                     (WHEEL_SLOTS - 1)]),
+               timer);
+}
+
+
+void link_timer(Timer *head, Timer *timer) {
+    /* Adds the timer to the end of the list head heads */
+
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+
+void cascade(TimerWheel *wheel, int level, int slot) {
+    /* Empties a slot: the timers on level 0 have expired, the ones above go
+     * back in, now a level or more lower */
+
+    Timer *head = &(wheel->slots[level][slot]), *timer;
+
+    while ((timer = head->next) != head) {
+        head->next = timer->next;
+        timer->next->prev = head;
+        if (level == 0) {
+            link_timer(&(wheel->expired), timer);
+        } else {
+            insert_timer(wheel, timer);
+        }
+    }
+}
@@ -0,0 +1,66 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Header for the hierarchical timing wheel     *
+ *                               connection deadlines are kept in             *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+
+#ifndef TIMER_H
+#define TIMER_H
+
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TIMER_TICK_MS 250                 // deadlines are kept this finely
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)     // per level
+#define WHEEL_LEVELS 4                    // 2^24 ticks, about 48 days
+#define WHEEL_SPAN (1UL << (WHEEL_BITS * WHEEL_LEVELS))
+
+
+//
+// Data Structures
+//
+typedef struct Timer {
+    /* A deadline, kept in whatever it is for (see Connection). Arming and
+     * cancelling it is O(1), it just goes in or out of a slot's list */
+    struct Timer *prev;         // in its slot's list, NULL while not armed
+    struct Timer *next;
+    struct TimerWheel *wheel;   // ...and the wheel it is in
+    unsigned long expires;      // in ticks
+} Timer;
+
+typedef struct TimerWheel {
+    /* Level 0 has a slot for each of the next WHEEL_SLOTS ticks, every level
+     * above has one for WHEEL_SLOTS slots of the level below. Timers are put
+     * on the lowest level that reaches their tick and move down a level
+     * whenever their slot comes up, so a tick only looks at one slot */
+    Timer slots[WHEEL_LEVELS][WHEEL_SLOTS];  // each heads a circular list
+    Timer expired;                           // ...as does this, see next_expired
+    unsigned long next_tick;                 // the first tick not yet run
+    int armed;
+} TimerWheel;
+
+
+//
+// Forward Declarations
+//
+TimerWheel *create_timer_wheel();
+void init_timer(Timer *timer);
+int timer_armed(Timer *timer);
+void arm_timer(TimerWheel *wheel, Timer *timer, long ms);
+void cancel_timer(Timer *timer);
+void advance_timers(TimerWheel *wheel);
+Timer *next_expired(TimerWheel *wheel);
+int timer_wait_ms(TimerWheel *wheel, int longest);
+
+
+#endif /* TIMER_H */
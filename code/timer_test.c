@@ -0,0 +1,200 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Unit test for the timing wheel: timers must  *
+ *                               cascade down to expire on their tick, and    *
+ *                               cancelled ones must never expire             *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+#include <stdio.h>
+
+#include "timer.h"
+
+#define BEHIND (WHEEL_SLOTS * WHEEL_SLOTS + WHEEL_SLOTS)  // ticks, see check_cascade
+#define LONG_WAIT_MS (100L * 24 * 60 * 60 * 1000)        // past what the wheel spans
+
+
+//
+// Forward Declarations
+//
+int check_cascade();
+int check_cancel();
+int check_far_future();
+int expect(int condition, const char *what);
+int in_slot(TimerWheel *wheel, Timer *timer, int level);
+void wait_for(Timer *timer);
+
+
+//
+// Implementation
+//
+int main() {
+    /* Runs every check. Exits non-zero if any of them failed */
+
+    int failures = check_cascade() + check_cancel() + check_far_future();
+
+    if (failures == 0) {
+        printf("--------- TIMER WHEEL PASSED --------\n");
+    } else {
+        printf("--------- TIMER WHEEL FAILED --------\n");
+    }
+
+    return failures != 0;
+}
+
+
+int check_cascade() {
+    /* A wheel that hasn't run for BEHIND ticks puts timers due shortly on
+     * level 2. Catching up has to bring them down a level at a time, and
+     * they must then expire on their tick, in order, and not before.
+     * Returns how many checks failed */
+
+    TimerWheel *wheel = create_timer_wheel();
+    Timer first, second, third;
+    int failures = 0;
+
+    init_timer(&first);
+    init_timer(&second);
+    init_timer(&third);
+    wheel->next_tick -= BEHIND;
+    arm_timer(wheel, &first, TIMER_TICK_MS);
+    arm_timer(wheel, &second, 2 * TIMER_TICK_MS);
+    arm_timer(wheel, &third, 3 * TIMER_TICK_MS);
+    failures += expect(wheel->armed == 3, "cascade: three timers armed");
+    failures += expect(in_slot(wheel, &first, 2), "cascade: timer went on level 2");
+
+    advance_timers(wheel);
+    failures += expect(next_expired(wheel) == NULL, "cascade: nothing due yet");
+    failures += expect(timer_armed(&first) && timer_armed(&third),
+                       "cascade: timers still armed after catching up");
+
+    wait_for(&first);
+    advance_timers(wheel);
+    failures += expect(next_expired(wheel) == &first, "cascade: first expired");
+    failures += expect(next_expired(wheel) == NULL, "cascade: only the first");
+    failures += expect(!timer_armed(&first), "cascade: expired timer collected");
+
+    wait_for(&third);
+    advance_timers(wheel);
+    failures += expect(next_expired(wheel) == &second, "cascade: second expired next");
+    failures += expect(next_expired(wheel) == &third, "cascade: then the third");
+    failures += expect(wheel->armed == 0, "cascade: nothing left armed");
+
+    free(wheel);
+    return failures;
+}
+
+
+int check_cancel() {
+    /* Cancelled timers never expire, whether they are still in a slot or
+     * are waiting to be collected, and re-arming one moves it. Returns how
+     * many checks failed */
+
+    TimerWheel *wheel = create_timer_wheel();
+    Timer kept, cancelled, moved;
+    int failures = 0;
+
+    init_timer(&kept);
+    init_timer(&cancelled);
+    init_timer(&moved);
+    cancel_timer(&cancelled);
+    failures += expect(!timer_armed(&cancelled), "cancel: an unarmed timer stays so");
+
+    arm_timer(wheel, &kept, TIMER_TICK_MS);
+    arm_timer(wheel, &cancelled, TIMER_TICK_MS);
+    arm_timer(wheel, &moved, TIMER_TICK_MS);
+    arm_timer(wheel, &moved, LONG_WAIT_MS);
+    cancel_timer(&cancelled);
+    failures += expect(wheel->armed == 2, "cancel: re-arming doesn't count twice");
+
+    wait_for(&kept);
+    advance_timers(wheel);
+    failures += expect(next_expired(wheel) == &kept, "cancel: the kept one expired");
+    failures += expect(next_expired(wheel) == NULL,
+                       "cancel: cancelled and moved ones didn't");
+
+    // expired but not yet collected
+    arm_timer(wheel, &cancelled, 0);
+    wait_for(&cancelled);
+    advance_timers(wheel);
+    cancel_timer(&cancelled);
+    failures += expect(next_expired(wheel) == NULL,
+                       "cancel: an expired one is taken back");
+
+    cancel_timer(&moved);
+    failures += expect(wheel->armed == 0, "cancel: nothing left armed");
+
+    free(wheel);
+    return failures;
+}
+
+
+int check_far_future() {
+    /* A deadline further off than the wheel reaches is held on its top level
+     * at the furthest tick it has, and the event loop may still wait no
+     * longer than it asks to. Returns how many checks failed */
+
+    TimerWheel *wheel = create_timer_wheel();
+    Timer timer;
+    int failures = 0;
+
+    init_timer(&timer);
+    failures += expect(timer_wait_ms(wheel, 1000) == 1000,
+                       "far future: an empty wheel waits as long as asked");
+    arm_timer(wheel, &timer, LONG_WAIT_MS);
+    failures += expect(timer.expires - wheel->next_tick == WHEEL_SPAN - 1,
+                       "far future: held at the furthest tick");
+    failures += expect(in_slot(wheel, &timer, WHEEL_LEVELS - 1),
+                       "far future: held on the top level");
+    failures += expect(timer_wait_ms(wheel, 1000) <= 1000,
+                       "far future: waits no longer than asked");
+    cancel_timer(&timer);
+
+    free(wheel);
+    return failures;
+}
+
+
+int expect(int condition, const char *what) {
+    /* Returns 0 if the condition holds, 1 (after saying what didn't) if it
+     * doesn't */
+
+    if (!condition) {
+        fprintf(stderr, "%s: failed\n", what);
+    }
+    return !condition;
+}
+
+
+int in_slot(TimerWheel *wheel, Timer *timer, int level) {
+    /* Returns 1 if the timer is in the slot of the level its tick is on */
+
+    Timer *head = &(wheel->slots[level][(timer->expires >> (WHEEL_BITS * level)) &
+                                        (WHEEL_SLOTS - 1)]);
+
+    for (Timer *next = head->next; next != head; next = next->next) {
+        if (next == timer) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+void wait_for(Timer *timer) {
+    /* Sleeps until the timer's tick has started */
+
+    struct timespec now, pause = {0, 10 * 1000000};
+
+    do {
+        nanosleep(&pause, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec * 1000UL + now.tv_nsec / 1000000) / TIMER_TICK_MS <
+             timer->expires);
+}
@@ -0,0 +1,153 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Keeps finished connections to origin         *
+ *                               servers open so the next miss for the same   *
+ *                               origin skips the TCP handshake               *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Interface
+//
+#include "upstream.h"
+
+
+//
+// Globals
+//
+int pool_max_idle = DEFAULT_POOL_IDLE;
+int pool_idle_timeout = DEFAULT_POOL_TIMEOUT;
+
+
+//
+// Forward Declarations
+//
+UpstreamPool *find_pool(UpstreamPool **pools, char *host, int port, int create);
+int server_alive(int sockfd);
+
+
+//
+// Implementation
+//
+void init_upstream_pool(int max_idle, int idle_timeout) {
+    /* Sets the limits shared by every worker's pool */
+
+    pool_max_idle = max_idle;
+    pool_idle_timeout = idle_timeout;
+}
+
+
+int checkout_server(UpstreamPool **pools, char *host, int port) {
+    /* Returns an idle connection to host:port, or -1 if there is none we can
+     * use. Connections that went stale or were closed by the server are
+     * dropped on the way */
+
+    UpstreamPool *pool = find_pool(pools, host, port, 0);
+    IdleServer *server;
+    int sockfd = -1;
+    time_t now = time(NULL);
+
+    while (pool != NULL && pool->idle != NULL && sockfd < 0) {
+        server = pool->idle;
+        pool->idle = server->next;
+        pool->idle_count--;
+        if (now - server->idle_since < pool_idle_timeout &&
+                server_alive(server->sockfd)) {
+            sockfd = server->sockfd;
+        } else {
+            close(server->sockfd);
+        }
+        free(server);
+    }
+
+    return sockfd;
+}
+
+
+int checkin_server(UpstreamPool **pools, char *host, int port, int sockfd) {
+    /* Parks a connection whose response was fully read. Returns 1 if it was
+     * kept, 0 if the pool was full and it was closed instead */
+
+    UpstreamPool *pool = find_pool(pools, host, port, 1);
+    IdleServer *server;
+
+    if (pool->idle_count >= pool_max_idle) {
+        close(sockfd);
+        return 0;
+    }
+    if ((server = (IdleServer *) malloc(sizeof(IdleServer))) == NULL) {
+        error_declare("Couldn't malloc!");
+        close(sockfd);
+        return 0;
+    }
+    server->sockfd = sockfd;
+    server->idle_since = time(NULL);
+    server->next = pool->idle;
+    pool->idle = server;
+    pool->idle_count++;
+
+    return 1;
+}
+
+
+void sweep_idle_servers(UpstreamPool **pools) {
+    /* Closes every connection that has been idle for too long */
+
+    UpstreamPool *pool, *tmp;
+    IdleServer **server, *expired;
+    time_t now = time(NULL);
+
+    HASH_ITER(hh, *pools, pool, tmp) {
+
+        // most recently used first, so everything after the first expired
+        // connection has expired too
+        for (server = &(pool->idle); *server != NULL; server = &((*server)->next)) {
+            if (now - (*server)->idle_since >= pool_idle_timeout) {
+                break;
+            }
+        }
+        while (*server != NULL) {
+            expired = *server;
+            *server = expired->next;
+            close(expired->sockfd);
+            free(expired);
+            pool->idle_count--;
+        }
+    }
+}
+
+
+UpstreamPool *find_pool(UpstreamPool **pools, char *host, int port, int create) {
+    /* Finds (or creates) the pool for host:port */
+
+    UpstreamPool *pool;
+    int origin_length = snprintf(NULL, 0, "%s:%d", host, port);
+    char origin[origin_length + 1];
+
+    sprintf(origin, "%s:%d", host, port);
+    HASH_FIND_STR(*pools, origin, pool);
+    if (pool == NULL && create) {
+        if ((pool = (UpstreamPool *) malloc(sizeof(UpstreamPool))) == NULL ||
+                (pool->origin = strdup(origin)) == NULL) {
+            error_out("Couldn't malloc!");
+        }
+        pool->idle = NULL;
+        pool->idle_count = 0;
+        HASH_ADD_KEYPTR(hh, *pools, pool->origin, origin_length, pool);
+    }
+
+    return pool;
+}
+
+
+int server_alive(int sockfd) {
+    /* An idle connection should have nothing to say, if it reads as closed
+     * (or has unexpected data) the server is done with it */
+
+    char byte;
+
+    return recv(sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+           (errno == EAGAIN || errno == EWOULDBLOCK);
+}
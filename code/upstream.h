@@ -0,0 +1,52 @@
+/******************************************************************************
+ *                                                                            *
+ *                      AUTHORS: Annie Chen, Pulkit Jain                      *
+ *                      PURPOSE: Header for the pool of idle keep-alive       *
+ *                               connections to origin servers                *
+ *                                                                            *
+ *****************************************************************************/
+
+
+//
+// Includes and Definitions
+//
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+
+#include "ap_utilities.h"
+
+#define DEFAULT_POOL_IDLE 8      // idle connections kept per origin
+#define DEFAULT_POOL_TIMEOUT 30  // seconds an idle connection is kept
+
+
+//
+// Data Structures
+//
+typedef struct IdleServer {
+    /* An open connection to an origin that is not serving anyone */
+    int sockfd;
+    time_t idle_since;
+    struct IdleServer *next;
+} IdleServer;
+
+typedef struct UpstreamPool {
+    /* Idle connections to one origin, most recently used first */
+    char *origin; // key ("host:port")
+    IdleServer *idle;
+    int idle_count;
+    UT_hash_handle hh;
+} UpstreamPool;
+
+
+//
+// Forward Declarations
+//
+void init_upstream_pool(int max_idle, int idle_timeout);
+int checkout_server(UpstreamPool **pools, char *host, int port);
+int checkin_server(UpstreamPool **pools, char *host, int port, int sockfd);
+void sweep_idle_servers(UpstreamPool **pools);
+
+
+#endif /* UPSTREAM_H */